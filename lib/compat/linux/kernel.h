@@ -0,0 +1,10 @@
+#include <linux/types.h>
+
+#ifndef __PROCON_COMPAT_KERNEL_H__
+#define __PROCON_COMPAT_KERNEL_H__
+
+// The parts of the kernel's kernel.h the shared protocol code uses.
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+#define BIT(nr) (1UL << (nr))
+
+#endif
@@ -0,0 +1,10 @@
+#include_next <linux/types.h>
+
+#ifndef __PROCON_COMPAT_TYPES_H__
+#define __PROCON_COMPAT_TYPES_H__
+
+// The kernel gets these from its own types.h.
+#include <stdbool.h>
+#include <stddef.h>
+
+#endif
@@ -0,0 +1,174 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hids.h"
+#include "packet.h"
+#include "procon-devices.h"
+#include "procon-hidraw.h"
+
+// Prints the reports of a controller on /dev/hidrawN, or decodes a recorded trace and times it.
+// A trace has one input report per line in hex, lines starting with # are skipped.
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s /dev/hidrawN\n", name);
+    fprintf(stderr, "       %s --replay TRACE [procon|joycon-left|joycon-right]\n", name);
+}
+
+static void print_report(void *data, const struct input_response *resp) {
+    printf("%02x buttons=%06x lx=%d ly=%d rx=%d ry=%d", resp->report_id, resp->buttons,
+        resp->sticks[PROCON_AXIS_LX], resp->sticks[PROCON_AXIS_LY],
+        resp->sticks[PROCON_AXIS_RX], resp->sticks[PROCON_AXIS_RY]);
+
+    if (resp->report_id == 0x21) {
+        printf(" ack=%02x subcommand=%02x", resp->subcommand_ack, resp->subcommand_id);
+    }
+    printf("\n");
+}
+
+static void count_report(void *data, const struct input_response *resp) {
+    (*(unsigned long *) data)++;
+}
+
+static __u64 now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (__u64) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Parses one line of hex into buf. Returns the number of bytes, -1 on garbage.
+static int parse_hex(const char *line, __u8 *buf, size_t size) {
+    size_t len = 0;
+    unsigned int byte;
+    int used;
+
+    while (*line != '\0' && *line != '\n') {
+        if (*line == ' ' || *line == '\t' || *line == '\r') {
+            line++;
+            continue;
+        }
+
+        if (len == size || sscanf(line, "%2x%n", &byte, &used) != 1 || used != 2) {
+            return -1;
+        }
+
+        buf[len++] = byte;
+        line += used;
+    }
+
+    return len;
+}
+
+static int replay(const char *path, const struct procon_device_desc *desc) {
+    __u8 (*reports)[PROCON_HIDRAW_REPORT_LENGTH] = NULL;
+    size_t *lengths = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    struct procon_hidraw h;
+    unsigned long seen = 0;
+    char line[4096];
+    __u64 start;
+    __u64 ns;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return 1;
+    }
+
+    // Load the whole trace first, so only decoding gets timed.
+    while (fgets(line, sizeof(line), f) != NULL) {
+        int len;
+
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+
+        if (count == capacity) {
+            capacity = capacity == 0 ? 1024 : capacity * 2;
+            reports = realloc(reports, capacity * sizeof(*reports));
+            lengths = realloc(lengths, capacity * sizeof(*lengths));
+            if (reports == NULL || lengths == NULL) {
+                fprintf(stderr, "Out of memory.\n");
+                return 1;
+            }
+        }
+
+        len = parse_hex(line, reports[count], PROCON_HIDRAW_REPORT_LENGTH);
+        if (len <= 0) {
+            fprintf(stderr, "Skipping malformed line %zu.\n", count + 1);
+            continue;
+        }
+
+        lengths[count++] = len;
+    }
+    fclose(f);
+
+    procon_hidraw_init_replay(&h, desc, count_report, &seen);
+
+    start = now_ns();
+    for (size_t i = 0; i < count; i++) {
+        procon_hidraw_feed(&h, reports[i], lengths[i]);
+    }
+    ns = now_ns() - start;
+
+    printf("reports %zu\ndecoded %lu\ndecode_errors %lu\ntotal_ns %llu\nns_per_report %llu\n", count, seen,
+        h.decode_errors, (unsigned long long) ns, (unsigned long long) (count > 0 ? ns / count : 0));
+    printf("calibration %s\n", h.calibration_valid ? "trace" : "default");
+
+    free(reports);
+    free(lengths);
+    return 0;
+}
+
+static int live(const char *path) {
+    struct procon_hidraw h;
+    int ret;
+
+    ret = procon_hidraw_open(&h, path, print_report, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "Could not open %s: %s.\n", path, strerror(-ret));
+        return 1;
+    }
+
+    fprintf(stderr, "%s on bus %u.\n", h.desc->name, h.bus);
+
+    ret = procon_hidraw_start(&h);
+    while (ret >= 0) {
+        ret = procon_hidraw_dispatch(&h, -1);
+    }
+
+    fprintf(stderr, "Stopped: %s. %lu reports in %lu batches, %lu subcommands timed out.\n", strerror(-ret),
+        h.reports, h.batches, h.timeouts);
+
+    procon_hidraw_close(&h);
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    const struct procon_device_desc *desc = &procon_desc_procon;
+
+    if (argc >= 3 && strcmp(argv[1], "--replay") == 0) {
+        if (argc >= 4 && strcmp(argv[3], "joycon-left") == 0) {
+            desc = &procon_desc_joycon_left;
+        } else if (argc >= 4 && strcmp(argv[3], "joycon-right") == 0) {
+            desc = &procon_desc_joycon_right;
+        } else if (argc >= 4 && strcmp(argv[3], "procon") != 0) {
+            usage(argv[0]);
+            return 2;
+        }
+
+        return replay(argv[2], desc);
+    }
+
+    if (argc != 2 || argv[1][0] == '-') {
+        usage(argv[0]);
+        return 2;
+    }
+
+    return live(argv[1]);
+}
@@ -0,0 +1,347 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <linux/hidraw.h>
+#include <linux/input.h>
+
+#include "commands.h"
+#include "hids.h"
+#include "packet.h"
+#include "procon-devices.h"
+#include "procon-hidraw.h"
+
+// Over USB every output report is a full 64 byte frame, as in send_message_raw().
+#define PROCON_HIDRAW_USB_REPORT_LENGTH 64
+
+static void procon_hidraw_reset(struct procon_hidraw *h, procon_hidraw_report_fn report, void *data) {
+    memset(h, 0, sizeof(*h));
+
+    h->fd = -1;
+    h->epoll_fd = -1;
+    h->timer_fd = -1;
+    h->report = report;
+    h->report_data = data;
+
+    procon_calibration_default(&h->calibration);
+}
+
+static int procon_hidraw_arm(struct procon_hidraw *h, unsigned int ms) {
+    struct itimerspec spec = {0};
+
+    if (h->timer_fd < 0) {
+        return 0;
+    }
+
+    spec.it_value.tv_sec = ms / 1000;
+    spec.it_value.tv_nsec = (ms % 1000) * 1000000L;
+
+    return timerfd_settime(h->timer_fd, 0, &spec, NULL) < 0 ? -errno : 0;
+}
+
+// Sends the next output report, unless one is still in flight.
+static int procon_hidraw_pump(struct procon_hidraw *h) {
+    __u8 buf[PROCON_HIDRAW_USB_REPORT_LENGTH] = {0};
+    struct procon_hidraw_output *o;
+    size_t len;
+
+    if (h->busy || h->count == 0) {
+        return 0;
+    }
+
+    // Nothing to talk to when replaying.
+    if (h->fd < 0) {
+        h->count = 0;
+        return 0;
+    }
+
+    o = &h->queue[h->head];
+    h->head = (h->head + 1) % PROCON_HIDRAW_QUEUE_LEN;
+    h->count--;
+
+    memcpy(buf, o->data, o->len);
+    len = o->len;
+    if (h->bus == BUS_USB && len < PROCON_HIDRAW_USB_REPORT_LENGTH) {
+        len = PROCON_HIDRAW_USB_REPORT_LENGTH;
+    }
+
+    if (write(h->fd, buf, len) < 0) {
+        return -errno;
+    }
+
+    h->busy = true;
+    h->waiting = o->subcommand;
+
+    return procon_hidraw_arm(h, MAX_SUBCMD_RATE_MS);
+}
+
+static int procon_hidraw_queue(struct procon_hidraw *h, const __u8 *data, size_t len, __u8 subcommand) {
+    struct procon_hidraw_output *o;
+
+    if (h->count == PROCON_HIDRAW_QUEUE_LEN) {
+        return -ENOSPC;
+    }
+
+    o = &h->queue[(h->head + h->count) % PROCON_HIDRAW_QUEUE_LEN];
+    memcpy(o->data, data, len);
+    o->len = len;
+    o->subcommand = subcommand;
+    h->count++;
+
+    return procon_hidraw_pump(h);
+}
+
+int procon_hidraw_send(struct procon_hidraw *h, const struct packet *p) {
+    struct packet out = *p;
+
+    out.packet_num = h->packet_num;
+    h->packet_num = (h->packet_num + 1) & 0x0F;
+
+    // Rumble only commands are truncated to 11 bytes and get no reply.
+    if (out.command == PROCON_CMD_RUMBLE) {
+        return procon_hidraw_queue(h, (const __u8 *) &out, 0xB, 0);
+    }
+
+    return procon_hidraw_queue(h, (const __u8 *) &out, sizeof(out), out.subcommand);
+}
+
+// Queues what procon_init_device() sends, then switches to full reports.
+int procon_hidraw_start(struct procon_hidraw *h) {
+    struct packet setup[PROCON_SETUP_PACKETS];
+    size_t setup_count;
+    __u8 mode_arg[] = {0x30};
+    struct packet p;
+    int ret;
+
+    for (size_t i = 0; i < procon_handshake_length; i++) {
+        if (procon_handshake[i].usb_only && h->bus != BUS_USB) {
+            continue;
+        }
+
+        ret = procon_hidraw_queue(h, procon_handshake[i].data, sizeof(procon_handshake[i].data), 0);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    init_packet(&p, PROCON_CMD_COMMAND_AND_RUMBLE, PROCON_SUB_REQUEST_INFO, NULL, 0);
+    ret = procon_hidraw_send(h, &p);
+    if (ret < 0) {
+        return ret;
+    }
+
+    init_spi_read_packet(&p, PROCON_SPI_STICK_CALIBRATION, PROCON_SPI_STICK_CALIBRATION_LENGTH);
+    ret = procon_hidraw_send(h, &p);
+    if (ret < 0) {
+        return ret;
+    }
+
+    setup_count = init_setup_packets(setup, PROCON_SETUP_PACKETS, false);
+    for (size_t i = 0; i < setup_count; i++) {
+        ret = procon_hidraw_send(h, &setup[i]);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    init_packet(&p, PROCON_CMD_COMMAND_AND_RUMBLE, PROCON_SUB_SET_REPORT_MODE, mode_arg, sizeof(mode_arg));
+    return procon_hidraw_send(h, &p);
+}
+
+static void procon_hidraw_reply(struct procon_hidraw *h, const struct input_response *resp) {
+    if (resp->subcommand_id == PROCON_SUB_REQUEST_INFO) {
+        decode_device_information(&h->info, resp->subcommand_reply, 12);
+    } else if (resp->subcommand_id == PROCON_SUB_READ_SPI) {
+        __u8 buf[0x1d] = {0};
+
+        decode_spi_read(buf, resp->subcommand_reply, 0x1d);
+        if (decode_spi_address(resp->subcommand_reply) == PROCON_SPI_STICK_CALIBRATION &&
+            decode_stick_calibration(&h->calibration, buf, resp->subcommand_reply[4]) == 0) {
+            h->calibration_valid = true;
+        }
+    }
+
+    // The reply ends the pause, the next subcommand can go.
+    if (h->busy && resp->subcommand_id == h->waiting) {
+        h->busy = false;
+        h->waiting = 0;
+        procon_hidraw_arm(h, 0);
+        procon_hidraw_pump(h);
+    }
+}
+
+// Handles one input report, from the device or from a recorded trace.
+int procon_hidraw_feed(struct procon_hidraw *h, const __u8 *data, size_t len) {
+    struct input_response resp;
+
+    if (decode_message(&resp, data, len, h->desc, &h->calibration)) {
+        h->decode_errors++;
+        return -EINVAL;
+    }
+
+    if (resp.report_id == 0x21) {
+        procon_hidraw_reply(h, &resp);
+    }
+
+    h->reports++;
+    if (h->report != NULL) {
+        h->report(h->report_data, &resp);
+    }
+
+    return 0;
+}
+
+void procon_hidraw_init_replay(struct procon_hidraw *h, const struct procon_device_desc *desc, procon_hidraw_report_fn report, void *data) {
+    procon_hidraw_reset(h, report, data);
+    h->desc = desc;
+}
+
+int procon_hidraw_open(struct procon_hidraw *h, const char *path, procon_hidraw_report_fn report, void *data) {
+    struct hidraw_devinfo info;
+    struct epoll_event ev = {0};
+    int ret;
+
+    procon_hidraw_reset(h, report, data);
+
+    h->fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (h->fd < 0) {
+        return -errno;
+    }
+
+    if (ioctl(h->fd, HIDIOCGRAWINFO, &info) < 0) {
+        ret = -errno;
+        goto err_close;
+    }
+
+    h->desc = info.vendor == VENDOR_NINTENDO ? procon_device_desc(info.product) : NULL;
+    if (h->desc == NULL) {
+        ret = -ENODEV;
+        goto err_close;
+    }
+    h->bus = info.bustype;
+
+    h->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    h->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (h->timer_fd < 0 || h->epoll_fd < 0) {
+        ret = -errno;
+        goto err_close;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.fd = h->fd;
+    if (epoll_ctl(h->epoll_fd, EPOLL_CTL_ADD, h->fd, &ev) < 0) {
+        ret = -errno;
+        goto err_close;
+    }
+
+    ev.data.fd = h->timer_fd;
+    if (epoll_ctl(h->epoll_fd, EPOLL_CTL_ADD, h->timer_fd, &ev) < 0) {
+        ret = -errno;
+        goto err_close;
+    }
+
+    return 0;
+
+err_close:
+    procon_hidraw_close(h);
+    return ret;
+}
+
+// Reads everything that is there, up to a batch, without going back to epoll in between.
+static int procon_hidraw_read(struct procon_hidraw *h) {
+    __u8 buf[PROCON_HIDRAW_REPORT_LENGTH];
+    int reports = 0;
+    ssize_t len;
+
+    while (reports < PROCON_HIDRAW_BATCH) {
+        len = read(h->fd, buf, sizeof(buf));
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                break;
+            }
+
+            return -errno;
+        }
+
+        procon_hidraw_feed(h, buf, len);
+        reports++;
+    }
+
+    h->batches++;
+    return reports;
+}
+
+// The pause after an output report ran out.
+static int procon_hidraw_expired(struct procon_hidraw *h) {
+    __u64 expirations;
+
+    if (read(h->timer_fd, &expirations, sizeof(expirations)) < 0) {
+        return errno == EAGAIN ? 0 : -errno;
+    }
+
+    if (!h->busy) {
+        return 0;
+    }
+
+    if (h->waiting != 0) {
+        h->timeouts++;
+    }
+
+    h->busy = false;
+    h->waiting = 0;
+
+    return procon_hidraw_pump(h);
+}
+
+// Waits up to timeout_ms for something to do. Returns the number of reports handled.
+int procon_hidraw_dispatch(struct procon_hidraw *h, int timeout_ms) {
+    struct epoll_event events[2];
+    int reports = 0;
+    int ret;
+    int n;
+
+    n = epoll_wait(h->epoll_fd, events, 2, timeout_ms);
+    if (n < 0) {
+        return errno == EINTR ? 0 : -errno;
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (events[i].data.fd == h->timer_fd) {
+            ret = procon_hidraw_expired(h);
+        } else if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+            ret = -ENODEV;
+        } else {
+            ret = procon_hidraw_read(h);
+            if (ret > 0) {
+                reports += ret;
+            }
+        }
+
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return reports;
+}
+
+void procon_hidraw_close(struct procon_hidraw *h) {
+    if (h->epoll_fd >= 0) {
+        close(h->epoll_fd);
+    }
+
+    if (h->timer_fd >= 0) {
+        close(h->timer_fd);
+    }
+
+    if (h->fd >= 0) {
+        close(h->fd);
+    }
+
+    h->fd = -1;
+    h->epoll_fd = -1;
+    h->timer_fd = -1;
+}
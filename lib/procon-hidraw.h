@@ -0,0 +1,73 @@
+#include <linux/types.h>
+
+#include "packet.h"
+#include "procon-devices.h"
+
+#ifndef __PROCON_HIDRAW_H__
+#define __PROCON_HIDRAW_H__
+
+// Talks to a controller through /dev/hidrawN, with the same protocol code as the module.
+// Everything is nonblocking, procon_hidraw_dispatch() waits on the device and the pacing timer.
+
+// Number of output reports that can wait for their turn.
+#define PROCON_HIDRAW_QUEUE_LEN 16
+
+// Longest input report, a 0x31 report with MCU data.
+#define PROCON_HIDRAW_REPORT_LENGTH 362
+
+// Reports read in one go before going back to epoll.
+#define PROCON_HIDRAW_BATCH 16
+
+// Called for every decoded input report, subcommand replies included.
+typedef void (*procon_hidraw_report_fn)(void *data, const struct input_response *resp);
+
+struct procon_hidraw_output {
+    __u8 data[sizeof(struct packet)];
+    size_t len;
+    __u8 subcommand; // Reply that ends the pause after it, 0 when only the pause does.
+};
+
+struct procon_hidraw {
+    int fd; // -1 when replaying a trace.
+    int epoll_fd;
+    int timer_fd;
+    __u32 bus;
+
+    const struct procon_device_desc *desc;
+    struct procon_calibration calibration;
+    struct controller_info info;
+    bool calibration_valid;
+
+    procon_hidraw_report_fn report;
+    void *report_data;
+
+    // Output queue. Only one report is in flight, like the module without its adaptive pacing.
+    struct procon_hidraw_output queue[PROCON_HIDRAW_QUEUE_LEN];
+    unsigned int head;
+    unsigned int count;
+    bool busy; // Something went out and neither its reply nor MAX_SUBCMD_RATE_MS came yet.
+    __u8 waiting; // Subcommand of the report in flight.
+    __u8 packet_num;
+
+    // Statistics.
+    unsigned long reports;
+    unsigned long batches;
+    unsigned long decode_errors;
+    unsigned long timeouts; // Subcommands that were not acked in time.
+};
+
+int procon_hidraw_open(struct procon_hidraw *h, const char *path, procon_hidraw_report_fn report, void *data);
+
+void procon_hidraw_init_replay(struct procon_hidraw *h, const struct procon_device_desc *desc, procon_hidraw_report_fn report, void *data);
+
+int procon_hidraw_start(struct procon_hidraw *h);
+
+int procon_hidraw_send(struct procon_hidraw *h, const struct packet *p);
+
+int procon_hidraw_feed(struct procon_hidraw *h, const __u8 *data, size_t len);
+
+int procon_hidraw_dispatch(struct procon_hidraw *h, int timeout_ms);
+
+void procon_hidraw_close(struct procon_hidraw *h);
+
+#endif
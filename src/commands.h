@@ -6,6 +6,7 @@
 // Commands.
 const static __u8 PROCON_CMD_COMMAND_AND_RUMBLE = 0x01;
 const static __u8 PROCON_CMD_RUMBLE = 0x10;
+const static __u8 PROCON_CMD_MCU = 0x11; // Request or ack of MCU data, with rumble.
 
 // Subcommands.
 const static __u8 PROCON_SUB_GET_CONTROLLER_STATE = 0x00;
@@ -14,6 +15,8 @@ const static __u8 PROCON_SUB_SET_REPORT_MODE = 0x03;
 const static __u8 PROCON_SUB_GET_TRIGGER_TIME = 0x04;
 const static __u8 PROCON_SUB_SET_POWER_STATE = 0x08;
 const static __u8 PROCON_SUB_READ_SPI = 0x10;
+const static __u8 PROCON_SUB_SET_MCU_CONFIG = 0x21;
+const static __u8 PROCON_SUB_SET_MCU_STATE = 0x22;
 const static __u8 PROCON_SUB_SET_LIGHT = 0x30;
 const static __u8 PROCON_SUB_SET_IMU = 0x40;
 const static __u8 PROCON_SUB_SET_VIBRATION = 0x48;
@@ -10,7 +10,11 @@
 #include <linux/delay.h>
 #include <linux/jiffies.h>
 #include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 #include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
 
 #include "hids.h"
 #include "commands.h"
@@ -18,43 +22,27 @@
 #include "procon-print.h"
 #include "procon-controller.h"
 #include "procon-input.h"
-#include "util.h"
+#include "procon-output.h"
+#include "procon-debugfs.h"
+#include "procon-pair.h"
+#include "procon-stream.h"
+#include "procon-stick.h"
+#include "procon-battery.h"
+#include "procon-keymap.h"
+#include "procon-profile.h"
+#include "procon-bpf.h"
+#include "procon-mcu.h"
+#include "procon-gyro.h"
+#include "procon-virtual.h"
+#include "procon-probe.h"
+#include "procon-cache.h"
+#include "procon-slot.h"
+#include "procon-devices.h"
+#include "procon-compat.h"
 
-#define MAX_CONTROLLER_SUPPORT 8
 #define MAX_LIGHT_SUPPORT 4
-#define CHARS_NEEDED_FOR_CONTROLLER_ID 1
-
-static unsigned int MAX_SUBCMD_RATE_MS = 70;
-
-static bool controller_spots[MAX_CONTROLLER_SUPPORT] = {};
-struct controller *connected_controllers[MAX_CONTROLLER_SUPPORT] = {};
 
 struct proc_dir_entry *procon_proc_dir = NULL;
-struct proc_dir_entry *procon_player_dirs[MAX_CONTROLLER_SUPPORT] = {};
-
-void enforce_baudrate(struct controller *c) {
-    unsigned int current_ms = jiffies_to_msecs(jiffies);
-	unsigned int delta_ms = current_ms - c->time_last_cmd_sent;
-
-	while (delta_ms < MAX_SUBCMD_RATE_MS) {
-		mdelay(5);
-        current_ms = jiffies_to_msecs(jiffies);
-		delta_ms = current_ms - c->time_last_cmd_sent;
-	}
-
-	c->time_last_cmd_sent = current_ms;
-}
-
-int get_next_free_controller(void) {
-    for (int i = 0; i < MAX_CONTROLLER_SUPPORT; i++) {
-        if (controller_spots[i]) {
-            controller_spots[i] = false;
-            return i;
-        }
-    }
-
-    return -1;
-}
 
 __u8 get_player_led_arg(__u8 player_id) {
     switch (player_id) {
@@ -74,410 +62,687 @@ __u8 get_player_led_arg(__u8 player_id) {
     return PROCON_LED_FLASH_4;
 }
 
-int send_message_raw(struct hid_device *hdev, __u8 *data, size_t len) {
-    __u8 *buf;
+int set_player_led(struct controller *c, __u8 led_information) {
     int ret;
+    struct packet p;
 
-    // Try to allocate enough memory to send the message.
-    buf = kmemdup(data, len, GFP_KERNEL);
-    if (buf == NULL) {
-        return -ENOMEM;
+    __u8 light_arg[1] = {led_information};
+    init_packet(&p, PROCON_CMD_COMMAND_AND_RUMBLE, PROCON_SUB_SET_LIGHT, light_arg, sizeof(light_arg));
+    
+    ret = send_message(c, &p);
+    if (ret < 0) {
+        return ret;
     }
 
-    // Send the message.
-    ret = hid_hw_output_report(hdev, buf, len);
+    return 0;
+}
 
-    // Free the buffer.
-    kfree(buf);
+struct controller *procon_proc_get_controller(struct file *file) {
+    // Every proc file of a controller is created with the controller as its data.
+    return pde_data(file_inode(file));
+}
+
+// Pollers of all controllers share one queue, it outlives any controller that goes away under them.
+static DECLARE_WAIT_QUEUE_HEAD(procon_proc_wait);
+
+// Tells pollers of the info, led and lpm files that their contents changed.
+void procon_proc_notify(struct controller *c) {
+    atomic_inc(&c->proc_event);
+    wake_up_interruptible(&procon_proc_wait);
+}
+
+// Opens a seq_file that only counts changes made after it was opened.
+int procon_proc_single_open(struct file *file, int (*show)(struct seq_file *, void *)) {
+    struct controller *c = procon_proc_get_controller(file);
+    struct seq_file *m;
+    int ret;
 
+    if (c == NULL) {
+        return -ENODEV;
+    }
+
+    ret = single_open(file, show, c);
     if (ret < 0) {
-        pr_warn("Failed to send message to device: %d\n", ret);
+        return ret;
+    }
+
+    m = file->private_data;
+    m->poll_event = atomic_read(&c->proc_event);
+
+    return 0;
+}
+
+// Readable as always, with EPOLLPRI once the contents changed since the last poll.
+// Seek back to the start and read again to get the new contents.
+__poll_t procon_proc_poll(struct file *file, poll_table *wait) {
+    struct seq_file *m = file->private_data;
+    struct controller *c = m->private;
+    __poll_t ret = DEFAULT_POLLMASK;
+    int event;
+
+    poll_wait(file, &procon_proc_wait, wait);
+
+    event = atomic_read(&c->proc_event);
+    if (m->poll_event != event) {
+        m->poll_event = event;
+        ret |= EPOLLERR | EPOLLPRI;
     }
 
     return ret;
 }
 
-int send_message(struct controller *c, struct packet *p) {
-    size_t len = 0x40;
-    int ret = 0;
+int procon_proc_show_player_led(struct seq_file *m, void *v) {
+    struct controller *c = m->private;
 
-    // Set the packet number.
-    p->packet_num = c->current_packet_num++;
-    if (c->current_packet_num > 0x0F) {
-        c->current_packet_num = 0x00;
+    seq_printf(m, "%d\n", READ_ONCE(c->player_indicator));
+
+    return 0;
+}
+
+int procon_proc_open_player_led(struct inode *file_info, struct file *file) {
+    return procon_proc_single_open(file, procon_proc_show_player_led);
+}
+
+ssize_t procon_proc_set_player_led(struct file *file, const char __user *buffer, size_t len, loff_t *offset) {
+    struct controller *c = ((struct seq_file *) file->private_data)->private;
+    int player_led;
+    int ret;
+
+    ret = kstrtoint_from_user(buffer, len, 10, &player_led);
+    if (ret < 0) {
+        return ret;
     }
 
-    // If the packet is a rumble only command, truncate the message to 11 bytes.
-    if (p->command == PROCON_CMD_RUMBLE) {
-        len = 0xB;
+    if (player_led < 0 || player_led > MAX_LIGHT_SUPPORT) {
+        return -EINVAL;
     }
 
-    // Wait until we can send.
-    enforce_baudrate(c);
+    ret = set_player_led(c, get_player_led_arg(player_led));
+    if (ret < 0) {
+        pr_err("Could not set LED.\n");
+        return ret;
+    }
 
-    // Wait a bit longer if the mutex is locked.
-    mutex_lock(&c->lock);
+    if (READ_ONCE(c->player_indicator) != player_led) {
+        WRITE_ONCE(c->player_indicator, player_led);
+        procon_proc_notify(c);
+    }
 
-    ret = send_message_raw(c->handler, (__u8*) p, len);
+    return len;
+}
 
-    // Unlock the mutex and return.
-    mutex_unlock(&c->lock);
-    return ret;
+void procon_proc_create_player_indicator(struct controller *c) {
+    static struct proc_ops ops = {
+        .proc_open = procon_proc_open_player_led,
+        .proc_release = single_release,
+        .proc_read = seq_read,
+        .proc_write = procon_proc_set_player_led,
+        .proc_lseek = seq_lseek,
+        .proc_poll = procon_proc_poll,
+    };
+
+    struct proc_dir_entry *proc_entry;
+
+    proc_entry = proc_create_data("led", 0666, c->proc_dir, &ops, c);
+    if (proc_entry == NULL) {
+        pr_err("Cannot create led proc file!\n");
+        return;
+    }
 }
 
-int set_player_led(struct controller *c, __u8 led_information) {
+int procon_proc_show_low_power_mode(struct seq_file *m, void *v) {
+    struct controller *c = m->private;
+
+    seq_printf(m, "%d\n", READ_ONCE(c->info.low_power_mode));
+
+    return 0;
+}
+
+int procon_proc_open_low_power_mode(struct inode *file_info, struct file *file) {
+    return procon_proc_single_open(file, procon_proc_show_low_power_mode);
+}
+
+ssize_t procon_proc_set_low_power_mode(struct file *file, const char __user *buffer, size_t len, loff_t *offset) {
+    struct controller *c = ((struct seq_file *) file->private_data)->private;
+    __u8 lpm_set_args[1] = {0};
+    __u8 lpm_read_args[] = {0x00, 0x50, 0x00, 0x00, 0x01};
+    int enable;
     int ret;
     struct packet p;
 
-    __u8 light_arg[1] = {led_information};
-    init_packet(&p, PROCON_CMD_COMMAND_AND_RUMBLE, PROCON_SUB_SET_LIGHT, light_arg, sizeof(light_arg));
-    
-    ret = send_message(c, &p);
+    ret = kstrtoint_from_user(buffer, len, 10, &enable);
     if (ret < 0) {
         return ret;
     }
 
-    return 0;
+    lpm_set_args[0] = enable == 1 ? 0x1 : 0x0;
+
+    // Send new lower power mode to controller.
+    init_packet(&p, PROCON_CMD_COMMAND_AND_RUMBLE, PROCON_SUB_SET_POWER_STATE, lpm_set_args, sizeof(lpm_set_args));
+    send_message(c, &p);
+
+    // Also request new controller info. Pollers hear about it once the reply is in.
+    init_packet(&p, PROCON_CMD_COMMAND_AND_RUMBLE, PROCON_SUB_READ_SPI, lpm_read_args, sizeof(lpm_read_args));
+    send_message(c, &p);
+
+    return len;
 }
 
-int procon_proc_init(struct inode *file_info, struct file *file) {
-    int controller_id = -1;
-    const unsigned char *path = file->f_path.dentry->d_parent->d_name.name;
-    struct controller *c;
+void procon_proc_create_low_power_mode(struct controller *c) {
+    static struct proc_ops ops = {
+        .proc_open = procon_proc_open_low_power_mode,
+        .proc_release = single_release,
+        .proc_read = seq_read,
+        .proc_write = procon_proc_set_low_power_mode,
+        .proc_lseek = seq_lseek,
+        .proc_poll = procon_proc_poll,
+    };
 
-    // Try to get the connected controller id form the proc file path.
-    // This should work, since the proc files are created in the form:
-    // /proc/procon/player<n>/<file>
-    if (sscanf(path, "controller%d", &controller_id) == 0) {
-        pr_err("Could not get controller id from path: %s\n", path);
-        return 1;
-    }
+    struct proc_dir_entry *proc_entry;
 
-    // Check if player within limits.
-    if (controller_id >= MAX_CONTROLLER_SUPPORT || controller_id < 0) {
-        pr_err("Wrong controller id (%d) in file: %s\n", controller_id, path);
-        return 1;
+    proc_entry = proc_create_data("lpm", 0666, c->proc_dir, &ops, c);
+    if (proc_entry == NULL) {
+        pr_err("Cannot create low power mode proc file!\n");
+        return;
     }
+}
 
-    if (connected_controllers[controller_id] == NULL) {
-        pr_err("Controller %d no longer connected!\n", controller_id);
-        return 1;
-    }
+int procon_proc_show_controller_info(struct seq_file *m, void *v) {
+    struct controller *c = m->private;
+    struct controller_info info;
+    unsigned long flags;
 
-    c = connected_controllers[controller_id];
-    mutex_lock(&c->proc_lock);
+    // Copy the info out, the event path updates it.
+    spin_lock_irqsave(&c->info_lock, flags);
+    info = c->info;
+    spin_unlock_irqrestore(&c->info_lock, flags);
 
-    // Set private data to be used in further functions.
-    file->private_data = connected_controllers[controller_id];
+    seq_printf(m, "Device information\n\nPlayer LED: %d\nFirmware: %d.%d\nType: %s\nMAC: %pM\nLPM: %s\nCM: %s\n",
+        c->player_indicator,
+        info.firmware_version_major, info.firmware_version_minor,
+        format_controller_type(info.controller_type),
+        info.controller_mac_addr,
+        format_lpm(info.low_power_mode),
+        format_colour_mode(info.colour_mode));
 
     return 0;
 }
 
-int procon_proc_exit(struct inode *file_info, struct file *file) {
-    struct controller* c;
+int procon_proc_open_controller_info(struct inode *file_info, struct file *file) {
+    return procon_proc_single_open(file, procon_proc_show_controller_info);
+}
 
-    if (file->private_data == NULL) {
-        pr_err("Private data not set!\n");
-        return 1;
+void procon_proc_create_info(struct controller *c) {
+    static struct proc_ops ops = {
+        .proc_open = procon_proc_open_controller_info,
+        .proc_release = single_release,
+        .proc_read = seq_read,
+        .proc_lseek = seq_lseek,
+        .proc_poll = procon_proc_poll,
+    };
+
+    struct proc_dir_entry *proc_entry;
+
+    proc_entry = proc_create_data("info", 0444, c->proc_dir, &ops, c);
+    if (proc_entry == NULL) {
+        pr_err("Cannot create device info proc file!\n");
+        return;
     }
+}
 
-    c = (struct controller*) file->private_data;
+// Everything a monitor needs in a single read, as one line of key=value pairs.
+int procon_proc_show_state(struct seq_file *m, void *v) {
+    struct controller *c = m->private;
+    struct controller_info info;
+    unsigned long flags;
+
+    spin_lock_irqsave(&c->info_lock, flags);
+    info = c->info;
+    spin_unlock_irqrestore(&c->info_lock, flags);
+
+    seq_printf(m, "fw=%u.%u type=%u mac=%pM lpm=%u mode=%02x idle=%u battery=%u charging=%u rate=%u reports=%u coalesced=%u resyncs=%u decode_errors=%u send_errors=%u\n",
+        info.firmware_version_major, info.firmware_version_minor,
+        info.controller_type,
+        info.controller_mac_addr,
+        info.low_power_mode,
+        READ_ONCE(c->report_mode), READ_ONCE(c->idle),
+        c->battery_level, c->charging,
+        c->report_rate, c->reports_received, c->syncs_coalesced, c->resyncs,
+        c->decode_errors, c->send_errors);
 
-    mutex_unlock(&c->proc_lock);
     return 0;
 }
 
-ssize_t procon_proc_get_player_led(struct file *file, char __user *buffer, size_t len, loff_t *offset) {
-    struct controller *c;
-    char player_indicator[3];
+int procon_proc_open_state(struct inode *file_info, struct file *file) {
+    struct controller *c = procon_proc_get_controller(file);
 
-    if ((int) (*offset) >= sizeof(player_indicator)) {
-        return 0;
+    if (c == NULL) {
+        return -ENODEV;
     }
 
-    if (file->private_data == NULL) {
-        pr_err("Private data not set!\n");
-        return 0;
-    }
+    return single_open(file, procon_proc_show_state, c);
+}
 
-    c = (struct controller*) file->private_data;
-    snprintf(player_indicator, sizeof(player_indicator), "%d\n", c->player_indicator);
+int procon_proc_show_sync_rate(struct seq_file *m, void *v) {
+    struct controller *c = m->private;
 
-    if (copy_to_user(buffer, player_indicator, sizeof(player_indicator))) {
-        pr_err("Failed writing player_id!\n");
-        return 0;
-    }
+    seq_printf(m, "%u\n", READ_ONCE(c->max_sync_rate));
 
-    *offset = sizeof(player_indicator);
-    return sizeof(player_indicator);
+    return 0;
 }
 
-ssize_t procon_proc_set_player_led(struct file *file, const char __user *buffer, size_t len, loff_t *offset) {
-    struct controller *c;
-    char player_indicator[2];
-    int player_led = 0;
+int procon_proc_open_sync_rate(struct inode *file_info, struct file *file) {
+    struct controller *c = procon_proc_get_controller(file);
 
-    if ((int) (*offset) >= sizeof(player_indicator)) {
-        return 0;
+    if (c == NULL) {
+        return -ENODEV;
     }
 
-    if (file->private_data == NULL) {
-        pr_err("Private data not set!\n");
-        return 0;
+    return single_open(file, procon_proc_show_sync_rate, c);
+}
+
+ssize_t procon_proc_set_sync_rate(struct file *file, const char __user *buffer, size_t len, loff_t *offset) {
+    struct controller *c = ((struct seq_file *) file->private_data)->private;
+    unsigned int rate;
+    int ret;
+
+    ret = kstrtouint_from_user(buffer, len, 10, &rate);
+    if (ret < 0) {
+        return ret;
     }
 
-    c = (struct controller*) file->private_data;
-    
-    if (copy_from_user(player_indicator, buffer, sizeof(player_indicator))) {
-        pr_err("Failed reading from user!\n");
-        return 0;
+    // Takes effect on the next report.
+    WRITE_ONCE(c->max_sync_rate, rate);
+
+    return len;
+}
+
+void procon_proc_create_sync_rate(struct controller *c) {
+    static struct proc_ops ops = {
+        .proc_open = procon_proc_open_sync_rate,
+        .proc_release = single_release,
+        .proc_read = seq_read,
+        .proc_write = procon_proc_set_sync_rate,
+        .proc_lseek = seq_lseek,
+    };
+
+    struct proc_dir_entry *proc_entry;
+
+    proc_entry = proc_create_data("sync_rate", 0644, c->proc_dir, &ops, c);
+    if (proc_entry == NULL) {
+        pr_err("Cannot create sync_rate proc file!\n");
+        return;
     }
+}
 
-    if (sscanf(player_indicator, "%d", &player_led) == 0) {
-        return 0;
+int procon_proc_show_sticks(struct seq_file *m, void *v) {
+    procon_stick_show(m, m->private);
+    return 0;
+}
+
+int procon_proc_open_sticks(struct inode *file_info, struct file *file) {
+    struct controller *c = procon_proc_get_controller(file);
+
+    if (c == NULL) {
+        return -ENODEV;
     }
 
-    if (player_led < 0 || player_led > MAX_LIGHT_SUPPORT) {
-        return 0;
+    return single_open(file, procon_proc_show_sticks, c);
+}
+
+ssize_t procon_proc_set_sticks(struct file *file, const char __user *buffer, size_t len, loff_t *offset) {
+    struct controller *c = ((struct seq_file *) file->private_data)->private;
+    char *config;
+    char *cursor;
+    char *line;
+    int ret = 0;
+
+    if (len > PAGE_SIZE) {
+        return -EINVAL;
     }
 
-    if (set_player_led(c, get_player_led_arg(player_led))) {
-        pr_err("Could not set LED.\n");
-        return sizeof(player_indicator);
+    config = memdup_user_nul(buffer, len);
+    if (IS_ERR(config)) {
+        return PTR_ERR(config);
     }
 
-    c->player_indicator = player_led;
+    // One stick per line.
+    cursor = config;
+    while ((line = strsep(&cursor, "\n")) != NULL) {
+        line = strim(line);
+        if (*line == '\0') {
+            continue;
+        }
 
-    *offset = sizeof(player_indicator);
-    return sizeof(player_indicator);
+        ret = procon_stick_configure(c, line);
+        if (ret < 0) {
+            break;
+        }
+    }
+
+    kfree(config);
+    return ret < 0 ? ret : len;
 }
 
-void procon_proc_create_player_indicator(int controller_id) {
+void procon_proc_create_sticks(struct controller *c) {
     static struct proc_ops ops = {
-        .proc_open = procon_proc_init,
-        .proc_release = procon_proc_exit,
-        .proc_read = procon_proc_get_player_led,
-        .proc_write = procon_proc_set_player_led,
+        .proc_open = procon_proc_open_sticks,
+        .proc_release = single_release,
+        .proc_read = seq_read,
+        .proc_write = procon_proc_set_sticks,
+        .proc_lseek = seq_lseek,
     };
 
     struct proc_dir_entry *proc_entry;
 
-    proc_entry = proc_create("led", 0666, procon_player_dirs[controller_id], &ops);
+    proc_entry = proc_create_data("sticks", 0644, c->proc_dir, &ops, c);
     if (proc_entry == NULL) {
-        pr_err("Cannot create led proc file!\n");
+        pr_err("Cannot create sticks proc file!\n");
         return;
     }
 }
 
-ssize_t procon_proc_get_low_power_mode(struct file *file, char __user *buffer, size_t len, loff_t *offset) {
-    struct controller *c;
-    char low_power_mode[3];
+int procon_proc_show_keymap(struct seq_file *m, void *v) {
+    procon_keymap_show(m, m->private);
+    return 0;
+}
 
-    if ((int) (*offset) >= sizeof(low_power_mode)) {
-        return 0;
-    }
+int procon_proc_open_keymap(struct inode *file_info, struct file *file) {
+    struct controller *c = procon_proc_get_controller(file);
 
-    if (file->private_data == NULL) {
-        pr_err("Private data not set!\n");
-        return 0;
+    if (c == NULL) {
+        return -ENODEV;
     }
 
-    c = (struct controller*) file->private_data;
-    snprintf(low_power_mode, sizeof(low_power_mode), "%d\n", c->info->low_power_mode);
+    return single_open(file, procon_proc_show_keymap, c);
+}
 
-    if (copy_to_user(buffer, low_power_mode, sizeof(low_power_mode))) {
-        pr_err("Failed writing low power mode!\n");
-        return 0;
+ssize_t procon_proc_set_keymap(struct file *file, const char __user *buffer, size_t len, loff_t *offset) {
+    struct controller *c = ((struct seq_file *) file->private_data)->private;
+    char *config;
+    int ret;
+
+    if (len > PAGE_SIZE) {
+        return -EINVAL;
     }
 
-    *offset = sizeof(low_power_mode);
-    return sizeof(low_power_mode);
+    config = memdup_user_nul(buffer, len);
+    if (IS_ERR(config)) {
+        return PTR_ERR(config);
+    }
+
+    ret = procon_keymap_configure(c, config);
+
+    kfree(config);
+    return ret < 0 ? ret : len;
 }
 
-ssize_t procon_proc_set_low_power_mode(struct file *file, const char __user *buffer, size_t len, loff_t *offset) {
-    struct controller *c;
-    __u8 lpm_set_args[1] = {0};
-    __u8 lpm_read_args[] = {0x00, 0x50, 0x00, 0x00, 0x01};
-    int enable = 0;
-    char buf[2] = {0};
-    struct packet p;
+void procon_proc_create_keymap(struct controller *c) {
+    static struct proc_ops ops = {
+        .proc_open = procon_proc_open_keymap,
+        .proc_release = single_release,
+        .proc_read = seq_read,
+        .proc_write = procon_proc_set_keymap,
+        .proc_lseek = seq_lseek,
+    };
 
-    if ((int) (*offset) >= sizeof(buf)) {
-        return 0;
-    }
+    struct proc_dir_entry *proc_entry;
 
-    if (file->private_data == NULL) {
-        pr_err("Private data not set!\n");
-        return 0;
+    proc_entry = proc_create_data("keymap", 0644, c->proc_dir, &ops, c);
+    if (proc_entry == NULL) {
+        pr_err("Cannot create keymap proc file!\n");
+        return;
     }
+}
 
-    c = (struct controller*) file->private_data;
+int procon_proc_show_mcu(struct seq_file *m, void *v) {
+    procon_mcu_show(m, m->private);
+    return 0;
+}
 
-    // Copy the user buffer to our buffer and convert to an unsigned integer.
-    if (copy_from_user(buf, buffer, sizeof(buf))) {
-        pr_err("Cannot read data from user!\n");
-        return 0;
-    }
+int procon_proc_open_mcu(struct inode *file_info, struct file *file) {
+    struct controller *c = procon_proc_get_controller(file);
 
-    // Check if user actually sent an int.
-    if (sscanf(buf, "%d", &enable) == 0) {
-        return 0;
+    if (c == NULL) {
+        return -ENODEV;
     }
 
-    lpm_set_args[0] = enable == 1 ? 0x1 : 0x0;
+    return single_open(file, procon_proc_show_mcu, c);
+}
 
-    // Send new lower power mode to controller.
-    init_packet(&p, PROCON_CMD_COMMAND_AND_RUMBLE, PROCON_SUB_SET_POWER_STATE, lpm_set_args, sizeof(lpm_set_args));
-    send_message(c, &p);
+ssize_t procon_proc_set_mcu(struct file *file, const char __user *buffer, size_t len, loff_t *offset) {
+    struct controller *c = ((struct seq_file *) file->private_data)->private;
+    char *config;
+    int ret;
 
-    // Also request new controller info.
-    init_packet(&p, PROCON_CMD_COMMAND_AND_RUMBLE, PROCON_SUB_READ_SPI, lpm_read_args, sizeof(lpm_read_args));
-    send_message(c, &p);
+    if (len > PAGE_SIZE) {
+        return -EINVAL;
+    }
 
-    *offset = sizeof(buf);
-    return sizeof(buf);
+    config = memdup_user_nul(buffer, len);
+    if (IS_ERR(config)) {
+        return PTR_ERR(config);
+    }
+
+    ret = procon_mcu_configure(c, config);
+
+    kfree(config);
+    return ret < 0 ? ret : len;
 }
 
-void procon_proc_create_low_power_mode(int controller_id) {
+// Settings and statistics of the MCU, and the ring of frames it delivers to map.
+void procon_proc_create_mcu(struct controller *c) {
     static struct proc_ops ops = {
-        .proc_open = procon_proc_init,
-        .proc_release = procon_proc_exit,
-        .proc_read = procon_proc_get_low_power_mode,
-        .proc_write = procon_proc_set_low_power_mode,
+        .proc_open = procon_proc_open_mcu,
+        .proc_release = single_release,
+        .proc_read = seq_read,
+        .proc_write = procon_proc_set_mcu,
+        .proc_lseek = seq_lseek,
+    };
+
+    static struct proc_ops frames_ops = {
+        .proc_open = procon_mcu_frames_open,
+        .proc_release = procon_mcu_frames_release,
+        .proc_mmap = procon_mcu_frames_mmap,
+        .proc_poll = procon_mcu_frames_poll,
     };
 
     struct proc_dir_entry *proc_entry;
 
-    proc_entry = proc_create("lpm", 0666, procon_player_dirs[controller_id], &ops);
-    if (proc_entry == NULL) {
-        pr_err("Cannot create low power mode proc file!\n");
+    if (!c->desc->mcu) {
         return;
     }
-}
 
-ssize_t procon_proc_get_controller_info(struct file *file, char __user *buffer, size_t len, loff_t *offset) {
-    struct controller *c;
-    const char fmt[] = "Device information\n\nPlayer LED: %d\nFirmware: %d.%d\nType: %s\nMAC: %s\nLPM: %s\nCM: %s\n";
-
-    // Ret has size of the base format, plus the extremes for each of the format values.
-    // CHARS_NEEDED_FOR_CONTROLLER_ID, for Player LED.
-    // 7 (xxx.xxx), for major.minor
-    // 12 (Right JoyCon), for type
-    // 17, for MAC address
-    // 8 (disabled), for LPM
-    // 7 (default), for CM.
-    // 1 for \00.
-    char ret[sizeof(fmt) + CHARS_NEEDED_FOR_CONTROLLER_ID + 7 + 12 + 17 + 8 + 7 + 1] = {0};
-    char *mac;
-    char *controller_type;
-    char *lpm;
-    char *colour_mode;
-
-    if ((int) (*offset) >= sizeof(ret)) {
-        return 0;
+    proc_entry = proc_create_data("mcu", 0644, c->proc_dir, &ops, c);
+    if (proc_entry == NULL) {
+        pr_err("Cannot create mcu proc file!\n");
+        return;
     }
 
-    if (file->private_data == NULL) {
-        pr_err("Private data not set!\n");
-        return 0;
+    proc_entry = proc_create_data("mcu_frames", 0644, c->proc_dir, &frames_ops, c);
+    if (proc_entry == NULL) {
+        pr_err("Cannot create mcu_frames proc file!\n");
+        return;
     }
+}
 
-    c = (struct controller*) file->private_data;
+int procon_proc_show_gyro(struct seq_file *m, void *v) {
+    procon_gyro_show(m, m->private);
+    return 0;
+}
 
-    mac = format_mac_addr(c->info->controller_mac_addr);
-    if (mac == NULL) {
-        return 0;
-    }
+int procon_proc_open_gyro(struct inode *file_info, struct file *file) {
+    struct controller *c = procon_proc_get_controller(file);
 
-    controller_type = format_controller_type(c->info->controller_type);
-    if (controller_type == NULL) {
-        return 0;
+    if (c == NULL) {
+        return -ENODEV;
     }
 
-    lpm = format_lpm(c->info->low_power_mode);
-    if (lpm == NULL) {
-        return 0;
+    return single_open(file, procon_proc_show_gyro, c);
+}
+
+ssize_t procon_proc_set_gyro(struct file *file, const char __user *buffer, size_t len, loff_t *offset) {
+    struct controller *c = ((struct seq_file *) file->private_data)->private;
+    char *config;
+    int ret;
+
+    if (len > PAGE_SIZE) {
+        return -EINVAL;
     }
 
-    colour_mode = format_colour_mode(c->info->colour_mode);
-    if (colour_mode == NULL) {
-        return 0;
+    config = memdup_user_nul(buffer, len);
+    if (IS_ERR(config)) {
+        return PTR_ERR(config);
     }
 
-    snprintf(ret, sizeof(ret), fmt, c->player_indicator, c->info->firmware_version_major, c->info->firmware_version_minor, controller_type, mac, lpm, colour_mode);
+    ret = procon_gyro_configure(c, config);
 
-    // Free all used variables.
-    kfree(mac);
-    kfree(controller_type);
-    kfree(lpm);
-    kfree(colour_mode);
+    kfree(config);
+    return ret < 0 ? ret : len;
+}
 
-    if(copy_to_user(buffer, ret, sizeof(ret))) {
-        pr_err("Failed writing device information!\n");
-        return 0;
+void procon_proc_create_gyro(struct controller *c) {
+    static struct proc_ops ops = {
+        .proc_open = procon_proc_open_gyro,
+        .proc_release = single_release,
+        .proc_read = seq_read,
+        .proc_write = procon_proc_set_gyro,
+        .proc_lseek = seq_lseek,
+    };
+
+    struct proc_dir_entry *proc_entry;
+
+    proc_entry = proc_create_data("gyro", 0644, c->proc_dir, &ops, c);
+    if (proc_entry == NULL) {
+        pr_err("Cannot create gyro proc file!\n");
+        return;
     }
-    
-    *offset = sizeof(ret);
-    return sizeof(ret);
 }
 
-void procon_proc_create_info(int controller_id) {
+void procon_proc_create_state(struct controller *c) {
     static struct proc_ops ops = {
-        .proc_open = procon_proc_init,
-        .proc_release = procon_proc_exit,
-        .proc_read = procon_proc_get_controller_info,
+        .proc_open = procon_proc_open_state,
+        .proc_release = single_release,
+        .proc_read = seq_read,
+        .proc_lseek = seq_lseek,
     };
 
     struct proc_dir_entry *proc_entry;
 
-    proc_entry = proc_create("info", 0444, procon_player_dirs[controller_id], &ops);
+    proc_entry = proc_create_data("state", 0444, c->proc_dir, &ops, c);
     if (proc_entry == NULL) {
-        pr_err("Cannot create device info proc file!\n");
+        pr_err("Cannot create state proc file!\n");
         return;
     }
 }
 
+// Reads the stick calibration and the low power mode from flash.
+int procon_read_flash(struct controller *c) {
+    struct packet p;
+    int ret;
+
+    // Fetch the current controller calibration.
+    init_spi_read_packet(&p, PROCON_SPI_STICK_CALIBRATION, PROCON_SPI_STICK_CALIBRATION_LENGTH);
+    ret = send_message(c, &p);
+    if (ret < 0) {
+        pr_err("Failed to request controller calibration: %d.\n", ret);
+        return ret;
+    }
+
+    // Fetch LPM mode.
+    init_spi_read_packet(&p, PROCON_SPI_LPM, 0x01);
+    ret = send_message(c, &p);
+    if (ret < 0) {
+        pr_err("Failed to read LPM information: %d.\n", ret);
+        return ret;
+    }
+
+    return 0;
+}
+
 int procon_init_device(struct hid_device *hdev, const struct hid_device_id *id) {
     int ret;
 
     struct controller *c;
-    int controller_id = get_next_free_controller();
+    int controller_id;
+    bool cached;
 
-    __u8 handshake[] = {0x80, 0x02};
-    __u8 baudrate_increase[] = {0x80, 0x03};
-    __u8 calibration_args[] = {};
-    __u8 lpm_read_args[] = {0x00, 0x50, 0x00, 0x00, 0x01};
-    __u8 report_mode_args[] = {0x30};
+    struct packet p;
+    struct packet setup[PROCON_SETUP_PACKETS];
+    size_t setup_count;
+    char controller_name[24];
 
-    __u8 disable_arg[] = {0x00};
-    __u8 enable_arg[] = {0x01};
+    // Probe has started.
+    pr_info("Probe started for: %s [%x:%x].\n", hdev->name, id->vendor, id->product);
 
-    struct packet p;
-    char* controller_name;
+    // Initialise controller struct, the info and MAC address live inside of it.
+    // This has to happen before starting the device, since reports can arrive right away.
+    c = devm_kzalloc(&hdev->dev, sizeof(struct controller), GFP_KERNEL);
+    if (c == NULL) {
+        ret = -ENOMEM;
+        goto err_ret;
+    }
 
-    // Check if there is a controller slot available.
-    if (controller_id == -1) {
-        pr_err("Driver does not support more than %d controllers!", MAX_CONTROLLER_SUPPORT);
-        ret = -1;
+    c->handler = hdev;
+    c->desc = procon_device_desc(hdev->product);
+    procon_probe_begin(c);
+
+    // Check if there is a controller slot available, or one kept for this controller.
+    ret = procon_slot_alloc(c);
+    if (ret < 0) {
         goto err_ret;
     }
 
-    // Probe has started.
-    pr_info("Probe started for: %s [%x:%x].\n", hdev->name, id->vendor, id->product);
+    controller_id = c->controller_id;
+
+    mutex_init(&c->lock);
+    spin_lock_init(&c->info_lock);
+    atomic_set(&c->proc_event, 0);
+    procon_input_init(c);
+    procon_stick_init(c);
+    procon_keymap_init(c);
+    procon_battery_init(c);
+    procon_stream_init(c);
+    procon_mcu_init(c);
+    procon_gyro_init(c);
+
+    c->player_indicator = 0;
+    c->current_packet_num = 0;
+    c->rate_window_start = jiffies;
+    
+    procon_calibration_default(&c->calibration);
+
+    // A controller seen before does not need its flash read again.
+    // Its info is still asked for, the reply tells whether the cached data is still good.
+    // Looked up before the event path can see the controller, which reads the calibration.
+    cached = procon_cache_lookup(c);
+    c->cached = cached;
+
+    hid_set_drvdata(hdev, c);
+
+    // Let the output scheduler know about the controller.
+    ret = procon_output_register(c);
+    if (ret < 0) {
+        pr_err("Could not register controller output: %d.\n", ret);
+        goto err_free_id;
+    }
+    procon_probe_phase(c, PROCON_PROBE_SLOT);
 
     // Try to parse the HID information.
     ret = hid_parse(hdev);
     if (ret < 0) {
         pr_err("Could not parse HID device.\n");
-        goto err_ret;
+        goto err_unregister;
     }
+    procon_probe_phase(c, PROCON_PROBE_PARSE);
 
     // Use hidraw to get the inputs from the controller. Initialise hidraw.
     ret = hid_hw_start(hdev, HID_CONNECT_HIDRAW);
     if (ret < 0) {
         pr_err("Could not start hidraw.\n");
-        goto err_ret;
+        goto err_unregister;
     }
+    procon_probe_phase(c, PROCON_PROBE_HW_START);
 
     ret = hid_hw_open(hdev);
     if (ret < 0) {
@@ -485,49 +750,22 @@ int procon_init_device(struct hid_device *hdev, const struct hid_device_id *id)
         goto err_stop;
     }
     hid_device_io_start(hdev);
+    procon_probe_phase(c, PROCON_PROBE_HW_OPEN);
 
-    // Initialise controller struct.
-    c = devm_kzalloc(&hdev->dev, sizeof(struct controller), GFP_KERNEL);
-    mutex_init(&c->lock);
-    mutex_init(&c->proc_lock);
-    mutex_init(&c->input_lock);
-    c->info = devm_kzalloc(&hdev->dev, sizeof(struct controller_info), GFP_KERNEL);
-    c->info->controller_mac_addr = devm_kzalloc(&hdev->dev, 6 * sizeof(__u8), GFP_KERNEL);
-
-    if (c == NULL || c->info == NULL || c->info->controller_mac_addr == NULL) {
-        controller_spots[controller_id] = true;
-        return -ENOMEM;
-    }
-
-    c->controller_id = controller_id;
-    c->player_indicator = 0;
-    c->current_packet_num = 0;
-    
-    c->ls_center = CALIBRATION_DEFAULT_CENTER;
-    c->ls_min = CALIBRATION_DEFAULT_MIN;
-    c->ls_max = CALIBRATION_DEFAULT_MAX;
-
-    c->rs_center = CALIBRATION_DEFAULT_CENTER;
-    c->rs_min = CALIBRATION_DEFAULT_MIN;
-    c->rs_max = CALIBRATION_DEFAULT_MAX;
-
-    c->handler = hdev;
-    hid_set_drvdata(hdev, c);
-    connected_controllers[controller_id] = c;
-
-    // Perform handshake.
+    // Perform handshake, some steps only apply over USB.
     mutex_lock(&c->lock);
-    send_message_raw(hdev, handshake, sizeof(handshake));
-    mdelay(MAX_SUBCMD_RATE_MS);
 
-    // Increase baudrate
-    send_message_raw(hdev, baudrate_increase, sizeof(baudrate_increase));
-    mdelay(MAX_SUBCMD_RATE_MS);
+    for (size_t i = 0; i < procon_handshake_length; i++) {
+        if (procon_handshake[i].usb_only && hdev->bus != BUS_USB) {
+            continue;
+        }
+
+        send_message_raw(hdev, procon_handshake[i].data, sizeof(procon_handshake[i].data));
+        mdelay(MAX_SUBCMD_RATE_MS);
+    }
 
-    // Handshake again.
-    send_message_raw(hdev, handshake, sizeof(handshake));
-    mdelay(MAX_SUBCMD_RATE_MS);
     mutex_unlock(&c->lock);
+    procon_probe_phase(c, PROCON_PROBE_HANDSHAKE);
 
     // First ask the controller for its info.
     init_packet(&p, PROCON_CMD_COMMAND_AND_RUMBLE, PROCON_SUB_REQUEST_INFO, NULL, 0);
@@ -538,166 +776,279 @@ int procon_init_device(struct hid_device *hdev, const struct hid_device_id *id)
         goto err_close;
     }
 
-    // Fetch the current controller calibration.
-    init_packet(&p, PROCON_CMD_COMMAND_AND_RUMBLE, PROCON_SUB_READ_SPI, calibration_args, sizeof(calibration_args));
-    ret = send_message(c, &p);
-    if (ret < 0) {
-        pr_err("Failed to request controller calibration: %d.\n", ret);
-        goto err_close;
+    // The info reply clears c->cached, and reads the flash itself if the cache was stale.
+    if (!cached) {
+        ret = procon_read_flash(c);
+        if (ret < 0) {
+            goto err_close;
+        }
     }
 
-    // Fetch LPM mode.
-    init_packet(&p, PROCON_CMD_COMMAND_AND_RUMBLE, PROCON_SUB_READ_SPI, lpm_read_args, sizeof(lpm_read_args));
-
-    ret = send_message(c, &p);
-    if (ret < 0) {
-        pr_err("Failed to read LPM information: %d.\n", ret);
-        goto err_close;
+    // Send a vibrate command, turn the IMU on only for gyro aim, and vibration off.
+    setup_count = init_setup_packets(setup, ARRAY_SIZE(setup), READ_ONCE(c->gyro.enabled));
+    for (size_t i = 0; i < setup_count; i++) {
+        ret = send_message(c, &setup[i]);
+        if (ret < 0) {
+            pr_err("Could not send setup subcommand %02x: %d.\n", setup[i].subcommand, ret);
+            goto err_close;
+        }
     }
 
-    // Set input report mode to full reporting mode.
-    init_packet(&p, PROCON_CMD_COMMAND_AND_RUMBLE, PROCON_SUB_SET_REPORT_MODE, report_mode_args, sizeof(report_mode_args));
-    packet_add_rumble(&p);
+    // Set the player light.
+    set_player_led(c, get_player_led_arg(c->player_indicator));
+    procon_probe_phase(c, PROCON_PROBE_SUBCOMMANDS);
 
-    ret = send_message(c, &p);
-    if (ret < 0) {
-        pr_err("Failed to set input report mode: %d.\n", ret);
-        goto err_close;
+    // Create input device for the controller.
+    // A JoyCon that gets merged with its other half shares the input device of the pair.
+    // A controller back within its grace period keeps the input device it had.
+    c->merged = procon_pair_wanted(c);
+    if (c->merged) {
+        ret = procon_pair_add(c);
+    } else if (c->input != NULL) {
+        ret = procon_input_reattach(c);
+    } else {
+        ret = create_input_device(c);
     }
 
-    // Send a vibrate command.
-    init_packet(&p, PROCON_CMD_RUMBLE, 0, NULL, 0);
-    packet_add_rumble(&p);
-    send_message(c, &p);
-
-    // Disable the IMU.
-    init_packet(&p, PROCON_CMD_COMMAND_AND_RUMBLE, PROCON_SUB_SET_IMU, disable_arg, sizeof(disable_arg));
-
-    ret = send_message(c, &p);
     if (ret < 0) {
-        pr_err("Could not disable IMU: %d.\n", ret);
+        pr_err("Could not create input device: %d.\n", ret);
         goto err_close;
     }
 
-    // Enable vibration.
-    init_packet(&p, PROCON_CMD_COMMAND_AND_RUMBLE, PROCON_SUB_SET_VIBRATION, disable_arg, sizeof(disable_arg));
-
-    ret = send_message(c, &p);
+    // Gyro aim is not needed to use the controller either.
+    ret = procon_gyro_start(c);
     if (ret < 0) {
-        pr_err("Could not disable vibration: %d.\n", ret);
-        goto err_close;
+        pr_warn("Could not start gyro aim for controller%d: %d.\n", controller_id, ret);
     }
 
-    // Set the player light.
-    set_player_led(c, get_player_led_arg(c->player_indicator));
-
-    // Create input device for the controller.
-    ret = create_input_device(c);
+    // The battery is not needed to use the controller.
+    ret = procon_battery_register(c);
     if (ret < 0) {
-        pr_err("Could not create input device: %d.\n", ret);
-        goto err_close;
+        pr_warn("Could not register battery for controller%d: %d.\n", controller_id, ret);
     }
 
-    // Create a proc folder for settings for this device.
-    controller_name = devm_kzalloc(&hdev->dev, 12, GFP_KERNEL);
-    if (controller_name == NULL) {
-        return -ENOMEM;
-    }
+    // Start streaming. Unless the input device got opened already, this is the simple report mode.
+    procon_stream_update(c);
+    procon_probe_phase(c, PROCON_PROBE_INPUT);
 
-    snprintf(controller_name, 12, "controller%d", controller_id);
+    // Create a proc folder for settings for this device.
+    snprintf(controller_name, sizeof(controller_name), "controller%d", controller_id);
 
     if (procon_proc_dir == NULL) {
         pr_warn("Not creating proc entries, parent is null.\n");
+        procon_probe_end(c);
         return 0;
     }
 
-    procon_player_dirs[controller_id] = proc_mkdir(controller_name, procon_proc_dir);
-    if (procon_player_dirs[controller_id] == NULL) {
+    c->proc_dir = proc_mkdir(controller_name, procon_proc_dir);
+    if (c->proc_dir == NULL) {
         pr_warn("Not creating proc entires, player folder is null.\n");
+        procon_probe_end(c);
         return 0;
     }
 
-    procon_proc_create_player_indicator(controller_id);
-    procon_proc_create_info(controller_id);
-    procon_proc_create_low_power_mode(controller_id);
+    procon_proc_create_player_indicator(c);
+    procon_proc_create_info(c);
+    procon_proc_create_state(c);
+    procon_proc_create_sync_rate(c);
+    procon_proc_create_sticks(c);
+    procon_proc_create_keymap(c);
+    procon_proc_create_mcu(c);
+    procon_proc_create_gyro(c);
+    procon_proc_create_low_power_mode(c);
+    procon_debugfs_add(c);
+    procon_probe_phase(c, PROCON_PROBE_PROC);
+    procon_probe_end(c);
 
     pr_info("Device %s [%02x:%02x] successfully connected as id controller%d!\n", hdev->name, hdev->vendor, hdev->product, controller_id);
 
     return 0;
 
 err_close:
+    // The info, flash and setup subcommands are queued, none of them may go to a stopped device.
+    procon_output_unregister(c);
     hid_hw_close(hdev);
+    hid_hw_stop(hdev);
+    goto err_free_id;
 err_stop:
     hid_hw_stop(hdev);
-    controller_spots[controller_id] = true;
+err_unregister:
+    procon_output_unregister(c);
+err_free_id:
+    hid_set_drvdata(hdev, NULL);
+    procon_input_stop(c);
+    procon_slot_free(c);
 err_ret:
     return ret;
 }
 
+void procon_update_report_stats(struct controller *c, const struct input_response *resp) {
+    unsigned long elapsed;
+
+    c->reports_received++;
+    c->rate_window_count++;
+
+    // Recalculate the report rate about once a second.
+    elapsed = jiffies - c->rate_window_start;
+    if (elapsed >= HZ) {
+        c->report_rate = c->rate_window_count * HZ / elapsed;
+        c->rate_window_count = 0;
+        c->rate_window_start = jiffies;
+    }
+
+    // Only the full reports carry the battery information.
+    if (resp->report_id == 0x30 || resp->report_id == 0x31 || resp->report_id == 0x21) {
+        procon_battery_update(c, resp->battery_and_connection_type);
+    }
+}
+
 int procon_event(struct hid_device *hdev, struct hid_report *report, __u8 *raw_data, int size) {
     struct input_response resp;
     struct controller *c;
+    unsigned long flags;
+    bool changed = false;
+    __u64 start;
 
     // Get the controller from the device.
     c = hid_get_drvdata(hdev);
+    if (c == NULL) {
+        return 0;
+    }
+
+    // Nobody has the input device open, the simple reports only keep the statistics going.
+    if (size > 0 && raw_data[0] == PROCON_REPORT_SIMPLE && !READ_ONCE(c->input_open)) {
+        resp.report_id = raw_data[0];
+        procon_update_report_stats(c, &resp);
+        return 0;
+    }
 
     // Decode the controller message.
-    decode_message(&resp, raw_data, size, c);
+    start = procon_profile_start();
+    if (decode_message(&resp, raw_data, size, c->desc, &c->calibration)) {
+        c->decode_errors++;
+        return 0;
+    }
+    procon_profile_end(c, PROCON_PROFILE_DECODE, start);
+
+    procon_update_report_stats(c, &resp);
+
+    if (resp.report_id == PROCON_REPORT_MCU) {
+        procon_mcu_input(c, raw_data, size);
+    }
 
+    if (resp.report_id == PROCON_REPORT_FULL || resp.report_id == PROCON_REPORT_MCU) {
+        procon_gyro_input(c, raw_data, size);
+    }
+
+    start = procon_profile_start();
+
+    // Any reply means the controller is done with the subcommand, this drives the pacing.
+    if (resp.report_id == 0x21) {
+        procon_output_ack(c, resp.subcommand_id);
+        procon_probe_ack(c, resp.subcommand_id);
+    }
+
+    // Pollers of the proc files only hear about real changes.
     if (resp.subcommand_id == 0x02) {
-        mutex_lock(&c->lock);
-        decode_device_information(c->info, resp.subcommand_reply, 12);
-        mutex_unlock(&c->lock);
+        struct controller_info before;
+        bool stale;
+        bool stale_imu;
+
+        spin_lock_irqsave(&c->info_lock, flags);
+        before = c->info;
+        decode_device_information(&c->info, resp.subcommand_reply, 12);
+        changed = memcmp(&before, &c->info, sizeof(before)) != 0;
+
+        // Cached data is only good for the firmware it was read with.
+        stale = c->cached && (before.firmware_version_major != c->info.firmware_version_major ||
+            before.firmware_version_minor != c->info.firmware_version_minor ||
+            memcmp(before.controller_mac_addr, c->info.controller_mac_addr, sizeof(before.controller_mac_addr)) != 0);
+        stale_imu = stale && c->imu_calibration_valid;
+        if (stale) {
+            c->calibration_valid = false;
+            c->imu_calibration_valid = false;
+        }
+        c->cached = false;
+        spin_unlock_irqrestore(&c->info_lock, flags);
+
+        if (stale) {
+            pr_info("Cached data of controller%d is stale, reading flash.\n", c->controller_id);
+            procon_cache_invalidate(before.controller_mac_addr);
+            procon_read_flash(c);
+        }
+
+        if (stale_imu) {
+            procon_gyro_invalidate_calibration(c);
+        }
+
+        procon_cache_store(c);
     } else if (resp.subcommand_id == 0x10) {
         __u8 buf[0x1d] = {0};
-        decode_spi_read(buf, resp.subcommand_reply, 0x1d);
+        __u32 address = decode_spi_address(resp.subcommand_reply);
 
-        mutex_lock(&c->lock);
-        c->info->low_power_mode = buf[0] == 0x1 ? 1 : 0;
-        mutex_unlock(&c->lock);
-    }
-
-    mutex_lock(&c->input_lock);
+        decode_spi_read(buf, resp.subcommand_reply, 0x1d);
 
-    // Full input report. Pass this to the input device.
-    if (c->input != NULL && (resp.report_id == 0x30 || resp.report_id == 0x21)) {
-        // D-Pad
-        input_report_abs(c->input, ABS_HAT0X, resp.button_data.dpad_horizontal);
-        input_report_abs(c->input, ABS_HAT0Y, resp.button_data.dpad_vertical);
+        if (address == PROCON_SPI_LPM) {
+            __u8 low_power_mode = buf[0] == 0x1 ? 1 : 0;
+
+            spin_lock_irqsave(&c->info_lock, flags);
+            changed = c->info.low_power_mode != low_power_mode;
+            c->info.low_power_mode = low_power_mode;
+            spin_unlock_irqrestore(&c->info_lock, flags);
+        } else if (address == PROCON_SPI_STICK_CALIBRATION) {
+            spin_lock_irqsave(&c->info_lock, flags);
+            if (decode_stick_calibration(&c->calibration, buf, resp.subcommand_reply[4]) == 0) {
+                memcpy(c->stick_calibration, buf, sizeof(c->stick_calibration));
+                c->calibration_valid = true;
+            } else {
+                pr_warn("controller%d has no usable stick calibration, using defaults.\n", c->controller_id);
+            }
+            spin_unlock_irqrestore(&c->info_lock, flags);
+        } else if (address == PROCON_SPI_IMU_CALIBRATION) {
+            if (procon_gyro_set_calibration(c, buf, resp.subcommand_reply[4]) == 0) {
+                spin_lock_irqsave(&c->info_lock, flags);
+                memcpy(c->imu_calibration, buf, sizeof(c->imu_calibration));
+                c->imu_calibration_valid = true;
+                spin_unlock_irqrestore(&c->info_lock, flags);
+            }
+        }
 
-        // Buttons on the right
-        input_report_key(c->input, BTN_NORTH, resp.button_data.y);
-        input_report_key(c->input, BTN_WEST, resp.button_data.x);
-        input_report_key(c->input, BTN_SOUTH, resp.button_data.b);
-        input_report_key(c->input, BTN_EAST, resp.button_data.a);
+        procon_cache_store(c);
+    }
 
-        // Buttons in the middle.
-        input_report_key(c->input, BTN_START, resp.button_data.plus);
-        input_report_key(c->input, BTN_SELECT, resp.button_data.minus);
-        input_report_key(c->input, BTN_MODE, resp.button_data.home);
+    if (resp.report_id == 0x21) {
+        procon_profile_end(c, PROCON_PROFILE_REPLY, start);
+    }
 
-        // Bumpers and triggers.
-        input_report_key(c->input, BTN_TR, resp.button_data.r);
-        input_report_key(c->input, BTN_TL, resp.button_data.l);
-        input_report_key(c->input, BTN_TR2, resp.button_data.zr);
-        input_report_key(c->input, BTN_TL2, resp.button_data.zl);
+    if (changed) {
+        procon_proc_notify(c);
+    }
 
-        // Stick buttons.
-        input_report_key(c->input, BTN_THUMBL, resp.button_data.tl);
-        input_report_key(c->input, BTN_THUMBR, resp.button_data.tr);
+    // Shape the sticks before anything looks at them.
+    if (resp.report_id == 0x30 || resp.report_id == 0x31 || resp.report_id == 0x21 || resp.report_id == PROCON_REPORT_SIMPLE) {
+        procon_stick_process(c, &resp);
+    }
 
-        // Analog joysticks.
-        input_report_abs(c->input, ABS_X, resp.stick_data.left_horizontal);
-        input_report_abs(c->input, ABS_Y, resp.stick_data.left_vertical);
+    // Any change wakes an idle controller back up.
+    procon_stream_input(c, &resp);
 
-        input_report_abs(c->input, ABS_RX, resp.stick_data.right_horizontal);
-        input_report_abs(c->input, ABS_RY, resp.stick_data.right_vertical);
+    // Input report. Pass this to the input device, if anyone is listening.
+    // An idle controller only sends simple reports, those carry the same state.
+    // BPF programs see the final state and may drop it, the stream itself still counts as alive.
+    if ((resp.report_id == 0x30 || resp.report_id == 0x31 || resp.report_id == 0x21 || resp.report_id == PROCON_REPORT_SIMPLE) && READ_ONCE(c->input_open)) {
+        if (procon_bpf_filter(c, &resp) != 0) {
+            return 0;
+        }
 
-        input_sync(c->input);
+        start = procon_profile_start();
+        if (c->merged) {
+            procon_pair_report(c, &resp);
+        } else {
+            procon_input_report(c, &resp);
+        }
+        procon_profile_end(c, PROCON_PROFILE_REPORT, start);
     }
 
-    mutex_unlock(&c->input_lock);
-    
     return 0;
 }
 
@@ -708,21 +1059,41 @@ void procon_remove_device(struct hid_device *hdev) {
         goto close;
     }
 
-    // Remove proc entries.
-    if (c->controller_id >= 0 && c->controller_id < MAX_CONTROLLER_SUPPORT && procon_player_dirs[c->controller_id] != NULL) {
-        proc_remove(procon_player_dirs[c->controller_id]);
-        controller_spots[c->controller_id] = true;
+    if (c->merged) {
+        procon_pair_remove(c);
     }
 
+    // Remove proc entries. This waits for any open proc file to be released.
+    proc_remove(c->proc_dir);
+    procon_debugfs_remove(c);
+
+    // Drop anything still waiting to be sent.
+    procon_output_unregister(c);
+
+    // The watchdog and battery work talk to the device, and a pair half that is split off already.
+    // They have to be done before the device stops.
+    procon_stream_stop(c);
+    procon_battery_stop(c);
+    procon_mcu_stop(c);
+    procon_gyro_stop(c);
+
     pr_info("Device removed: %s [%02x:%02x] [controller%d].\n", hdev->name, hdev->vendor, hdev->product, c->controller_id);
 
 close:
     hid_hw_close(hdev);
     hid_hw_stop(hdev);
+
+    if (c != NULL) {
+        procon_input_stop(c);
+
+        // Nothing uses the input device anymore, it either goes or waits for the controller to return.
+        procon_slot_release(c);
+    }
 }
 
 static const struct hid_device_id procon_devices[] = {
     { HID_BLUETOOTH_DEVICE(VENDOR_NINTENDO, DEVICE_PROCON) },
+    { HID_USB_DEVICE(VENDOR_NINTENDO, DEVICE_PROCON) },
     { HID_BLUETOOTH_DEVICE(VENDOR_NINTENDO, DEVICE_JOYCON_RIGHT) },
     { HID_BLUETOOTH_DEVICE(VENDOR_NINTENDO, DEVICE_JOYCON_LEFT) },
     { }
@@ -741,22 +1112,32 @@ static struct hid_driver procon_hid_driver = {
 static int __init procon_hid_driver_init(void) {
     int ret = 0;
 
-    // Register the driver with HID.
-    ret = hid_register_driver(&procon_hid_driver);
+    ret = procon_slot_init();
     if (ret != 0) {
-        pr_crit("Cannot register device with HID: %d\n", ret);
         return ret;
     }
 
-    // Set all controller slots to available.
-    for (int i = 0; i < MAX_CONTROLLER_SUPPORT; i++) {
-        controller_spots[i] = true;
-        connected_controllers[i] = NULL;
-        procon_player_dirs[i] = NULL;
+    // Start the output scheduler shared by all controllers.
+    ret = procon_output_init();
+    if (ret != 0) {
+        pr_crit("Cannot start output scheduler: %d\n", ret);
+        return ret;
     }
 
     // Create some proc entries for user-space controller management.
+    // This has to exist before the first probe can run.
     procon_proc_dir = proc_mkdir("procon", NULL);
+    procon_debugfs_init();
+
+    // Register the driver with HID.
+    ret = hid_register_driver(&procon_hid_driver);
+    if (ret != 0) {
+        pr_crit("Cannot register device with HID: %d\n", ret);
+        proc_remove(procon_proc_dir);
+        procon_debugfs_exit();
+        procon_output_exit();
+        return ret;
+    }
 
     pr_info("Ready to play!");
 
@@ -765,11 +1146,17 @@ static int __init procon_hid_driver_init(void) {
 
 // Exit of the driver.
 static void __exit procon_hid_driver_exit(void) {
+    hid_unregister_driver(&(procon_hid_driver));
+
     if (procon_proc_dir) {
         proc_remove(procon_proc_dir);
     }
 
-    hid_unregister_driver(&(procon_hid_driver));
+    // Nothing can start virtual controllers anymore once debugfs is gone.
+    procon_debugfs_exit();
+    procon_virtual_exit();
+    procon_output_exit();
+    procon_slot_exit();
 }
 
 module_init(procon_hid_driver_init);
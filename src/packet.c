@@ -1,7 +1,24 @@
+#include <linux/kernel.h>
 #include <linux/string.h>
 
+#include "commands.h"
 #include "packet.h"
-#include "procon-controller.h"
+#include "procon-devices.h"
+
+const struct procon_handshake_step procon_handshake[] = {
+    // Over USB, ask for the status first.
+    { {0x80, 0x01}, true },
+
+    // Handshake, increase the baudrate and handshake again.
+    { {0x80, 0x02}, false },
+    { {0x80, 0x03}, false },
+    { {0x80, 0x02}, false },
+
+    // Over USB, talk HID only, so the controller does not time out waiting for a console.
+    { {0x80, 0x04}, true },
+};
+
+const size_t procon_handshake_length = ARRAY_SIZE(procon_handshake);
 
 void init_packet(struct packet *p, const __u8 command, const __u8 subcommand, const __u8 *args, size_t args_len) {
     __u8 neutral[PACKET_RUMBLE_LENGTH] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
@@ -30,20 +47,61 @@ void packet_add_rumble(struct packet *p) {
     memcpy(p->rumble_data, neutral, PACKET_RUMBLE_LENGTH);
 }
 
-__s16 scale_and_clamp_single_stick(const __s16 stick_info, const struct controller *c, __u8 stick_id) {
+void init_spi_read_packet(struct packet *p, const __u32 address, const __u8 len) {
+    __u8 args[] = {address & 0xFF, (address >> 8) & 0xFF, (address >> 16) & 0xFF, (address >> 24) & 0xFF, len};
+
+    init_packet(p, PROCON_CMD_COMMAND_AND_RUMBLE, PROCON_SUB_READ_SPI, args, sizeof(args));
+}
+
+// A rumble frame, the IMU on or off and vibration off. Returns the number of packets filled in.
+size_t init_setup_packets(struct packet *packets, const size_t count, const bool imu) {
+    __u8 disable_arg[] = {0x00};
+    __u8 imu_arg[] = {imu ? 0x01 : 0x00};
+
+    if (count < PROCON_SETUP_PACKETS) {
+        return 0;
+    }
+
+    init_packet(&packets[0], PROCON_CMD_RUMBLE, 0, NULL, 0);
+    packet_add_rumble(&packets[0]);
+
+    init_packet(&packets[1], PROCON_CMD_COMMAND_AND_RUMBLE, PROCON_SUB_SET_IMU, imu_arg, sizeof(imu_arg));
+    init_packet(&packets[2], PROCON_CMD_COMMAND_AND_RUMBLE, PROCON_SUB_SET_VIBRATION, disable_arg, sizeof(disable_arg));
+
+    return PROCON_SETUP_PACKETS;
+}
+
+void procon_calibration_default(struct procon_calibration *cal) {
+    cal->ls_center = CALIBRATION_DEFAULT_CENTER;
+    cal->ls_min = CALIBRATION_DEFAULT_MIN;
+    cal->ls_max = CALIBRATION_DEFAULT_MAX;
+
+    cal->rs_center = CALIBRATION_DEFAULT_CENTER;
+    cal->rs_min = CALIBRATION_DEFAULT_MIN;
+    cal->rs_max = CALIBRATION_DEFAULT_MAX;
+}
+
+void procon_imu_calibration_default(struct procon_imu_calibration *cal) {
+    for (int i = 0; i < 3; i++) {
+        cal->gyro_offset[i] = 0;
+        cal->gyro_sensitivity[i] = PROCON_GYRO_DEFAULT_SENSITIVITY;
+    }
+}
+
+__s16 scale_and_clamp_single_stick(const __s16 stick_info, const struct procon_calibration *cal, __u8 stick_id) {
     __s32 center;
     __s32 min;
     __s32 max;
     __s32 val;
 
     if (stick_id == 0) {
-        center = c->ls_center;
-        min = c->ls_min;
-        max = c->ls_max;
+        center = cal->ls_center;
+        min = cal->ls_min;
+        max = cal->ls_max;
     } else {
-        center = c->rs_center;
-        min = c->rs_min;
-        max = c->rs_max;
+        center = cal->rs_center;
+        min = cal->rs_min;
+        max = cal->rs_max;
     }
 
     if (stick_info > center) {
@@ -57,18 +115,24 @@ __s16 scale_and_clamp_single_stick(const __s16 stick_info, const struct controll
     return (__s16) val;
 }
 
-void scale_and_clamp(struct analog_stick_info *data, struct controller *c) {
-    data->left_horizontal = scale_and_clamp_single_stick(data->left_horizontal, c, 0);
-    data->left_vertical = -scale_and_clamp_single_stick(data->left_vertical, c, 0);
-    
-    data->right_horizontal = scale_and_clamp_single_stick(data->right_horizontal, c, 1);
-    data->right_vertical = -scale_and_clamp_single_stick(data->right_vertical, c, 1);
+void scale_and_clamp(__s16 *sticks, const struct procon_device_desc *desc, const struct procon_calibration *cal) {
+    if (desc->sticks & PROCON_STICK_LEFT) {
+        sticks[PROCON_AXIS_LX] = scale_and_clamp_single_stick(sticks[PROCON_AXIS_LX], cal, 0);
+        sticks[PROCON_AXIS_LY] = -scale_and_clamp_single_stick(sticks[PROCON_AXIS_LY], cal, 0);
+    }
+
+    if (desc->sticks & PROCON_STICK_RIGHT) {
+        sticks[PROCON_AXIS_RX] = scale_and_clamp_single_stick(sticks[PROCON_AXIS_RX], cal, 1);
+        sticks[PROCON_AXIS_RY] = -scale_and_clamp_single_stick(sticks[PROCON_AXIS_RY], cal, 1);
+    }
 }
 
-int decode_advanced_input_report(struct input_response *resp, const __u8 *resp_data, const size_t len, struct controller *c) {
-    const __u8 *left_data;
-    const __u8 *right_data;
+static void decode_stick(__s16 *horizontal, __s16 *vertical, const __u8 *data) {
+    *horizontal = data[0] | ((data[1] & 0xF) << 8);
+    *vertical = (data[1] >> 4) | (data[2] << 4);
+}
 
+int decode_advanced_input_report(struct input_response *resp, const __u8 *resp_data, const size_t len, const struct procon_device_desc *desc, const struct procon_calibration *cal) {
     if (len < 49) {
         return 1;
     }
@@ -87,82 +151,90 @@ int decode_advanced_input_report(struct input_response *resp, const __u8 *resp_d
         resp->subcommand_ack = 0x00;
     }
 
-    // Decode the button data.
-    resp->button_data.y = resp_data[3] & 0x01;
-    resp->button_data.x = resp_data[3] & 0x02;
-    resp->button_data.b = resp_data[3] & 0x04;
-    resp->button_data.a = resp_data[3] & 0x08;
-    resp->button_data.sr = resp_data[3] & 0x10;
-    resp->button_data.sl = resp_data[3] & 0x20;
-    resp->button_data.r = resp_data[3] & 0x40;
-    resp->button_data.zr = resp_data[3] & 0x80;
-
-    resp->button_data.minus = resp_data[4] & 0x01;
-    resp->button_data.plus = resp_data[4] & 0x02;
-    resp->button_data.tr = resp_data[4] & 0x04;
-    resp->button_data.tl = resp_data[4] & 0x08;
-    resp->button_data.home = resp_data[4] & 0x10;
-    resp->button_data.capture = resp_data[4] & 0x20;
-
-    resp->button_data.dpad_vertical = (resp_data[5] & 0x01) ^ -((resp_data[5] & 0x02) >> 1);
-    resp->button_data.dpad_horizontal = ((resp_data[5] & 0x04) >> 2) ^ -((resp_data[5] & 0x08) >> 3);
-
-    // resp->button_data.sr = resp_data[5] & 0x10;
-    // resp->button_data.sl = resp_data[5] & 0x20;
-    resp->button_data.l = resp_data[5] & 0x40;
-    resp->button_data.zl = resp_data[5] & 0x80;
-
-    // Decode the stick data.
-    left_data = resp_data + 6;
-    right_data = resp_data + 9;
-
-    resp->stick_data.left_horizontal = left_data[0] | ((left_data[1] & 0xF) << 8);
-    resp->stick_data.left_vertical = (left_data[1] >> 4) | (left_data[2] << 4);
-    resp->stick_data.right_horizontal = right_data[0] | ((right_data[1] & 0xF) << 8);
-    resp->stick_data.right_vertical = (right_data[1] >> 4) | (right_data[2] << 4);
+    // The button bits are laid out the same as in the report, only keep what the device has.
+    resp->buttons = (resp_data[3] | (resp_data[4] << 8) | (resp_data[5] << 16)) & desc->button_mask;
+
+    // Decode the stick data. Sticks the device does not have stay centred.
+    memset(resp->sticks, 0, sizeof(resp->sticks));
+
+    if (desc->sticks & PROCON_STICK_LEFT) {
+        decode_stick(&resp->sticks[PROCON_AXIS_LX], &resp->sticks[PROCON_AXIS_LY], resp_data + 6);
+    }
+
+    if (desc->sticks & PROCON_STICK_RIGHT) {
+        decode_stick(&resp->sticks[PROCON_AXIS_RX], &resp->sticks[PROCON_AXIS_RY], resp_data + 9);
+    }
 
     // Clamp the stick data after applying the scaling function.
-    scale_and_clamp(&resp->stick_data, c);
+    scale_and_clamp(resp->sticks, desc, cal);
 
     return 0;
 }
 
-int decode_simple_input_report(struct input_response *resp, const __u8 *resp_data, const size_t len) {
-    const __u8 *left_data;
-    const __u8 *right_data;
+// The hat in byte 3 of a simple report, clockwise from up. Anything else is centred.
+static const __u32 simple_hat_buttons[8] = {
+    BIT(PROCON_BTN_UP),
+    BIT(PROCON_BTN_UP) | BIT(PROCON_BTN_RIGHT),
+    BIT(PROCON_BTN_RIGHT),
+    BIT(PROCON_BTN_DOWN) | BIT(PROCON_BTN_RIGHT),
+    BIT(PROCON_BTN_DOWN),
+    BIT(PROCON_BTN_DOWN) | BIT(PROCON_BTN_LEFT),
+    BIT(PROCON_BTN_LEFT),
+    BIT(PROCON_BTN_UP) | BIT(PROCON_BTN_LEFT),
+};
+
+int decode_simple_input_report(struct input_response *resp, const __u8 *resp_data, const size_t len, const struct procon_device_desc *desc, const struct procon_calibration *cal) {
+    __u16 raw;
+    __u32 buttons = 0;
+    __u32 hat = 0;
 
-    if (len < 11) {
+    if (len < 12) {
         return 1;
     }
 
     // Copy basic data.
     resp->report_id = resp_data[0];
 
-    // Decode the button data.
-    resp->button_data.dpad_vertical = (resp_data[1] & 0x01) ^ -((resp_data[1] & 0x08) >> 3);
-    resp->button_data.dpad_horizontal = ((resp_data[1] & 0x02) >> 1) ^ -((resp_data[1] & 0x04) >> 2);
+    // Decode the button data, every device type has its own layout.
+    raw = resp_data[1] | (resp_data[2] << 8);
+    for (int i = 0; i < 16; i++) {
+        if ((raw & (1 << i)) && desc->simple_buttons[i] != PROCON_SIMPLE_NONE) {
+            buttons |= BIT(desc->simple_buttons[i]);
+        }
+    }
 
-    resp->button_data.sl = resp_data[1] & 0x10;
-    resp->button_data.sr = resp_data[1] & 0x20;
+    if (resp_data[3] < ARRAY_SIZE(simple_hat_buttons)) {
+        hat = simple_hat_buttons[resp_data[3]];
+    }
 
-    resp->button_data.minus = resp_data[2] & 0x01;
-    resp->button_data.plus = resp_data[2] & 0x02;
-    resp->button_data.tl = resp_data[2] & 0x04;
-    resp->button_data.tr = resp_data[2] & 0x08;
-    resp->button_data.home = resp_data[2] & 0x10;
-    resp->button_data.capture = resp_data[2] & 0x20;
-    resp->button_data.l = resp_data[2] & 0x40;
-    resp->button_data.zl = resp_data[2] & 0x80;
+    if (desc->simple_dpad) {
+        buttons |= hat;
+    }
 
-    // Decode the stick data.
-    left_data = resp_data + 4;
-    right_data = resp_data + 8;
+    resp->buttons = buttons & desc->button_mask;
 
-    resp->stick_data.left_horizontal = left_data[0] | (left_data[1] << 8);
-    resp->stick_data.left_vertical = left_data[2] | (left_data[3] << 8);
+    if (desc->simple_dpad) {
+        // Decode the stick data. These are 16 bits wide, the calibration is for the 12 bits of the full reports.
+        for (int i = 0; i < PROCON_AXIS_COUNT; i++) {
+            resp->sticks[i] = (resp_data[4 + 2 * i] | (resp_data[5 + 2 * i] << 8)) >> 4;
+        }
 
-    resp->stick_data.right_horizontal = right_data[0] | (right_data[1] << 8);
-    resp->stick_data.right_vertical = right_data[2] | (right_data[3] << 8);
+        scale_and_clamp(resp->sticks, desc, cal);
+    } else {
+        // The JoyCons send a centred filler there, their stick only comes as a direction in byte 3.
+        // A pushed stick counts as all the way out, enough to tell it moved.
+        memset(resp->sticks, 0, sizeof(resp->sticks));
+
+        if (desc->sticks & PROCON_STICK_LEFT) {
+            resp->sticks[PROCON_AXIS_LX] = procon_dpad_horizontal(hat) * PROCON_STICK_MAX;
+            resp->sticks[PROCON_AXIS_LY] = procon_dpad_vertical(hat) * PROCON_STICK_MAX;
+        }
+
+        if (desc->sticks & PROCON_STICK_RIGHT) {
+            resp->sticks[PROCON_AXIS_RX] = procon_dpad_horizontal(hat) * PROCON_STICK_MAX;
+            resp->sticks[PROCON_AXIS_RY] = procon_dpad_vertical(hat) * PROCON_STICK_MAX;
+        }
+    }
 
     return 0;
 }
@@ -195,77 +267,147 @@ int decode_spi_read(__u8 *buf, const __u8 *data, const size_t len) {
     return 0;
 }
 
-int decode_message(struct input_response *resp, const __u8 *resp_data, const size_t len, struct controller *c) {
-    // Decode the report.
-    if (resp_data[0] == 0x21 || resp_data[0] == 0x30) {
-        return decode_advanced_input_report(resp, resp_data, len, c);
-    } else if (resp_data[0] == 0x3F) {
-        return decode_simple_input_report(resp, resp_data, len);
+__u32 decode_spi_address(const __u8 *data) {
+    return data[0] | (data[1] << 8) | (data[2] << 16) | (data[3] << 24);
+}
+
+// Both sticks have a centre, a range below and a range above it, for X and Y.
+// The left stick stores them as above, centre, below. The right one as centre, below, above.
+// The axes are not calibrated separately here, so X and Y are averaged.
+int decode_stick_calibration(struct procon_calibration *cal, const __u8 *data, const size_t len) {
+    static const int order[2][3] = {{1, 2, 0}, {0, 1, 2}};
+    __s16 x[3];
+    __s16 y[3];
+    __s32 center[2];
+    __s32 below[2];
+    __s32 above[2];
+
+    if (len < PROCON_SPI_STICK_CALIBRATION_LENGTH) {
+        return 1;
     }
 
+    for (int stick = 0; stick < 2; stick++) {
+        for (int i = 0; i < 3; i++) {
+            decode_stick(&x[i], &y[i], data + 9 * stick + 3 * i);
+
+            // Flash that was never written.
+            if (x[i] == 0xFFF || y[i] == 0xFFF) {
+                return 1;
+            }
+        }
+
+        center[stick] = (x[order[stick][0]] + y[order[stick][0]]) / 2;
+        below[stick] = (x[order[stick][1]] + y[order[stick][1]]) / 2;
+        above[stick] = (x[order[stick][2]] + y[order[stick][2]]) / 2;
+
+        if (below[stick] == 0 || above[stick] == 0) {
+            return 1;
+        }
+    }
+
+    cal->ls_center = center[0];
+    cal->ls_min = center[0] - below[0];
+    cal->ls_max = center[0] + above[0];
+
+    cal->rs_center = center[1];
+    cal->rs_min = center[1] - below[1];
+    cal->rs_max = center[1] + above[1];
+
     return 0;
 }
 
-char *format_controller_type(const enum controller_type type) {
-    char *ret = kzalloc(13, GFP_KERNEL);
-    if (ret == NULL) {
-        pr_err("Cannot allocate memory for controller type!\n");
-        return NULL;
-    }
+static __s16 decode_s16(const __u8 *data) {
+    return (__s16) (data[0] | (data[1] << 8));
+}
 
-    switch (type) {
-        case LEFT_JOYCON:
-        snprintf(ret, 13, "Left JoyCon");
-        break;
+// The factory IMU calibration is the accelerometer offset and sensitivity, then the same for the gyro.
+int decode_imu_calibration(struct procon_imu_calibration *cal, const __u8 *data, const size_t len) {
+    struct procon_imu_calibration decoded;
 
-        case RIGHT_JOYCON:
-        snprintf(ret, 13, "Right JoyCon");
-        break;
+    if (len < PROCON_SPI_IMU_CALIBRATION_LENGTH) {
+        return 1;
+    }
 
-        case PROCON:
-        snprintf(ret, 13, "ProCon");
-        break;
+    for (int i = 0; i < 3; i++) {
+        decoded.gyro_offset[i] = decode_s16(data + 12 + 2 * i);
+        decoded.gyro_sensitivity[i] = decode_s16(data + 18 + 2 * i);
 
-        default:
-        snprintf(ret, 13, "Unknown");
-        break;
+        // Flash that was never written, or nothing to scale by.
+        if (decoded.gyro_sensitivity[i] == -1 || decoded.gyro_sensitivity[i] == decoded.gyro_offset[i]) {
+            return 1;
+        }
     }
 
-    return ret;
+    *cal = decoded;
+    return 0;
 }
 
-char *format_lpm(const __u8 low_power_mode) {
-    char *ret = kzalloc(9, GFP_KERNEL);
-    if (ret == NULL) {
-        pr_err("Cannot allocate memory for LPM setting!\n");
-        return NULL;
+// Only full reports have IMU data, subcommand replies put the reply there instead.
+int decode_imu(struct procon_imu_sample *samples, const __u8 *resp_data, const size_t len) {
+    if (len < PROCON_IMU_OFFSET + 12 * PROCON_IMU_SAMPLES || (resp_data[0] != 0x30 && resp_data[0] != 0x31)) {
+        return 1;
     }
 
-    if (low_power_mode == 1) {
-        snprintf(ret, 9, "enabled");
-    } else {
-        snprintf(ret, 9, "disabled");
+    for (int i = 0; i < PROCON_IMU_SAMPLES; i++) {
+        const __u8 *sample = resp_data + PROCON_IMU_OFFSET + 12 * i;
+
+        for (int axis = 0; axis < 3; axis++) {
+            samples[i].accel[axis] = decode_s16(sample + 2 * axis);
+            samples[i].gyro[axis] = decode_s16(sample + 6 + 2 * axis);
+        }
     }
 
-    return ret;
+    return 0;
 }
 
-char *format_colour_mode(const __u8 colour_mode) {
-    char *ret = kzalloc(8, GFP_KERNEL);
-    if (ret == NULL) {
-        pr_err("Cannot allocate memory for colour mode!\n");
-        return NULL;
+int decode_message(struct input_response *resp, const __u8 *resp_data, const size_t len, const struct procon_device_desc *desc, const struct procon_calibration *cal) {
+    if (len < 1) {
+        return 1;
     }
 
-    switch(colour_mode) {
-        case 0x1:
-        snprintf(ret, 8, "SPI");
-        break;
+    // Only 0x21 reports carry a subcommand reply, make sure the others never look like one.
+    resp->report_id = resp_data[0];
+    resp->subcommand_ack = 0x00;
+    resp->subcommand_id = 0x00;
 
-        default:
-        snprintf(ret, 8, "default");
-        break;
+    // Decode the report. The 0x31 reports are full reports with MCU data after them.
+    if (resp_data[0] == 0x21 || resp_data[0] == 0x30 || resp_data[0] == 0x31) {
+        return decode_advanced_input_report(resp, resp_data, len, desc, cal);
+    } else if (resp_data[0] == 0x3F) {
+        return decode_simple_input_report(resp, resp_data, len, desc, cal);
     }
 
-    return ret;
+    return 0;
+}
+
+static const char * const controller_type_names[] = {
+    [LEFT_JOYCON] = "Left JoyCon",
+    [RIGHT_JOYCON] = "Right JoyCon",
+    [PROCON] = "ProCon",
+};
+
+static const char * const lpm_names[] = {
+    "disabled",
+    "enabled",
+};
+
+static const char * const colour_mode_names[] = {
+    "default",
+    "SPI",
+};
+
+const char *format_controller_type(const enum controller_type type) {
+    if (type >= ARRAY_SIZE(controller_type_names) || controller_type_names[type] == NULL) {
+        return "Unknown";
+    }
+
+    return controller_type_names[type];
+}
+
+const char *format_lpm(const __u8 low_power_mode) {
+    return lpm_names[low_power_mode == 1];
+}
+
+const char *format_colour_mode(const __u8 colour_mode) {
+    return colour_mode_names[colour_mode == 0x1];
 }
\ No newline at end of file
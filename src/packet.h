@@ -1,13 +1,91 @@
 #include <linux/types.h>
 #include <linux/string.h>
-#include "procon-controller.h"
 
 #ifndef __PROCON_PACKET_H__
 #define __PROCON_PACKET_H__
 
+// The protocol itself. This and packet.c, commands.h and procon-devices.c only use plain
+// types, so they build in the module as well as in the userspace library under lib/.
+
 #define PACKET_RUMBLE_LENGTH 8
 #define PACKET_ARG_LENGTH 53
 
+// Time between two subcommands to the same controller, before any acks have been seen.
+#define MAX_SUBCMD_RATE_MS 70
+
+#define PROCON_STICK_MAX 32767
+
+#define CALIBRATION_DEFAULT_CENTER 2000
+#define CALIBRATION_DEFAULT_MIN 500
+#define CALIBRATION_DEFAULT_MAX 3500
+
+// SPI flash locations.
+#define PROCON_SPI_LPM 0x5000
+#define PROCON_SPI_STICK_CALIBRATION 0x603D
+#define PROCON_SPI_STICK_CALIBRATION_LENGTH 18
+#define PROCON_SPI_IMU_CALIBRATION 0x6020
+#define PROCON_SPI_IMU_CALIBRATION_LENGTH 24
+
+// Full reports carry three IMU samples, 5 ms apart and oldest first, after the buttons and sticks.
+#define PROCON_IMU_OFFSET 13
+#define PROCON_IMU_SAMPLES 3
+#define PROCON_IMU_SAMPLE_US 5000
+
+// Sensitivity the gyro calibration is relative to, and the rate it stands for in mdps.
+#define PROCON_GYRO_DEFAULT_SENSITIVITY 13371
+#define PROCON_GYRO_RANGE_MDPS 936000
+
+enum controller_type {
+    LEFT_JOYCON = 1,
+    RIGHT_JOYCON = 2,
+    PROCON = 3,
+};
+
+struct procon_device_desc;
+
+struct controller_info {
+    __u8 firmware_version_major;
+    __u8 firmware_version_minor;
+    enum controller_type controller_type;
+    __u8 controller_mac_addr[6];
+    __u8 low_power_mode;
+    __u8 colour_mode;
+};
+
+// Stick ranges, from the factory calibration or the defaults.
+struct procon_calibration {
+    __s32 ls_center;
+    __s32 ls_min;
+    __s32 ls_max;
+
+    __s32 rs_center;
+    __s32 rs_min;
+    __s32 rs_max;
+};
+
+// Axes are X, Y and Z. With the controller held flat, Y is pitch and Z is yaw.
+struct procon_imu_sample {
+    __s16 accel[3];
+    __s16 gyro[3];
+};
+
+struct procon_imu_calibration {
+    __s16 gyro_offset[3];
+    __s16 gyro_sensitivity[3];
+};
+
+// One raw output report of the handshake, each is followed by a MAX_SUBCMD_RATE_MS pause.
+struct procon_handshake_step {
+    __u8 data[2];
+    bool usb_only;
+};
+
+extern const struct procon_handshake_step procon_handshake[];
+extern const size_t procon_handshake_length;
+
+// Subcommands that set a controller up once its info and calibration are asked for.
+#define PROCON_SETUP_PACKETS 3
+
 // Defines a packet as sent to the switch.
 // Is always 0x40 bytes long.
 struct packet {
@@ -18,69 +96,90 @@ struct packet {
     __u8 arguments[PACKET_ARG_LENGTH];
 };
 
-struct button_info {
-    // Buttons.
-    _Bool y;
-    _Bool x;
-    _Bool b;
-    _Bool a;
-    _Bool minus;
-    _Bool plus;
-    _Bool tr;
-    _Bool tl;
-    _Bool home;
-    _Bool capture;
-
-    // Triggers and bumpers.
-    _Bool zr;
-    _Bool zl;
-    _Bool sr;
-    _Bool sl;
-    _Bool r;
-    _Bool l;
-
-    // D-pad.
-    __s8 dpad_vertical;
-    __s8 dpad_horizontal;
-};
-
-struct analog_stick_info {
-    // Left stick.
-    __s16 left_horizontal;
-    __s16 left_vertical;
-
-    // Right stick.
-    __s16 right_horizontal;
-    __s16 right_vertical;
+// Button bits, in the order of bytes 3 to 5 of a full input report.
+#define PROCON_BTN_Y 0
+#define PROCON_BTN_X 1
+#define PROCON_BTN_B 2
+#define PROCON_BTN_A 3
+#define PROCON_BTN_RIGHT_SR 4
+#define PROCON_BTN_RIGHT_SL 5
+#define PROCON_BTN_R 6
+#define PROCON_BTN_ZR 7
+#define PROCON_BTN_MINUS 8
+#define PROCON_BTN_PLUS 9
+#define PROCON_BTN_RSTICK 10
+#define PROCON_BTN_LSTICK 11
+#define PROCON_BTN_HOME 12
+#define PROCON_BTN_CAPTURE 13
+#define PROCON_BTN_DOWN 16
+#define PROCON_BTN_UP 17
+#define PROCON_BTN_RIGHT 18
+#define PROCON_BTN_LEFT 19
+#define PROCON_BTN_LEFT_SR 20
+#define PROCON_BTN_LEFT_SL 21
+#define PROCON_BTN_L 22
+#define PROCON_BTN_ZL 23
+#define PROCON_BTN_COUNT 24
+
+enum procon_axis {
+    PROCON_AXIS_LX,
+    PROCON_AXIS_LY,
+    PROCON_AXIS_RX,
+    PROCON_AXIS_RY,
+    PROCON_AXIS_COUNT,
 };
 
 struct input_response {
     __u8 report_id;
     __u8 timer;
     __u8 battery_and_connection_type;
-    struct button_info button_data;
-    struct analog_stick_info stick_data;
+    __u32 buttons; // One bit per PROCON_BTN_*.
+    __s16 sticks[PROCON_AXIS_COUNT];
     __u8 vibrator;
     __u8 subcommand_ack;
     __u8 subcommand_id;
     __u8 subcommand_reply[35];
 };
 
+static inline __s8 procon_dpad_vertical(const __u32 buttons) {
+    return ((buttons >> PROCON_BTN_DOWN) & 0x1) - ((buttons >> PROCON_BTN_UP) & 0x1);
+}
+
+static inline __s8 procon_dpad_horizontal(const __u32 buttons) {
+    return ((buttons >> PROCON_BTN_RIGHT) & 0x1) - ((buttons >> PROCON_BTN_LEFT) & 0x1);
+}
+
 // Functions.
 void init_packet(struct packet *p, const __u8 command, const __u8 subcommand, const __u8 *args, const size_t args_len);
 
 void packet_add_rumble(struct packet *p);
 
+void init_spi_read_packet(struct packet *p, const __u32 address, const __u8 len);
+
+size_t init_setup_packets(struct packet *packets, const size_t count, const bool imu);
+
+void procon_calibration_default(struct procon_calibration *cal);
+
+void procon_imu_calibration_default(struct procon_imu_calibration *cal);
+
 int decode_spi_read(__u8 *buf, const __u8 *data, const size_t len);
 
-int decode_message(struct input_response *resp, const __u8 *resp_data, const size_t len, struct controller *c);
+__u32 decode_spi_address(const __u8 *data);
+
+int decode_stick_calibration(struct procon_calibration *cal, const __u8 *data, const size_t len);
+
+int decode_imu_calibration(struct procon_imu_calibration *cal, const __u8 *data, const size_t len);
+
+int decode_imu(struct procon_imu_sample *samples, const __u8 *resp_data, const size_t len);
+
+int decode_message(struct input_response *resp, const __u8 *resp_data, const size_t len, const struct procon_device_desc *desc, const struct procon_calibration *cal);
 
 int decode_device_information(struct controller_info *resp, const __u8 *data, const size_t len);
 
-char *format_controller_type(const enum controller_type type);
+const char *format_controller_type(const enum controller_type type);
 
-char *format_lpm(const __u8 low_power_mode);
+const char *format_lpm(const __u8 low_power_mode);
 
-char *format_colour_mode(const __u8 colour_mode);
+const char *format_colour_mode(const __u8 colour_mode);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,163 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/device.h>
+#include <linux/power_supply.h>
+#include <linux/workqueue.h>
+
+#include "commands.h"
+#include "packet.h"
+#include "procon-controller.h"
+#include "procon-output.h"
+#include "procon-stream.h"
+#include "procon-battery.h"
+
+static unsigned int battery_poll_s = 60;
+module_param(battery_poll_s, uint, 0644);
+MODULE_PARM_DESC(battery_poll_s, "Seconds between battery requests while a controller only sends simple reports, 0 to disable.");
+
+static const enum power_supply_property procon_battery_props[] = {
+    POWER_SUPPLY_PROP_PRESENT,
+    POWER_SUPPLY_PROP_SCOPE,
+    POWER_SUPPLY_PROP_STATUS,
+    POWER_SUPPLY_PROP_CAPACITY_LEVEL,
+    POWER_SUPPLY_PROP_CAPACITY,
+};
+
+static int procon_battery_capacity_level(__u8 level) {
+    switch (level) {
+    case 0:
+    case 1:
+        return POWER_SUPPLY_CAPACITY_LEVEL_CRITICAL;
+    case 2:
+        return POWER_SUPPLY_CAPACITY_LEVEL_LOW;
+    case 3:
+        return POWER_SUPPLY_CAPACITY_LEVEL_NORMAL;
+    case 4:
+        return POWER_SUPPLY_CAPACITY_LEVEL_FULL;
+    default:
+        return POWER_SUPPLY_CAPACITY_LEVEL_UNKNOWN;
+    }
+}
+
+static int procon_battery_get_property(struct power_supply *psy, enum power_supply_property psp, union power_supply_propval *val) {
+    struct controller *c = power_supply_get_drvdata(psy);
+    __u8 level = READ_ONCE(c->battery_level);
+
+    switch (psp) {
+    case POWER_SUPPLY_PROP_PRESENT:
+        val->intval = 1;
+        break;
+
+    case POWER_SUPPLY_PROP_SCOPE:
+        val->intval = POWER_SUPPLY_SCOPE_DEVICE;
+        break;
+
+    case POWER_SUPPLY_PROP_STATUS:
+        if (level == PROCON_BATTERY_UNKNOWN) {
+            val->intval = POWER_SUPPLY_STATUS_UNKNOWN;
+        } else if (READ_ONCE(c->charging)) {
+            val->intval = POWER_SUPPLY_STATUS_CHARGING;
+        } else if (READ_ONCE(c->powered) && level == 4) {
+            val->intval = POWER_SUPPLY_STATUS_FULL;
+        } else {
+            val->intval = POWER_SUPPLY_STATUS_DISCHARGING;
+        }
+        break;
+
+    case POWER_SUPPLY_PROP_CAPACITY_LEVEL:
+        val->intval = procon_battery_capacity_level(level);
+        break;
+
+    case POWER_SUPPLY_PROP_CAPACITY:
+        // The controller only knows five levels.
+        if (level == PROCON_BATTERY_UNKNOWN) {
+            return -ENODATA;
+        }
+
+        val->intval = level * 25;
+        break;
+
+    default:
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+// The simple reports have no battery state, but every subcommand reply does.
+static void procon_battery_work(struct work_struct *work) {
+    struct controller *c = container_of(to_delayed_work(work), struct controller, battery_work);
+    unsigned int interval = READ_ONCE(battery_poll_s);
+    struct packet p;
+
+    if (interval == 0) {
+        return;
+    }
+
+    if (READ_ONCE(c->report_mode) == PROCON_REPORT_SIMPLE) {
+        init_packet(&p, PROCON_CMD_COMMAND_AND_RUMBLE, PROCON_SUB_GET_CONTROLLER_STATE, NULL, 0);
+        send_message(c, &p);
+    }
+
+    schedule_delayed_work(&c->battery_work, interval * HZ);
+}
+
+void procon_battery_init(struct controller *c) {
+    c->battery_level = PROCON_BATTERY_UNKNOWN;
+    INIT_DELAYED_WORK(&c->battery_work, procon_battery_work);
+}
+
+int procon_battery_register(struct controller *c) {
+    struct device *dev = &c->handler->dev;
+    struct power_supply_config config = {
+        .drv_data = c,
+    };
+
+    c->battery_desc.name = devm_kasprintf(dev, GFP_KERNEL, "procon_battery_%d", c->controller_id);
+    if (c->battery_desc.name == NULL) {
+        return -ENOMEM;
+    }
+
+    c->battery_desc.type = POWER_SUPPLY_TYPE_BATTERY;
+    c->battery_desc.properties = procon_battery_props;
+    c->battery_desc.num_properties = ARRAY_SIZE(procon_battery_props);
+    c->battery_desc.get_property = procon_battery_get_property;
+
+    c->battery = devm_power_supply_register(dev, &c->battery_desc, &config);
+    if (IS_ERR(c->battery)) {
+        int ret = PTR_ERR(c->battery);
+
+        c->battery = NULL;
+        return ret;
+    }
+
+    if (battery_poll_s > 0) {
+        schedule_delayed_work(&c->battery_work, battery_poll_s * HZ);
+    }
+
+    return 0;
+}
+
+// Called from the event path. Only a real change reaches userspace.
+void procon_battery_update(struct controller *c, __u8 battery_and_connection_type) {
+    __u8 level = battery_and_connection_type >> 5;
+    __u8 charging = (battery_and_connection_type >> 4) & 0x1;
+    __u8 powered = battery_and_connection_type & 0x1;
+
+    if (level == c->battery_level && charging == c->charging && powered == c->powered) {
+        return;
+    }
+
+    WRITE_ONCE(c->battery_level, level);
+    WRITE_ONCE(c->charging, charging);
+    WRITE_ONCE(c->powered, powered);
+
+    if (c->battery != NULL) {
+        power_supply_changed(c->battery);
+    }
+}
+
+// Called once no more reports can come in.
+void procon_battery_stop(struct controller *c) {
+    cancel_delayed_work_sync(&c->battery_work);
+}
@@ -0,0 +1,17 @@
+#include "procon-controller.h"
+
+#ifndef __PROCON_BATTERY_H__
+#define __PROCON_BATTERY_H__
+
+// Battery level before the first report that carries one.
+#define PROCON_BATTERY_UNKNOWN 0xFF
+
+void procon_battery_init(struct controller *c);
+
+int procon_battery_register(struct controller *c);
+
+void procon_battery_update(struct controller *c, __u8 battery_and_connection_type);
+
+void procon_battery_stop(struct controller *c);
+
+#endif
@@ -0,0 +1,30 @@
+#include <linux/kernel.h>
+#include <linux/hid.h>
+#include <linux/error-injection.h>
+
+#include "packet.h"
+#include "procon-bpf.h"
+#include "procon-controller.h"
+
+// Only here for BPF programs to attach to, see procon-bpf.h.
+// Not inlined, so every report really makes the call. Error injection lets fmod_ret programs change what it returns.
+noinline int procon_bpf_report(struct hid_device *hdev, const struct procon_bpf_state *state) {
+    return 0;
+}
+ALLOW_ERROR_INJECTION(procon_bpf_report, ERRNO);
+
+// Returns non-zero when a program wants the report dropped.
+int procon_bpf_filter(struct controller *c, const struct input_response *resp) {
+    struct procon_bpf_state state = {
+        .version = PROCON_BPF_STATE_VERSION,
+        .size = sizeof(struct procon_bpf_state),
+        .controller_id = c->controller_id,
+        .product = c->handler->product,
+        .report_id = resp->report_id,
+        .buttons = resp->buttons,
+    };
+
+    memcpy(state.sticks, resp->sticks, sizeof(state.sticks));
+
+    return procon_bpf_report(c->handler, &state);
+}
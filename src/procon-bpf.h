@@ -0,0 +1,51 @@
+#include <linux/types.h>
+
+#ifndef __PROCON_BPF_H__
+#define __PROCON_BPF_H__
+
+// What BPF programs get to see of the reports, kept stable across versions of the driver.
+//
+// There are two places to hook in:
+//
+// - Before decoding. HID-BPF programs on the device_event hook run on the raw report before
+//   the driver sees it, and may rewrite it in place. The offsets of full (0x30, 0x31, 0x21) reports
+//   are below. Each stick is two 12 bit values, X in the low 12 bits of the three bytes and
+//   Y in the high 12 bits, both little endian and uncalibrated.
+//
+// - After decoding. procon_bpf_report() is called with the decoded state of every input
+//   report, after calibration and stick shaping and before anything reaches the input device.
+//   An fmod_ret program on it that returns an error drops the report, the input device then
+//   keeps the state of the last report that went through.
+
+#define PROCON_BPF_RAW_REPORT_ID 0
+#define PROCON_BPF_RAW_BUTTONS 3 // 3 bytes, bit n is PROCON_BTN_* n.
+#define PROCON_BPF_RAW_LEFT_STICK 6 // 3 bytes.
+#define PROCON_BPF_RAW_RIGHT_STICK 9 // 3 bytes.
+
+#define PROCON_BPF_STATE_VERSION 1
+
+// Fields are only ever added at the end, size tells how many there are.
+struct procon_bpf_state {
+    __u16 version; // PROCON_BPF_STATE_VERSION.
+    __u16 size; // sizeof(struct procon_bpf_state).
+    __s32 controller_id; // As in /proc/procon/controllerN.
+    __u16 product; // USB product id, tells the device types apart.
+    __u8 report_id; // 0x30, 0x31, 0x21 or 0x3F.
+    __u8 reserved;
+    __u32 buttons; // Bit n is PROCON_BTN_* n, these follow the report and do not change.
+    __s16 sticks[4]; // LX, LY, RX, RY from -32767 to 32767, Y is positive downwards.
+};
+
+#ifdef __KERNEL__
+
+struct hid_device;
+struct controller;
+struct input_response;
+
+int procon_bpf_report(struct hid_device *hdev, const struct procon_bpf_state *state);
+
+int procon_bpf_filter(struct controller *c, const struct input_response *resp);
+
+#endif
+
+#endif
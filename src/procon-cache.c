@@ -0,0 +1,196 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/string.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/etherdevice.h>
+#include <linux/seq_file.h>
+
+#include "packet.h"
+#include "procon-controller.h"
+#include "procon-cache.h"
+#include "procon-gyro.h"
+
+// What a probe would otherwise read from the controller, by MAC address.
+struct procon_cache_entry {
+    struct list_head node; // Most recently used first.
+    struct controller_info info;
+    bool has_calibration;
+    __u8 stick_calibration[PROCON_SPI_STICK_CALIBRATION_LENGTH];
+    bool has_imu_calibration; // Only once gyro aim was used, it is read on demand.
+    __u8 imu_calibration[PROCON_SPI_IMU_CALIBRATION_LENGTH];
+    unsigned int hits;
+};
+
+static bool probe_cache = true;
+module_param(probe_cache, bool, 0644);
+MODULE_PARM_DESC(probe_cache, "Remember controller info and calibration to skip flash reads on reconnect.");
+
+static struct procon_cache_entry procon_cache_entries[PROCON_CACHE_SIZE];
+static unsigned int procon_cache_used;
+static LIST_HEAD(procon_cache);
+static DEFINE_SPINLOCK(procon_cache_lock);
+
+static unsigned int procon_cache_hits;
+static unsigned int procon_cache_misses;
+static unsigned int procon_cache_invalidations;
+
+static struct procon_cache_entry *procon_cache_find(const __u8 *mac) {
+    struct procon_cache_entry *entry;
+
+    list_for_each_entry(entry, &procon_cache, node) {
+        if (ether_addr_equal(entry->info.controller_mac_addr, mac)) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+// Fills in the info and calibration of a controller seen before.
+// The Bluetooth address in the HID device is all there is to go on at this point,
+// the caller still checks the firmware version once the controller sends its info.
+bool procon_cache_lookup(struct controller *c) {
+    struct procon_cache_entry *entry;
+    struct procon_cache_entry found;
+    struct procon_calibration calibration;
+    unsigned long flags;
+    __u8 mac[ETH_ALEN] __aligned(2);
+
+    if (!READ_ONCE(probe_cache) || !mac_pton(c->handler->uniq, mac)) {
+        return false;
+    }
+
+    spin_lock_irqsave(&procon_cache_lock, flags);
+
+    entry = procon_cache_find(mac);
+    if (entry == NULL || !entry->has_calibration) {
+        procon_cache_misses++;
+        spin_unlock_irqrestore(&procon_cache_lock, flags);
+        return false;
+    }
+
+    entry->hits++;
+    procon_cache_hits++;
+    list_move(&entry->node, &procon_cache);
+    found = *entry;
+
+    spin_unlock_irqrestore(&procon_cache_lock, flags);
+
+    calibration = c->calibration;
+    if (decode_stick_calibration(&calibration, found.stick_calibration, sizeof(found.stick_calibration))) {
+        return false;
+    }
+
+    spin_lock_irqsave(&c->info_lock, flags);
+    c->info = found.info;
+    c->calibration = calibration;
+    memcpy(c->stick_calibration, found.stick_calibration, sizeof(c->stick_calibration));
+    c->calibration_valid = true;
+    spin_unlock_irqrestore(&c->info_lock, flags);
+
+    // Gyro aim then does not read it again.
+    if (found.has_imu_calibration && procon_gyro_set_calibration(c, found.imu_calibration, sizeof(found.imu_calibration)) == 0) {
+        spin_lock_irqsave(&c->info_lock, flags);
+        memcpy(c->imu_calibration, found.imu_calibration, sizeof(c->imu_calibration));
+        c->imu_calibration_valid = true;
+        spin_unlock_irqrestore(&c->info_lock, flags);
+    }
+
+    return true;
+}
+
+// Remembers what is known about a controller, once its address is.
+void procon_cache_store(struct controller *c) {
+    struct procon_cache_entry *entry;
+    struct controller_info info;
+    bool has_calibration;
+    __u8 stick_calibration[PROCON_SPI_STICK_CALIBRATION_LENGTH];
+    bool has_imu_calibration;
+    __u8 imu_calibration[PROCON_SPI_IMU_CALIBRATION_LENGTH];
+    unsigned long flags;
+
+    if (!READ_ONCE(probe_cache)) {
+        return;
+    }
+
+    // Replies update these from the event path.
+    spin_lock_irqsave(&c->info_lock, flags);
+    info = c->info;
+    has_calibration = c->calibration_valid;
+    memcpy(stick_calibration, c->stick_calibration, sizeof(stick_calibration));
+    has_imu_calibration = c->imu_calibration_valid;
+    memcpy(imu_calibration, c->imu_calibration, sizeof(imu_calibration));
+    spin_unlock_irqrestore(&c->info_lock, flags);
+
+    if (is_zero_ether_addr(info.controller_mac_addr)) {
+        return;
+    }
+
+    spin_lock_irqsave(&procon_cache_lock, flags);
+
+    entry = procon_cache_find(info.controller_mac_addr);
+    if (entry == NULL) {
+        // Reuse the least recently used entry once the cache is full.
+        if (procon_cache_used < PROCON_CACHE_SIZE) {
+            entry = &procon_cache_entries[procon_cache_used++];
+        } else {
+            entry = list_last_entry(&procon_cache, struct procon_cache_entry, node);
+            list_del(&entry->node);
+        }
+
+        memset(entry, 0, sizeof(*entry));
+    } else {
+        list_del(&entry->node);
+    }
+
+    list_add(&entry->node, &procon_cache);
+
+    entry->info = info;
+    entry->has_calibration = has_calibration;
+    memcpy(entry->stick_calibration, stick_calibration, sizeof(entry->stick_calibration));
+    // Kept from an earlier connection when gyro aim was not used on this one.
+    if (has_imu_calibration) {
+        entry->has_imu_calibration = true;
+        memcpy(entry->imu_calibration, imu_calibration, sizeof(entry->imu_calibration));
+    }
+
+    spin_unlock_irqrestore(&procon_cache_lock, flags);
+}
+
+void procon_cache_invalidate(const __u8 *mac) {
+    struct procon_cache_entry *entry;
+    unsigned long flags;
+
+    spin_lock_irqsave(&procon_cache_lock, flags);
+
+    entry = procon_cache_find(mac);
+    if (entry != NULL) {
+        entry->has_calibration = false;
+        entry->has_imu_calibration = false;
+        procon_cache_invalidations++;
+    }
+
+    spin_unlock_irqrestore(&procon_cache_lock, flags);
+}
+
+int procon_cache_show(struct seq_file *m) {
+    struct procon_cache_entry *entry;
+    unsigned long flags;
+
+    spin_lock_irqsave(&procon_cache_lock, flags);
+
+    seq_printf(m, "entries=%u hits=%u misses=%u invalidations=%u\n",
+        procon_cache_used, procon_cache_hits, procon_cache_misses, procon_cache_invalidations);
+
+    list_for_each_entry(entry, &procon_cache, node) {
+        seq_printf(m, "%pM fw=%u.%u calibration=%u imu_calibration=%u hits=%u\n",
+            entry->info.controller_mac_addr,
+            entry->info.firmware_version_major, entry->info.firmware_version_minor,
+            entry->has_calibration, entry->has_imu_calibration, entry->hits);
+    }
+
+    spin_unlock_irqrestore(&procon_cache_lock, flags);
+
+    return 0;
+}
@@ -0,0 +1,20 @@
+#include <linux/types.h>
+#include <linux/seq_file.h>
+
+#include "procon-controller.h"
+
+#ifndef __PROCON_CACHE_H__
+#define __PROCON_CACHE_H__
+
+// Number of controllers remembered between connections.
+#define PROCON_CACHE_SIZE 16
+
+bool procon_cache_lookup(struct controller *c);
+
+void procon_cache_store(struct controller *c);
+
+void procon_cache_invalidate(const __u8 *mac);
+
+int procon_cache_show(struct seq_file *m);
+
+#endif
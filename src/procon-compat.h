@@ -0,0 +1,21 @@
+#include <linux/version.h>
+#include <linux/hrtimer.h>
+#include <linux/proc_fs.h>
+
+#ifndef __PROCON_COMPAT_H__
+#define __PROCON_COMPAT_H__
+
+// Kernels before 5.17 call this PDE_DATA.
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 17, 0)
+#define pde_data(inode) PDE_DATA(inode)
+#endif
+
+// Kernels before 6.13 set the callback after hrtimer_init().
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 13, 0)
+static inline void hrtimer_setup(struct hrtimer *timer, enum hrtimer_restart (*function)(struct hrtimer *), clockid_t clock_id, enum hrtimer_mode mode) {
+    hrtimer_init(timer, clock_id, mode);
+    timer->function = function;
+}
+#endif
+
+#endif
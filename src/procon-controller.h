@@ -2,55 +2,128 @@
 #include <linux/hid.h>
 #include <linux/input.h>
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/power_supply.h>
+#include <linux/proc_fs.h>
+
+#include "packet.h"
+#include "procon-output.h"
+#include "procon-stick.h"
+#include "procon-keymap.h"
+#include "procon-profile.h"
+#include "procon-mcu.h"
+#include "procon-gyro.h"
+#include "procon-probe.h"
 
 #ifndef __PROCON_CONTROLLER_H__
 #define __PROCON_CONTROLLER_H__
 
-#define PROCON_STICK_MAX 32767
 #define PROCON_STICK_FUZZ 300
 #define PROCON_STICK_FLAT 1500
 
-#define CALIBRATION_DEFAULT_CENTER 2000
-#define CALIBRATION_DEFAULT_MIN 500
-#define CALIBRATION_DEFAULT_MAX 3500
-
-enum controller_type {
-    LEFT_JOYCON = 1,
-    RIGHT_JOYCON = 2,
-    PROCON = 3,
-};
-
-struct controller_info {
-    __u8 firmware_version_major;
-    __u8 firmware_version_minor;
-    enum controller_type controller_type;
-    __u8 *controller_mac_addr; // Has length 6.
-    __u8 low_power_mode;
-    __u8 colour_mode;
-};
+struct procon_pair;
+struct procon_device_desc;
 
 struct controller {
     struct input_dev *input;
+    struct procon_pair *pair; // Only set for JoyCons merged into one device.
+    bool merged;
     struct hid_device *handler;
-    struct controller_info *info;
+    const struct procon_device_desc *desc;
+    struct controller_info info;
 
-    __s32 rs_center;
-    __s32 rs_min;
-    __s32 rs_max;
+    // Factory stick calibration as read from flash.
+    __u8 stick_calibration[PROCON_SPI_STICK_CALIBRATION_LENGTH];
+    bool calibration_valid;
+    // The same for the IMU, only read once gyro aim needs it.
+    __u8 imu_calibration[PROCON_SPI_IMU_CALIBRATION_LENGTH];
+    bool imu_calibration_valid;
+    bool cached; // Info and calibration came from the cache and still need checking.
 
-    __s32 ls_center;
-    __s32 ls_min;
-    __s32 ls_max;
+    struct procon_calibration calibration;
 
     __u8 current_packet_num;
-    unsigned int time_last_cmd_sent;
+    struct procon_output output;
+
+    // Battery state from the last full report.
+    // Level goes from 0 (empty) to 4 (full).
+    __u8 battery_level;
+    __u8 charging;
+    __u8 powered;
+    struct power_supply *battery;
+    struct power_supply_desc battery_desc;
+    struct delayed_work battery_work;
+
+    // Report statistics.
+    unsigned int reports_received;
+    unsigned int report_rate;
+    unsigned int rate_window_count;
+    unsigned long rate_window_start;
+
+    // Error counters.
+    unsigned int decode_errors;
+    unsigned int send_errors;
     
-    __u8 controller_id;
+    // Report mode, follows whether anyone has the input device open and whether the controller is in use.
+    __u8 report_mode;
+    bool input_open;
+    bool idle;
+    bool idle_lpm; // Low power mode turned on by the idle policy.
+    __u32 idle_buttons; // Last input state, to tell a change from noise.
+    __s16 idle_sticks[PROCON_AXIS_COUNT];
+    unsigned long last_change;
+    struct delayed_work idle_work;
+    spinlock_t stream_lock;
+    bool stream_stopped; // Going away, the idle and watchdog work are not queued anymore.
+
+    // Report stream watchdog.
+    unsigned long last_full_report;
+    struct delayed_work watchdog_work;
+    unsigned int resyncs;
+    unsigned int resync_backoff; // Resyncs in a row that brought no full reports back, guarded by stream_lock.
+
+    // Stick shaping, compiled from the configuration.
+    struct procon_stick sticks[PROCON_STICK_ID_COUNT];
+    spinlock_t stick_lock;
+
+    // Button and axis remapping, guarded by input_lock.
+    struct procon_keymap keymap;
+
+    // Sync rate limiting. Reports above the rate are merged and flushed by the timer.
+    unsigned int max_sync_rate; // 0 is unlimited.
+    struct input_response sync_state;
+    __u32 synced_buttons; // Buttons as of the last sync.
+    bool sync_pending;
+    ktime_t next_sync;
+    struct hrtimer sync_timer;
+    unsigned int syncs; // Input events actually sent, a merged report counts once.
+    unsigned int syncs_coalesced;
+
+    // NFC/IR MCU data.
+    struct procon_mcu mcu;
+
+    // Gyro aim.
+    struct procon_gyro gyro;
+
+    // How long connecting took, step by step.
+    struct procon_probe_timing probe;
+
+#ifdef PROCON_PROFILE
+    struct procon_profile profile;
+#endif
+
+    int controller_id;
     __u8 player_indicator;
+    struct proc_dir_entry *proc_dir;
+    atomic_t proc_event; // Bumped whenever the info, led or lpm file changes.
+    struct dentry *debugfs_dir;
     
-    struct mutex lock;
-    struct mutex proc_lock;
-    struct mutex input_lock;
+    struct mutex lock; // Serialises raw output to the device.
+    spinlock_t info_lock; // Info and calibration, updated from the event path which can run in interrupt context.
+    spinlock_t input_lock;
 };
 
 #endif
\ No newline at end of file
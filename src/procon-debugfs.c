@@ -0,0 +1,116 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "procon-cache.h"
+#include "procon-controller.h"
+#include "procon-debugfs.h"
+#include "procon-output.h"
+#include "procon-probe.h"
+#include "procon-profile.h"
+#include "procon-stick.h"
+#include "procon-virtual.h"
+
+// Root of the debug files, /sys/kernel/debug/procon.
+static struct dentry *procon_debugfs_dir = NULL;
+
+static int procon_debugfs_pacing_show(struct seq_file *m, void *v) {
+    return procon_output_show_pacing(m, m->private);
+}
+DEFINE_SHOW_ATTRIBUTE(procon_debugfs_pacing);
+
+static int procon_debugfs_filter_show(struct seq_file *m, void *v) {
+    return procon_stick_show_filter(m, m->private);
+}
+DEFINE_SHOW_ATTRIBUTE(procon_debugfs_filter);
+
+static int procon_debugfs_probe_show(struct seq_file *m, void *v) {
+    return procon_probe_show(m, m->private);
+}
+DEFINE_SHOW_ATTRIBUTE(procon_debugfs_probe);
+
+#ifdef PROCON_PROFILE
+static int procon_debugfs_profile_show(struct seq_file *m, void *v) {
+    return procon_profile_show(m, m->private);
+}
+DEFINE_SHOW_ATTRIBUTE(procon_debugfs_profile);
+#endif
+
+static int procon_debugfs_cache_show(struct seq_file *m, void *v) {
+    return procon_cache_show(m);
+}
+DEFINE_SHOW_ATTRIBUTE(procon_debugfs_cache);
+
+static int procon_debugfs_virtual_show(struct seq_file *m, void *v) {
+    return procon_virtual_show(m);
+}
+
+static int procon_debugfs_virtual_open(struct inode *inode, struct file *file) {
+    return single_open(file, procon_debugfs_virtual_show, NULL);
+}
+
+static ssize_t procon_debugfs_virtual_write(struct file *file, const char __user *buffer, size_t len, loff_t *offset) {
+    char *config;
+    int ret;
+
+    if (len > PAGE_SIZE) {
+        return -EINVAL;
+    }
+
+    config = memdup_user_nul(buffer, len);
+    if (IS_ERR(config)) {
+        return PTR_ERR(config);
+    }
+
+    ret = procon_virtual_configure(config);
+
+    kfree(config);
+    return ret < 0 ? ret : len;
+}
+
+// Load generator, see procon-virtual.h.
+static const struct file_operations procon_debugfs_virtual_fops = {
+    .owner = THIS_MODULE,
+    .open = procon_debugfs_virtual_open,
+    .read = seq_read,
+    .write = procon_debugfs_virtual_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+void procon_debugfs_add(struct controller *c) {
+    char name[24];
+
+    if (procon_debugfs_dir == NULL) {
+        return;
+    }
+
+    snprintf(name, sizeof(name), "controller%d", c->controller_id);
+    c->debugfs_dir = debugfs_create_dir(name, procon_debugfs_dir);
+
+    debugfs_create_file("pacing", 0444, c->debugfs_dir, c, &procon_debugfs_pacing_fops);
+    debugfs_create_file("filter", 0444, c->debugfs_dir, c, &procon_debugfs_filter_fops);
+    debugfs_create_file("probe", 0444, c->debugfs_dir, c, &procon_debugfs_probe_fops);
+#ifdef PROCON_PROFILE
+    debugfs_create_file("profile", 0444, c->debugfs_dir, c, &procon_debugfs_profile_fops);
+#endif
+}
+
+void procon_debugfs_remove(struct controller *c) {
+    debugfs_remove_recursive(c->debugfs_dir);
+    c->debugfs_dir = NULL;
+}
+
+void procon_debugfs_init(void) {
+    procon_debugfs_dir = debugfs_create_dir("procon", NULL);
+    debugfs_create_file("cache", 0444, procon_debugfs_dir, NULL, &procon_debugfs_cache_fops);
+    debugfs_create_file("virtual", 0644, procon_debugfs_dir, NULL, &procon_debugfs_virtual_fops);
+}
+
+void procon_debugfs_exit(void) {
+    debugfs_remove_recursive(procon_debugfs_dir);
+    procon_debugfs_dir = NULL;
+}
@@ -0,0 +1,14 @@
+#include "procon-controller.h"
+
+#ifndef __PROCON_DEBUGFS_H__
+#define __PROCON_DEBUGFS_H__
+
+void procon_debugfs_add(struct controller *c);
+
+void procon_debugfs_remove(struct controller *c);
+
+void procon_debugfs_init(void);
+
+void procon_debugfs_exit(void);
+
+#endif
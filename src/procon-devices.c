@@ -0,0 +1,148 @@
+#include <linux/kernel.h>
+#include <linux/input.h>
+
+#include "hids.h"
+#include "packet.h"
+#include "procon-devices.h"
+
+static const struct procon_button_desc procon_buttons[] = {
+    // Buttons on the right
+    { PROCON_BTN_Y, BTN_NORTH },
+    { PROCON_BTN_X, BTN_WEST },
+    { PROCON_BTN_B, BTN_SOUTH },
+    { PROCON_BTN_A, BTN_EAST },
+
+    // Buttons in the middle.
+    { PROCON_BTN_PLUS, BTN_START },
+    { PROCON_BTN_MINUS, BTN_SELECT },
+    { PROCON_BTN_HOME, BTN_MODE },
+
+    // Triggers and bumpers.
+    { PROCON_BTN_R, BTN_TR },
+    { PROCON_BTN_L, BTN_TL },
+    { PROCON_BTN_ZR, BTN_TR2 },
+    { PROCON_BTN_ZL, BTN_TL2 },
+
+    // Stick buttons.
+    { PROCON_BTN_LSTICK, BTN_THUMBL },
+    { PROCON_BTN_RSTICK, BTN_THUMBR },
+};
+
+static const struct procon_button_desc joycon_left_buttons[] = {
+    { PROCON_BTN_MINUS, BTN_SELECT },
+    { PROCON_BTN_L, BTN_TL },
+    { PROCON_BTN_ZL, BTN_TL2 },
+    { PROCON_BTN_LSTICK, BTN_THUMBL },
+};
+
+static const struct procon_button_desc joycon_right_buttons[] = {
+    { PROCON_BTN_Y, BTN_NORTH },
+    { PROCON_BTN_X, BTN_WEST },
+    { PROCON_BTN_B, BTN_SOUTH },
+    { PROCON_BTN_A, BTN_EAST },
+    { PROCON_BTN_PLUS, BTN_START },
+    { PROCON_BTN_HOME, BTN_MODE },
+    { PROCON_BTN_R, BTN_TR },
+    { PROCON_BTN_ZR, BTN_TR2 },
+    { PROCON_BTN_RSTICK, BTN_THUMBR },
+};
+
+static const struct procon_axis_desc procon_axes[] = {
+    { PROCON_AXIS_LX, ABS_X },
+    { PROCON_AXIS_LY, ABS_Y },
+    { PROCON_AXIS_RX, ABS_RX },
+    { PROCON_AXIS_RY, ABS_RY },
+};
+
+static const struct procon_axis_desc joycon_left_axes[] = {
+    { PROCON_AXIS_LX, ABS_X },
+    { PROCON_AXIS_LY, ABS_Y },
+};
+
+static const struct procon_axis_desc joycon_right_axes[] = {
+    { PROCON_AXIS_RX, ABS_RX },
+    { PROCON_AXIS_RY, ABS_RY },
+};
+
+static const __u8 procon_simple_buttons[16] = {
+    PROCON_BTN_B, PROCON_BTN_A, PROCON_BTN_Y, PROCON_BTN_X,
+    PROCON_BTN_L, PROCON_BTN_R, PROCON_BTN_ZL, PROCON_BTN_ZR,
+    PROCON_BTN_MINUS, PROCON_BTN_PLUS, PROCON_BTN_LSTICK, PROCON_BTN_RSTICK,
+    PROCON_BTN_HOME, PROCON_BTN_CAPTURE, PROCON_SIMPLE_NONE, PROCON_SIMPLE_NONE,
+};
+
+static const __u8 joycon_left_simple_buttons[16] = {
+    PROCON_BTN_DOWN, PROCON_BTN_RIGHT, PROCON_BTN_LEFT, PROCON_BTN_UP,
+    PROCON_BTN_LEFT_SL, PROCON_BTN_LEFT_SR, PROCON_SIMPLE_NONE, PROCON_SIMPLE_NONE,
+    PROCON_BTN_MINUS, PROCON_BTN_PLUS, PROCON_BTN_LSTICK, PROCON_BTN_RSTICK,
+    PROCON_BTN_HOME, PROCON_BTN_CAPTURE, PROCON_BTN_L, PROCON_BTN_ZL,
+};
+
+static const __u8 joycon_right_simple_buttons[16] = {
+    PROCON_BTN_A, PROCON_BTN_X, PROCON_BTN_B, PROCON_BTN_Y,
+    PROCON_BTN_RIGHT_SL, PROCON_BTN_RIGHT_SR, PROCON_SIMPLE_NONE, PROCON_SIMPLE_NONE,
+    PROCON_BTN_MINUS, PROCON_BTN_PLUS, PROCON_BTN_LSTICK, PROCON_BTN_RSTICK,
+    PROCON_BTN_HOME, PROCON_BTN_CAPTURE, PROCON_BTN_R, PROCON_BTN_ZR,
+};
+
+#define PROCON_DPAD_MASK (BIT(PROCON_BTN_DOWN) | BIT(PROCON_BTN_UP) | BIT(PROCON_BTN_RIGHT) | BIT(PROCON_BTN_LEFT))
+
+#define JOYCON_LEFT_MASK (PROCON_DPAD_MASK | BIT(PROCON_BTN_MINUS) | BIT(PROCON_BTN_L) | BIT(PROCON_BTN_ZL) | BIT(PROCON_BTN_LSTICK))
+
+#define JOYCON_RIGHT_MASK (BIT(PROCON_BTN_Y) | BIT(PROCON_BTN_X) | BIT(PROCON_BTN_B) | BIT(PROCON_BTN_A) | \
+    BIT(PROCON_BTN_PLUS) | BIT(PROCON_BTN_HOME) | BIT(PROCON_BTN_R) | BIT(PROCON_BTN_ZR) | BIT(PROCON_BTN_RSTICK))
+
+const struct procon_device_desc procon_desc_procon = {
+    .name = "Nintendo Switch ProCon",
+    .button_mask = JOYCON_LEFT_MASK | JOYCON_RIGHT_MASK,
+    .sticks = PROCON_STICK_LEFT | PROCON_STICK_RIGHT,
+    .dpad = true,
+    .mcu = true,
+    .simple_buttons = procon_simple_buttons,
+    .simple_dpad = true,
+    .buttons = procon_buttons,
+    .num_buttons = ARRAY_SIZE(procon_buttons),
+    .axes = procon_axes,
+    .num_axes = ARRAY_SIZE(procon_axes),
+};
+
+const struct procon_device_desc procon_desc_joycon_left = {
+    .name = "Nintendo Switch Left JoyCon",
+    .button_mask = JOYCON_LEFT_MASK,
+    .sticks = PROCON_STICK_LEFT,
+    .dpad = true,
+    .mcu = false,
+    .simple_buttons = joycon_left_simple_buttons,
+    .simple_dpad = false,
+    .buttons = joycon_left_buttons,
+    .num_buttons = ARRAY_SIZE(joycon_left_buttons),
+    .axes = joycon_left_axes,
+    .num_axes = ARRAY_SIZE(joycon_left_axes),
+};
+
+const struct procon_device_desc procon_desc_joycon_right = {
+    .name = "Nintendo Switch Right JoyCon",
+    .button_mask = JOYCON_RIGHT_MASK,
+    .sticks = PROCON_STICK_RIGHT,
+    .dpad = false,
+    .mcu = true,
+    .simple_buttons = joycon_right_simple_buttons,
+    .simple_dpad = false,
+    .buttons = joycon_right_buttons,
+    .num_buttons = ARRAY_SIZE(joycon_right_buttons),
+    .axes = joycon_right_axes,
+    .num_axes = ARRAY_SIZE(joycon_right_axes),
+};
+
+const struct procon_device_desc *procon_device_desc(const __u16 product) {
+    switch (product) {
+        case DEVICE_JOYCON_LEFT:
+            return &procon_desc_joycon_left;
+
+        case DEVICE_JOYCON_RIGHT:
+            return &procon_desc_joycon_right;
+
+        default:
+            return &procon_desc_procon;
+    }
+}
@@ -0,0 +1,51 @@
+#include <linux/types.h>
+
+#include "packet.h"
+
+#ifndef __PROCON_DEVICES_H__
+#define __PROCON_DEVICES_H__
+
+#define PROCON_STICK_LEFT 0x1
+#define PROCON_STICK_RIGHT 0x2
+
+// A bit of a simple report that is no button.
+#define PROCON_SIMPLE_NONE 0xFF
+
+struct procon_button_desc {
+    __u8 bit; // PROCON_BTN_*.
+    __u16 code;
+};
+
+struct procon_axis_desc {
+    enum procon_axis axis;
+    __u16 code;
+};
+
+// Everything a device type physically has, and the events it is reported as.
+struct procon_device_desc {
+    const char *name;
+
+    __u32 button_mask;
+    __u8 sticks; // PROCON_STICK_* flags.
+    bool dpad;
+    bool mcu; // Has the NFC/IR MCU.
+
+    // Simple reports have a layout of their own. Bytes 1 and 2 are buttons, PROCON_BTN_* by bit.
+    // Byte 3 is a hat, the d-pad of a ProCon, or just the direction of the stick of a JoyCon.
+    const __u8 *simple_buttons;
+    bool simple_dpad;
+
+    const struct procon_button_desc *buttons;
+    size_t num_buttons;
+
+    const struct procon_axis_desc *axes;
+    size_t num_axes;
+};
+
+extern const struct procon_device_desc procon_desc_procon;
+extern const struct procon_device_desc procon_desc_joycon_left;
+extern const struct procon_device_desc procon_desc_joycon_right;
+
+const struct procon_device_desc *procon_device_desc(const __u16 product);
+
+#endif
@@ -0,0 +1,400 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/math64.h>
+#include <linux/input.h>
+
+#include "commands.h"
+#include "packet.h"
+#include "procon-controller.h"
+#include "procon-devices.h"
+#include "procon-gyro.h"
+#include "procon-input.h"
+#include "procon-output.h"
+#include "procon-stream.h"
+
+static bool gyro_aim = false;
+module_param(gyro_aim, bool, 0644);
+MODULE_PARM_DESC(gyro_aim, "Turn gyro aim on for controllers as they connect.");
+
+static unsigned int gyro_sensitivity = 30;
+module_param(gyro_sensitivity, uint, 0644);
+MODULE_PARM_DESC(gyro_sensitivity, "Default counts of relative motion per degree a controller turns.");
+
+#define PROCON_GYRO_MAX_SENSITIVITY 10000
+
+// Rotation slower than 1 degree per second is drift or a shaking hand.
+#define PROCON_GYRO_DEFAULT_DEADZONE 1000
+
+// The gyro axes that move the pointer, for a controller held flat.
+#define PROCON_GYRO_PITCH 1
+#define PROCON_GYRO_YAW 2
+
+// Must hold the gyro lock.
+static void procon_gyro_compute_scale(struct procon_gyro *g) {
+    for (int i = 0; i < 3; i++) {
+        __s32 range = g->calibration.gyro_sensitivity[i] - g->calibration.gyro_offset[i];
+
+        g->scale[i] = div_s64((__s64) PROCON_GYRO_RANGE_MDPS << 16, range);
+    }
+}
+
+// Rate of one axis of a sample in mdps, zero inside the deadzone. Must hold the gyro lock.
+static __s64 procon_gyro_rate(const struct procon_gyro *g, const struct procon_imu_sample *sample, int axis) {
+    __s32 counts = sample->gyro[axis] - g->calibration.gyro_offset[axis] - g->bias[axis];
+    __s64 mdps = ((__s64) counts * g->scale[axis]) >> 16;
+
+    return abs(mdps) < g->deadzone ? 0 : mdps;
+}
+
+// Integrates the samples of a full report and moves the pointer by whole counts.
+// What is left over is kept for the next report, so slow turns still add up.
+void procon_gyro_input(struct controller *c, const __u8 *data, size_t len) {
+    struct procon_gyro *g = &c->gyro;
+    struct procon_imu_sample samples[PROCON_IMU_SAMPLES];
+    unsigned long flags;
+    __s32 motion[2];
+    __s32 rem;
+
+    if (!READ_ONCE(g->enabled) || decode_imu(samples, data, len)) {
+        return;
+    }
+
+    spin_lock_irqsave(&g->lock, flags);
+
+    if (g->input == NULL) {
+        goto out;
+    }
+
+    for (int i = 0; i < PROCON_IMU_SAMPLES; i++) {
+        // The controller is held still while the bias is measured, nothing moves.
+        if (g->bias_left > 0) {
+            for (int axis = 0; axis < 3; axis++) {
+                g->bias_sum[axis] += samples[i].gyro[axis] - g->calibration.gyro_offset[axis];
+            }
+
+            if (--g->bias_left == 0) {
+                for (int axis = 0; axis < 3; axis++) {
+                    g->bias[axis] = div_s64(g->bias_sum[axis], PROCON_GYRO_BIAS_SAMPLES);
+                }
+            }
+            continue;
+        }
+
+        // mdps over us is in billionths of a degree. Turning left or tilting up is a positive rate.
+        g->remainder[0] -= procon_gyro_rate(g, &samples[i], PROCON_GYRO_YAW) * PROCON_IMU_SAMPLE_US * g->sensitivity;
+        g->remainder[1] -= procon_gyro_rate(g, &samples[i], PROCON_GYRO_PITCH) * PROCON_IMU_SAMPLE_US * g->sensitivity;
+    }
+    g->samples += PROCON_IMU_SAMPLES;
+
+    for (int i = 0; i < 2; i++) {
+        motion[i] = div_s64_rem(g->remainder[i], 1000000000, &rem);
+        g->remainder[i] = rem;
+    }
+
+    if (motion[0] != 0 || motion[1] != 0) {
+        input_report_rel(g->input, REL_X, g->invert_x ? -motion[0] : motion[0]);
+        input_report_rel(g->input, REL_Y, g->invert_y ? -motion[1] : motion[1]);
+        input_sync(g->input);
+        g->events++;
+    }
+
+out:
+    spin_unlock_irqrestore(&g->lock, flags);
+}
+
+// Called with the factory calibration read from flash, or remembered from the last connection.
+int procon_gyro_set_calibration(struct controller *c, const __u8 *data, size_t len) {
+    struct procon_imu_calibration calibration;
+    unsigned long flags;
+
+    if (decode_imu_calibration(&calibration, data, len)) {
+        pr_warn("controller%d has no usable IMU calibration, using defaults.\n", c->controller_id);
+        return -EINVAL;
+    }
+
+    spin_lock_irqsave(&c->gyro.lock, flags);
+    c->gyro.calibration = calibration;
+    c->gyro.calibration_valid = true;
+    procon_gyro_compute_scale(&c->gyro);
+    spin_unlock_irqrestore(&c->gyro.lock, flags);
+
+    return 0;
+}
+
+static void procon_gyro_read_calibration(struct controller *c) {
+    struct packet p;
+    int ret;
+
+    init_spi_read_packet(&p, PROCON_SPI_IMU_CALIBRATION, PROCON_SPI_IMU_CALIBRATION_LENGTH);
+    ret = send_message(c, &p);
+    if (ret < 0) {
+        pr_warn("Could not read IMU calibration of controller%d: %d.\n", c->controller_id, ret);
+    }
+}
+
+// Drops a cached calibration that turned out stale. It is read again now while gyro aim is on,
+// or once it gets turned on.
+void procon_gyro_invalidate_calibration(struct controller *c) {
+    unsigned long flags;
+    bool attached;
+
+    spin_lock_irqsave(&c->gyro.lock, flags);
+    procon_imu_calibration_default(&c->gyro.calibration);
+    c->gyro.calibration_valid = false;
+    procon_gyro_compute_scale(&c->gyro);
+    attached = c->gyro.input != NULL;
+    spin_unlock_irqrestore(&c->gyro.lock, flags);
+
+    if (attached) {
+        procon_gyro_read_calibration(c);
+    }
+}
+
+static void procon_gyro_send_imu(struct controller *c, bool on) {
+    struct packet p;
+    __u8 args[] = {on ? 0x01 : 0x00};
+    int ret;
+
+    init_packet(&p, PROCON_CMD_COMMAND_AND_RUMBLE, PROCON_SUB_SET_IMU, args, sizeof(args));
+    packet_add_rumble(&p);
+
+    ret = send_message(c, &p);
+    if (ret < 0 && ret != -ENODEV) {
+        pr_warn("Could not turn the IMU of controller%d %s: %d.\n", c->controller_id, on ? "on" : "off", ret);
+    }
+}
+
+// The pointer device, kept apart from the gamepad so both get picked up for what they are.
+static struct input_dev *procon_gyro_create(struct controller *c) {
+    struct input_dev *input;
+    int ret;
+
+    input = input_allocate_device();
+    if (input == NULL) {
+        return ERR_PTR(-ENOMEM);
+    }
+
+    input->name = kasprintf(GFP_KERNEL, "%s Gyro [controller %d]", c->desc->name, c->controller_id);
+    input->uniq = kstrdup(c->handler->uniq, GFP_KERNEL);
+    if (input->name == NULL || input->uniq == NULL) {
+        ret = -ENOMEM;
+        goto err_free;
+    }
+
+    input->dev.parent = &c->handler->dev;
+    input->id.bustype = c->handler->bus;
+    input->id.product = c->handler->product;
+    input->id.vendor = c->handler->vendor;
+    input->id.version = c->handler->version;
+
+    input_set_capability(input, EV_REL, REL_X);
+    input_set_capability(input, EV_REL, REL_Y);
+
+    // udev and libinput only take it for a pointer with a button, it is never pressed.
+    input_set_capability(input, EV_KEY, BTN_LEFT);
+    __set_bit(INPUT_PROP_POINTER, input->propbit);
+
+    ret = input_register_device(input);
+    if (ret < 0) {
+        goto err_free;
+    }
+
+    return input;
+
+err_free:
+    kfree(input->name);
+    kfree(input->uniq);
+    input_free_device(input);
+    return ERR_PTR(ret);
+}
+
+// Creates the pointer device and asks for the IMU calibration. The IMU itself is up to the caller.
+static int procon_gyro_attach(struct controller *c) {
+    struct procon_gyro *g = &c->gyro;
+    struct input_dev *input;
+    unsigned long flags;
+
+    input = procon_gyro_create(c);
+    if (IS_ERR(input)) {
+        return PTR_ERR(input);
+    }
+
+    spin_lock_irqsave(&g->lock, flags);
+    if (g->input == NULL) {
+        g->input = input;
+        g->remainder[0] = 0;
+        g->remainder[1] = 0;
+        input = NULL;
+    }
+    WRITE_ONCE(g->enabled, true);
+    spin_unlock_irqrestore(&g->lock, flags);
+
+    // Lost a race with another writer.
+    if (input != NULL) {
+        procon_input_destroy(input);
+    }
+
+    // A controller found in the cache already has it.
+    if (!READ_ONCE(g->calibration_valid)) {
+        procon_gyro_read_calibration(c);
+    }
+
+    return 0;
+}
+
+static void procon_gyro_detach(struct controller *c) {
+    struct input_dev *input;
+    unsigned long flags;
+
+    spin_lock_irqsave(&c->gyro.lock, flags);
+    input = c->gyro.input;
+    c->gyro.input = NULL;
+    WRITE_ONCE(c->gyro.enabled, false);
+    spin_unlock_irqrestore(&c->gyro.lock, flags);
+
+    if (input != NULL) {
+        procon_input_destroy(input);
+    }
+}
+
+// Turning gyro aim on or off also turns the IMU on or off, and with it the full reports.
+static int procon_gyro_set_enabled(struct controller *c, bool enabled) {
+    int ret;
+
+    if (enabled) {
+        ret = procon_gyro_attach(c);
+        if (ret < 0) {
+            return ret;
+        }
+    } else {
+        procon_gyro_detach(c);
+    }
+
+    procon_gyro_send_imu(c, enabled);
+    procon_stream_update(c);
+
+    return 0;
+}
+
+// Takes "key=value" pairs separated by spaces or newlines, and "calibrate" to measure the drift.
+// The controller has to lie still for a second while calibrating.
+int procon_gyro_configure(struct controller *c, char *config) {
+    struct procon_gyro *g = &c->gyro;
+    unsigned int sensitivity;
+    unsigned int deadzone;
+    bool invert_x;
+    bool invert_y;
+    bool enabled = READ_ONCE(g->enabled);
+    bool calibrate = false;
+    unsigned long flags;
+    char *token;
+    int ret;
+
+    spin_lock_irqsave(&g->lock, flags);
+    sensitivity = g->sensitivity;
+    deadzone = g->deadzone;
+    invert_x = g->invert_x;
+    invert_y = g->invert_y;
+    spin_unlock_irqrestore(&g->lock, flags);
+
+    while ((token = strsep(&config, " \t\n")) != NULL) {
+        char *value = token;
+        char *key = strsep(&value, "=");
+
+        if (*key == '\0') {
+            continue;
+        }
+
+        if (strcmp(key, "calibrate") == 0 && value == NULL) {
+            calibrate = true;
+            continue;
+        }
+
+        if (value == NULL) {
+            return -EINVAL;
+        }
+
+        if (strcmp(key, "enable") == 0) {
+            ret = kstrtobool(value, &enabled);
+        } else if (strcmp(key, "sensitivity") == 0) {
+            ret = kstrtouint(value, 10, &sensitivity);
+        } else if (strcmp(key, "deadzone") == 0) {
+            ret = kstrtouint(value, 10, &deadzone);
+        } else if (strcmp(key, "invert_x") == 0) {
+            ret = kstrtobool(value, &invert_x);
+        } else if (strcmp(key, "invert_y") == 0) {
+            ret = kstrtobool(value, &invert_y);
+        } else {
+            ret = -EINVAL;
+        }
+
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (sensitivity > PROCON_GYRO_MAX_SENSITIVITY) {
+        return -EINVAL;
+    }
+
+    spin_lock_irqsave(&g->lock, flags);
+    g->sensitivity = sensitivity;
+    g->deadzone = deadzone;
+    g->invert_x = invert_x;
+    g->invert_y = invert_y;
+
+    if (calibrate) {
+        g->bias_left = PROCON_GYRO_BIAS_SAMPLES;
+        memset(g->bias_sum, 0, sizeof(g->bias_sum));
+    }
+    spin_unlock_irqrestore(&g->lock, flags);
+
+    if (enabled != READ_ONCE(g->enabled)) {
+        return procon_gyro_set_enabled(c, enabled);
+    }
+
+    return 0;
+}
+
+void procon_gyro_show(struct seq_file *m, struct controller *c) {
+    struct procon_gyro *g = &c->gyro;
+    unsigned long flags;
+
+    spin_lock_irqsave(&g->lock, flags);
+    seq_printf(m, "enable=%d sensitivity=%u deadzone=%u invert_x=%d invert_y=%d\n",
+        g->enabled, g->sensitivity, g->deadzone, g->invert_x, g->invert_y);
+    seq_printf(m, "calibration=%s offset=%d,%d,%d bias=%d,%d,%d calibrating=%d samples=%u events=%u\n",
+        g->calibration_valid ? "factory" : "default",
+        g->calibration.gyro_offset[0], g->calibration.gyro_offset[1], g->calibration.gyro_offset[2],
+        g->bias[0], g->bias[1], g->bias[2], g->bias_left > 0, g->samples, g->events);
+    spin_unlock_irqrestore(&g->lock, flags);
+}
+
+// Called once the IMU got set up, it is only turned on while gyro aim is.
+int procon_gyro_start(struct controller *c) {
+    if (!READ_ONCE(c->gyro.enabled)) {
+        return 0;
+    }
+
+    return procon_gyro_attach(c);
+}
+
+void procon_gyro_init(struct controller *c) {
+    struct procon_gyro *g = &c->gyro;
+
+    spin_lock_init(&g->lock);
+    g->enabled = READ_ONCE(gyro_aim);
+    g->sensitivity = min(READ_ONCE(gyro_sensitivity), (unsigned int) PROCON_GYRO_MAX_SENSITIVITY);
+    g->deadzone = PROCON_GYRO_DEFAULT_DEADZONE;
+
+    procon_imu_calibration_default(&g->calibration);
+    procon_gyro_compute_scale(g);
+}
+
+// Called once no more reports can come in.
+void procon_gyro_stop(struct controller *c) {
+    procon_gyro_detach(c);
+}
@@ -0,0 +1,59 @@
+#include <linux/types.h>
+#include <linux/spinlock.h>
+#include <linux/input.h>
+#include <linux/seq_file.h>
+
+#include "packet.h"
+
+#ifndef __PROCON_GYRO_H__
+#define __PROCON_GYRO_H__
+
+// Number of samples averaged for the bias when calibrating, one second of full reports.
+#define PROCON_GYRO_BIAS_SAMPLES 200
+
+// Turns rotation of the controller into relative motion on a separate input device.
+struct procon_gyro {
+    spinlock_t lock; // Everything below, taken from the event path.
+    struct input_dev *input; // Only while enabled.
+    bool enabled;
+
+    struct procon_imu_calibration calibration;
+    bool calibration_valid; // Read from flash, defaults otherwise.
+    __s32 scale[3]; // mdps per count in Q16, from the calibration.
+    __s32 bias[3]; // Drift measured with "calibrate", in counts.
+
+    unsigned int sensitivity; // Counts of motion per degree turned.
+    unsigned int deadzone; // Rotation slower than this many mdps is ignored.
+    bool invert_x;
+    bool invert_y;
+
+    __s64 remainder[2]; // Motion not reported yet, in billionths of a count.
+
+    // Bias measurement in progress.
+    unsigned int bias_left;
+    __s64 bias_sum[3];
+
+    // Statistics.
+    unsigned int samples;
+    unsigned int events;
+};
+
+struct controller;
+
+void procon_gyro_input(struct controller *c, const __u8 *data, size_t len);
+
+int procon_gyro_set_calibration(struct controller *c, const __u8 *data, size_t len);
+
+void procon_gyro_invalidate_calibration(struct controller *c);
+
+int procon_gyro_configure(struct controller *c, char *config);
+
+void procon_gyro_show(struct seq_file *m, struct controller *c);
+
+int procon_gyro_start(struct controller *c);
+
+void procon_gyro_init(struct controller *c);
+
+void procon_gyro_stop(struct controller *c);
+
+#endif
@@ -2,82 +2,253 @@
 #include <linux/input.h>
 #include <linux/types.h>
 #include <linux/kernel.h>
-
+#include <linux/module.h>
+#include <linux/spinlock.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/device.h>
+
+#include "packet.h"
 #include "procon-controller.h"
+#include "procon-devices.h"
 #include "procon-input.h"
+#include "procon-stream.h"
+#include "procon-compat.h"
+
+static unsigned int max_sync_rate = 0;
+module_param(max_sync_rate, uint, 0644);
+MODULE_PARM_DESC(max_sync_rate, "Default for the number of input syncs per second of a new controller, 0 is unlimited.");
+
+// Gives the input device exactly what the device type has.
+void procon_input_set_capabilities(struct input_dev *input, const struct procon_device_desc *desc) {
+    // D-Pad
+    if (desc->dpad) {
+        input_set_abs_params(input, ABS_HAT0X, -1, 1, 0, 0);
+        input_set_abs_params(input, ABS_HAT0Y, -1, 1, 0, 0);
+    }
+
+    for (size_t i = 0; i < desc->num_buttons; i++) {
+        input_set_capability(input, EV_KEY, desc->buttons[i].code);
+    }
+
+    // Analog joysticks.
+    for (size_t i = 0; i < desc->num_axes; i++) {
+        input_set_abs_params(input, desc->axes[i].code, -PROCON_STICK_MAX, PROCON_STICK_MAX, PROCON_STICK_FUZZ, PROCON_STICK_FLAT);
+    }
+}
 
 int create_input_device(struct controller *c) {
-    char *name;
-    static const size_t name_len = 45;
+    struct input_dev *input;
+    int ret;
 
-    name = devm_kzalloc(&c->handler->dev, 45, GFP_KERNEL);
-    if (name == NULL) {
+    // Not managed by the HID device, the input device can outlive it for a grace period.
+    input = input_allocate_device();
+    if (input == NULL) {
         return -ENOMEM;
     }
 
-    c->input = devm_input_allocate_device(&c->handler->dev);
-    if (c->input == NULL) {
-        return -ENOMEM;
+    input->name = kasprintf(GFP_KERNEL, "%s [controller %d]", c->desc->name, c->controller_id);
+    input->uniq = kstrdup(c->handler->uniq, GFP_KERNEL);
+    if (input->name == NULL || input->uniq == NULL) {
+        ret = -ENOMEM;
+        goto err_free;
     }
 
-    switch (c->handler->product) {
-        case 0x2006:
-            snprintf(name, name_len, "Nintendo Switch Left JoyCon [controller %d]", c->controller_id);
-            break;
-        
-        case 0x2007:
-            snprintf(name, name_len, "Nintendo Switch Right JoyCon [controller %d]", c->controller_id);
-            break;
+    // Setup basic information of the controller.
+    input->dev.parent = &c->handler->dev;
+    input->id.bustype = c->handler->bus;
+    input->id.product = c->handler->product;
+    input->id.vendor = c->handler->vendor;
+    input->id.version = c->handler->version;
+
+    procon_input_set_capabilities(input, c->desc);
+
+    // The report mode follows whether anyone is listening.
+    input_set_drvdata(input, c);
+    input->open = procon_stream_input_open;
+    input->close = procon_stream_input_close;
+
+    ret = input_register_device(input);
+    if (ret < 0) {
+        goto err_free;
+    }
 
-        case 0x2009:
-            snprintf(name, name_len, "Nintendo Switch ProCon [controller %d]", c->controller_id);
-            break;
+    c->input = input;
+    return 0;
+
+err_free:
+    kfree(input->name);
+    kfree(input->uniq);
+    input_free_device(input);
+    return ret;
+}
+
+void procon_input_destroy(struct input_dev *input) {
+    const char *name = input->name;
+    const char *uniq = input->uniq;
+
+    input_unregister_device(input);
+    kfree(name);
+    kfree(uniq);
+}
+
+// Takes the input device away from a controller that is going away.
+// Anything held is released, so nothing stays pressed while the controller is gone.
+struct input_dev *procon_input_detach(struct controller *c) {
+    struct input_dev *input = c->input;
+    struct input_response neutral = {0};
+    unsigned long flags;
+
+    spin_lock_irqsave(&c->input_lock, flags);
+    procon_input_report_state(input, c, &neutral);
+    input_sync(input);
+    c->input = NULL;
+    spin_unlock_irqrestore(&c->input_lock, flags);
+
+    mutex_lock(&input->mutex);
+    input_set_drvdata(input, NULL);
+    mutex_unlock(&input->mutex);
+
+    // Out from under the HID device, that is about to be removed.
+    device_move(&input->dev, NULL, DPM_ORDER_NONE);
+
+    return input;
+}
+
+// Hands an input device kept from an earlier connection to the controller.
+int procon_input_reattach(struct controller *c) {
+    struct input_dev *input = c->input;
+    int ret;
+
+    ret = device_move(&input->dev, &c->handler->dev, DPM_ORDER_DEV_AFTER_PARENT);
+    if (ret < 0) {
+        return ret;
+    }
 
-        default:
-            snprintf(name, name_len, "Unknown ProCon device [controller %d]", c->controller_id);
-            break;
+    // Whoever kept the device open during the gap gets full reports again.
+    mutex_lock(&input->mutex);
+    input_set_drvdata(input, c);
+    if (input->users > 0) {
+        procon_stream_set_open(c, true);
     }
+    mutex_unlock(&input->mutex);
+
+    return 0;
+}
+
+// Reports the state without a sync, only touching what the device type has.
+// Buttons and axes go out under the codes of the keymap, the caller holds what guards it.
+void procon_input_report_state(struct input_dev *input, const struct controller *c, const struct input_response *resp) {
+    const struct procon_device_desc *desc = c->desc;
+    const struct procon_keymap *map = &c->keymap;
 
-    // Setup basic information of the controller.
-    c->input->id.bustype = c->handler->bus;
-    c->input->id.product = c->handler->product;
-    c->input->id.vendor = c->handler->vendor;
-    c->input->id.version = c->handler->version;
-    c->input->uniq = c->handler->uniq;
-    c->input->name = name;
-
-    // Setup controller capabilities.
     // D-Pad
-    input_set_abs_params(c->input, ABS_HAT0X, -1, 1, 0, 0);
-    input_set_abs_params(c->input, ABS_HAT0Y, -1, 1, 0, 0);
-
-    // Buttons on the right
-    input_set_capability(c->input, EV_KEY, BTN_NORTH);
-    input_set_capability(c->input, EV_KEY, BTN_WEST);
-    input_set_capability(c->input, EV_KEY, BTN_SOUTH);
-    input_set_capability(c->input, EV_KEY, BTN_EAST);
-
-    // Buttons in the middle.
-    input_set_capability(c->input, EV_KEY, BTN_START);
-    input_set_capability(c->input, EV_KEY, BTN_SELECT);
-    input_set_capability(c->input, EV_KEY, BTN_MODE);
-
-    // Triggers and bumpers.
-    input_set_capability(c->input, EV_KEY, BTN_TR);
-    input_set_capability(c->input, EV_KEY, BTN_TL);
-    input_set_capability(c->input, EV_KEY, BTN_TR2);
-    input_set_capability(c->input, EV_KEY, BTN_TL2);
-
-    // Stick buttons.
-    input_set_capability(c->input, EV_KEY, BTN_THUMBL);
-    input_set_capability(c->input, EV_KEY, BTN_THUMBR);
+    if (desc->dpad) {
+        input_report_abs(input, ABS_HAT0X, procon_dpad_horizontal(resp->buttons));
+        input_report_abs(input, ABS_HAT0Y, procon_dpad_vertical(resp->buttons));
+    }
+
+    for (size_t i = 0; i < desc->num_buttons; i++) {
+        __u8 bit = desc->buttons[i].bit;
+
+        if (map->keys[bit] != PROCON_KEYMAP_NONE) {
+            input_report_key(input, map->keys[bit], (resp->buttons >> bit) & 0x1);
+        }
+    }
 
     // Analog joysticks.
-    input_set_abs_params(c->input, ABS_X, -PROCON_STICK_MAX, PROCON_STICK_MAX, PROCON_STICK_FUZZ, PROCON_STICK_FLAT);
-    input_set_abs_params(c->input, ABS_Y, -PROCON_STICK_MAX, PROCON_STICK_MAX, PROCON_STICK_FUZZ, PROCON_STICK_FLAT);
+    for (size_t i = 0; i < desc->num_axes; i++) {
+        enum procon_axis axis = desc->axes[i].axis;
+
+        if (map->axes[axis] != PROCON_KEYMAP_NONE) {
+            input_report_abs(input, map->axes[axis], map->sign[axis] * resp->sticks[axis]);
+        }
+    }
+}
+
+static void procon_input_flush(struct controller *c, ktime_t now, unsigned int rate) {
+    procon_input_report_state(c->input, c, &c->sync_state);
+    input_sync(c->input);
+    c->syncs++;
+
+    c->synced_buttons = c->sync_state.buttons;
+    c->sync_pending = false;
+    c->next_sync = rate > 0 ? ktime_add_ns(now, NSEC_PER_SEC / rate) : now;
+}
+
+// Reports the state, at most max_sync_rate times a second.
+// Anything faster is merged into a single sync, except that a button never
+// changes back before its first change went out.
+void procon_input_report(struct controller *c, const struct input_response *resp) {
+    unsigned int rate = READ_ONCE(c->max_sync_rate);
+    unsigned long flags;
+    ktime_t now;
+
+    spin_lock_irqsave(&c->input_lock, flags);
+
+    if (c->input == NULL) {
+        goto unlock;
+    }
+
+    now = ktime_get();
+
+    // Merging this report would lose an edge, send out what is pending first.
+    if (c->sync_pending && ((resp->buttons ^ c->sync_state.buttons) & (c->sync_state.buttons ^ c->synced_buttons))) {
+        procon_input_flush(c, now, rate);
+    }
+
+    c->sync_state = *resp;
+
+    if (rate == 0 || ktime_compare(now, c->next_sync) >= 0) {
+        procon_input_flush(c, now, rate);
+        goto unlock;
+    }
+
+    c->syncs_coalesced++;
+
+    if (!c->sync_pending) {
+        c->sync_pending = true;
+        hrtimer_start(&c->sync_timer, c->next_sync, HRTIMER_MODE_ABS);
+    }
+
+unlock:
+    spin_unlock_irqrestore(&c->input_lock, flags);
+}
+
+static enum hrtimer_restart procon_input_sync_timer_fired(struct hrtimer *timer) {
+    struct controller *c = container_of(timer, struct controller, sync_timer);
+    enum hrtimer_restart ret = HRTIMER_NORESTART;
+    unsigned long flags;
+    ktime_t now;
+
+    spin_lock_irqsave(&c->input_lock, flags);
+
+    if (c->sync_pending && c->input != NULL) {
+        now = ktime_get();
+
+        // An early flush for an edge moved the next tick.
+        if (ktime_compare(now, c->next_sync) < 0) {
+            hrtimer_set_expires(timer, c->next_sync);
+            ret = HRTIMER_RESTART;
+        } else {
+            procon_input_flush(c, now, READ_ONCE(c->max_sync_rate));
+        }
+    }
+
+    spin_unlock_irqrestore(&c->input_lock, flags);
+
+    return ret;
+}
 
-    input_set_abs_params(c->input, ABS_RX, -PROCON_STICK_MAX, PROCON_STICK_MAX, PROCON_STICK_FUZZ, PROCON_STICK_FLAT);
-    input_set_abs_params(c->input, ABS_RY, -PROCON_STICK_MAX, PROCON_STICK_MAX, PROCON_STICK_FUZZ, PROCON_STICK_FLAT);
+void procon_input_init(struct controller *c) {
+    spin_lock_init(&c->input_lock);
+    hrtimer_setup(&c->sync_timer, procon_input_sync_timer_fired, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    c->max_sync_rate = READ_ONCE(max_sync_rate);
+}
 
-    return input_register_device(c->input);
-}
\ No newline at end of file
+// Called once no more reports can come in.
+void procon_input_stop(struct controller *c) {
+    hrtimer_cancel(&c->sync_timer);
+}
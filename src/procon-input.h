@@ -1,8 +1,26 @@
+#include "packet.h"
 #include "procon-controller.h"
+#include "procon-devices.h"
 
 #ifndef __PROCON_INPUT_H__
 #define __PROCON_INPUT_H__
 
 int create_input_device(struct controller *c);
 
+void procon_input_destroy(struct input_dev *input);
+
+struct input_dev *procon_input_detach(struct controller *c);
+
+int procon_input_reattach(struct controller *c);
+
+void procon_input_set_capabilities(struct input_dev *input, const struct procon_device_desc *desc);
+
+void procon_input_report_state(struct input_dev *input, const struct controller *c, const struct input_response *resp);
+
+void procon_input_report(struct controller *c, const struct input_response *resp);
+
+void procon_input_init(struct controller *c);
+
+void procon_input_stop(struct controller *c);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,327 @@
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/spinlock.h>
+#include <linux/seq_file.h>
+#include <linux/input.h>
+
+#include "packet.h"
+#include "procon-controller.h"
+#include "procon-devices.h"
+#include "procon-input.h"
+#include "procon-keymap.h"
+#include "procon-pair.h"
+
+struct procon_keymap_name {
+    const char *name;
+    __u16 value;
+};
+
+static const struct procon_keymap_name procon_keymap_buttons[] = {
+    { "y", PROCON_BTN_Y },
+    { "x", PROCON_BTN_X },
+    { "b", PROCON_BTN_B },
+    { "a", PROCON_BTN_A },
+    { "r", PROCON_BTN_R },
+    { "zr", PROCON_BTN_ZR },
+    { "minus", PROCON_BTN_MINUS },
+    { "plus", PROCON_BTN_PLUS },
+    { "rstick", PROCON_BTN_RSTICK },
+    { "lstick", PROCON_BTN_LSTICK },
+    { "home", PROCON_BTN_HOME },
+    { "capture", PROCON_BTN_CAPTURE },
+    { "l", PROCON_BTN_L },
+    { "zl", PROCON_BTN_ZL },
+};
+
+static const struct procon_keymap_name procon_keymap_keys[] = {
+    { "north", BTN_NORTH },
+    { "west", BTN_WEST },
+    { "south", BTN_SOUTH },
+    { "east", BTN_EAST },
+    { "start", BTN_START },
+    { "select", BTN_SELECT },
+    { "mode", BTN_MODE },
+    { "tr", BTN_TR },
+    { "tl", BTN_TL },
+    { "tr2", BTN_TR2 },
+    { "tl2", BTN_TL2 },
+    { "thumbl", BTN_THUMBL },
+    { "thumbr", BTN_THUMBR },
+};
+
+static const struct procon_keymap_name procon_keymap_sticks[] = {
+    { "lx", PROCON_AXIS_LX },
+    { "ly", PROCON_AXIS_LY },
+    { "rx", PROCON_AXIS_RX },
+    { "ry", PROCON_AXIS_RY },
+};
+
+static const struct procon_keymap_name procon_keymap_abs[] = {
+    { "x", ABS_X },
+    { "y", ABS_Y },
+    { "rx", ABS_RX },
+    { "ry", ABS_RY },
+};
+
+static int procon_keymap_lookup(const struct procon_keymap_name *names, size_t count, const char *name) {
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(names[i].name, name) == 0) {
+            return names[i].value;
+        }
+    }
+
+    return -EINVAL;
+}
+
+static const char *procon_keymap_name(const struct procon_keymap_name *names, size_t count, __u16 value) {
+    for (size_t i = 0; i < count; i++) {
+        if (names[i].value == value) {
+            return names[i].name;
+        }
+    }
+
+    return NULL;
+}
+
+// The mapping the device type comes with.
+static void procon_keymap_default(const struct procon_device_desc *desc, struct procon_keymap *map) {
+    for (int i = 0; i < PROCON_BTN_COUNT; i++) {
+        map->keys[i] = PROCON_KEYMAP_NONE;
+    }
+
+    for (int i = 0; i < PROCON_AXIS_COUNT; i++) {
+        map->axes[i] = PROCON_KEYMAP_NONE;
+        map->sign[i] = 1;
+    }
+
+    for (size_t i = 0; i < desc->num_buttons; i++) {
+        map->keys[desc->buttons[i].bit] = desc->buttons[i].code;
+    }
+
+    for (size_t i = 0; i < desc->num_axes; i++) {
+        map->axes[desc->axes[i].axis] = desc->axes[i].code;
+    }
+}
+
+void procon_keymap_init(struct controller *c) {
+    procon_keymap_default(c->desc, &c->keymap);
+}
+
+// Takes a key code by name or by number.
+static int procon_keymap_parse_key(const char *value, __u16 *code) {
+    int ret;
+
+    if (strcmp(value, "none") == 0) {
+        *code = PROCON_KEYMAP_NONE;
+        return 0;
+    }
+
+    ret = procon_keymap_lookup(procon_keymap_keys, ARRAY_SIZE(procon_keymap_keys), value);
+    if (ret >= 0) {
+        *code = ret;
+        return 0;
+    }
+
+    return kstrtou16(value, 0, code);
+}
+
+// Takes an axis by name, a leading minus inverts it.
+static int procon_keymap_parse_axis(const char *value, __u16 *code, __s8 *sign) {
+    int ret;
+
+    if (strcmp(value, "none") == 0) {
+        *code = PROCON_KEYMAP_NONE;
+        *sign = 1;
+        return 0;
+    }
+
+    *sign = 1;
+    if (*value == '-') {
+        *sign = -1;
+        value++;
+    }
+
+    ret = procon_keymap_lookup(procon_keymap_abs, ARRAY_SIZE(procon_keymap_abs), value);
+    if (ret < 0) {
+        return ret;
+    }
+
+    *code = ret;
+    return 0;
+}
+
+// Only buttons the device type has may be mapped, and only to codes its input device was given.
+// No two sources may share a code, or one would keep releasing what the other holds.
+static int procon_keymap_validate(const struct procon_device_desc *desc, const struct procon_keymap *map) {
+    for (int i = 0; i < PROCON_BTN_COUNT; i++) {
+        bool found = false;
+
+        if (map->keys[i] == PROCON_KEYMAP_NONE) {
+            continue;
+        }
+
+        if (!(desc->button_mask & BIT(i))) {
+            return -EINVAL;
+        }
+
+        for (size_t j = 0; j < desc->num_buttons; j++) {
+            found |= desc->buttons[j].code == map->keys[i];
+        }
+
+        if (!found) {
+            return -EINVAL;
+        }
+
+        for (int j = i + 1; j < PROCON_BTN_COUNT; j++) {
+            if (map->keys[j] == map->keys[i]) {
+                return -EINVAL;
+            }
+        }
+    }
+
+    for (int i = 0; i < PROCON_AXIS_COUNT; i++) {
+        bool has_axis = false;
+        bool found = false;
+
+        if (map->axes[i] == PROCON_KEYMAP_NONE) {
+            continue;
+        }
+
+        for (size_t j = 0; j < desc->num_axes; j++) {
+            has_axis |= desc->axes[j].axis == i;
+            found |= desc->axes[j].code == map->axes[i];
+        }
+
+        if (!has_axis || !found) {
+            return -EINVAL;
+        }
+
+        for (int j = i + 1; j < PROCON_AXIS_COUNT; j++) {
+            if (map->axes[j] == map->axes[i]) {
+                return -EINVAL;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Swaps in a new keymap. Everything held is released under the old codes first,
+// then the last state goes out again under the new ones.
+static void procon_keymap_install(struct controller *c, const struct procon_keymap *map) {
+    struct input_response neutral = {0};
+    unsigned long flags;
+
+    spin_lock_irqsave(&c->input_lock, flags);
+
+    if (c->input != NULL) {
+        procon_input_report_state(c->input, c, &neutral);
+        input_sync(c->input);
+    }
+
+    c->keymap = *map;
+
+    if (c->input != NULL) {
+        procon_input_report_state(c->input, c, &c->sync_state);
+        input_sync(c->input);
+    }
+
+    spin_unlock_irqrestore(&c->input_lock, flags);
+
+    // A merged JoyCon reports through the input device of its pair.
+    procon_pair_update_keymap(c);
+}
+
+// Takes "source=target" pairs separated by spaces or newlines, applied on top of the current keymap.
+// The whole lot is checked before any of it is used, so swapping two buttons can be done in one write.
+int procon_keymap_configure(struct controller *c, char *config) {
+    struct procon_keymap map;
+    unsigned long flags;
+    char *token;
+    int ret;
+
+    spin_lock_irqsave(&c->input_lock, flags);
+    map = c->keymap;
+    spin_unlock_irqrestore(&c->input_lock, flags);
+
+    while ((token = strsep(&config, " \t\n")) != NULL) {
+        char *value = token;
+        char *key = strsep(&value, "=");
+        int source;
+
+        if (*key == '\0') {
+            continue;
+        }
+
+        if (strcmp(key, "reset") == 0 && value == NULL) {
+            procon_keymap_default(c->desc, &map);
+            continue;
+        }
+
+        if (value == NULL) {
+            return -EINVAL;
+        }
+
+        source = procon_keymap_lookup(procon_keymap_buttons, ARRAY_SIZE(procon_keymap_buttons), key);
+        if (source >= 0) {
+            ret = procon_keymap_parse_key(value, &map.keys[source]);
+        } else {
+            source = procon_keymap_lookup(procon_keymap_sticks, ARRAY_SIZE(procon_keymap_sticks), key);
+            if (source < 0) {
+                return -EINVAL;
+            }
+
+            ret = procon_keymap_parse_axis(value, &map.axes[source], &map.sign[source]);
+        }
+
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    ret = procon_keymap_validate(c->desc, &map);
+    if (ret < 0) {
+        return ret;
+    }
+
+    procon_keymap_install(c, &map);
+    return 0;
+}
+
+void procon_keymap_show(struct seq_file *m, struct controller *c) {
+    struct procon_keymap map;
+    unsigned long flags;
+    const char *name;
+
+    spin_lock_irqsave(&c->input_lock, flags);
+    map = c->keymap;
+    spin_unlock_irqrestore(&c->input_lock, flags);
+
+    for (size_t i = 0; i < ARRAY_SIZE(procon_keymap_buttons); i++) {
+        __u16 bit = procon_keymap_buttons[i].value;
+
+        if (!(c->desc->button_mask & BIT(bit))) {
+            continue;
+        }
+
+        name = procon_keymap_name(procon_keymap_keys, ARRAY_SIZE(procon_keymap_keys), map.keys[bit]);
+        if (map.keys[bit] == PROCON_KEYMAP_NONE) {
+            seq_printf(m, "%s=none\n", procon_keymap_buttons[i].name);
+        } else if (name != NULL) {
+            seq_printf(m, "%s=%s\n", procon_keymap_buttons[i].name, name);
+        } else {
+            seq_printf(m, "%s=%u\n", procon_keymap_buttons[i].name, map.keys[bit]);
+        }
+    }
+
+    for (size_t i = 0; i < c->desc->num_axes; i++) {
+        enum procon_axis axis = c->desc->axes[i].axis;
+
+        name = procon_keymap_name(procon_keymap_abs, ARRAY_SIZE(procon_keymap_abs), map.axes[axis]);
+        if (name == NULL) {
+            seq_printf(m, "%s=none\n", procon_keymap_sticks[axis].name);
+        } else {
+            seq_printf(m, "%s=%s%s\n", procon_keymap_sticks[axis].name, map.sign[axis] < 0 ? "-" : "", name);
+        }
+    }
+}
@@ -0,0 +1,27 @@
+#include <linux/types.h>
+#include <linux/seq_file.h>
+
+#include "packet.h"
+
+#ifndef __PROCON_KEYMAP_H__
+#define __PROCON_KEYMAP_H__
+
+// A button or axis that is not reported at all.
+#define PROCON_KEYMAP_NONE U16_MAX
+
+// Where every button and stick axis ends up, indexed by where it comes from.
+struct procon_keymap {
+    __u16 keys[PROCON_BTN_COUNT]; // Key code by PROCON_BTN_* bit.
+    __u16 axes[PROCON_AXIS_COUNT]; // Absolute axis code by stick axis.
+    __s8 sign[PROCON_AXIS_COUNT]; // -1 for an inverted axis.
+};
+
+struct controller;
+
+void procon_keymap_init(struct controller *c);
+
+int procon_keymap_configure(struct controller *c, char *config);
+
+void procon_keymap_show(struct seq_file *m, struct controller *c);
+
+#endif
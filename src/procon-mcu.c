@@ -0,0 +1,514 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/proc_fs.h>
+#include <linux/spinlock.h>
+#include <linux/kref.h>
+#include <linux/bitmap.h>
+
+#include "commands.h"
+#include "packet.h"
+#include "procon-controller.h"
+#include "procon-devices.h"
+#include "procon-mcu.h"
+#include "procon-output.h"
+#include "procon-stream.h"
+
+static unsigned int mcu_frames = 4;
+module_param(mcu_frames, uint, 0644);
+MODULE_PARM_DESC(mcu_frames, "Number of frames kept for userspace in the MCU ring of a controller, from 2 to 64.");
+
+// The header takes the first bytes of the ring, the slots follow.
+#define PROCON_MCU_RING_DATA_OFFSET 64
+
+// Length of the arguments of an MCU configuration, the CRC covers all but the first byte.
+#define PROCON_MCU_CONFIG_LENGTH 38
+
+static const char *procon_mcu_mode_names[] = {
+    [PROCON_MCU_OFF] = "off",
+    [PROCON_MCU_STANDBY] = "standby",
+    [PROCON_MCU_NFC] = "nfc",
+    [PROCON_MCU_IR] = "ir",
+};
+
+// What the MCU calls the modes, as set with the 0x21 0x00 configuration.
+static const __u8 procon_mcu_mode_bytes[] = {
+    [PROCON_MCU_STANDBY] = 0x01,
+    [PROCON_MCU_NFC] = 0x04,
+    [PROCON_MCU_IR] = 0x05,
+};
+
+// CRC-8 with polynomial 0x07, as the MCU checks its configuration and requests with.
+static __u8 procon_mcu_crc8(const __u8 *data, size_t len) {
+    __u8 crc = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+        }
+    }
+
+    return crc;
+}
+
+static int procon_mcu_send(struct controller *c, __u8 command, __u8 subcommand, const __u8 *args, size_t len) {
+    struct packet p;
+    int ret;
+
+    init_packet(&p, command, subcommand, args, len);
+    packet_add_rumble(&p);
+
+    ret = send_message(c, &p);
+    if (ret < 0 && ret != -ENODEV) {
+        pr_warn("Could not send MCU command %02x to controller%d: %d.\n", subcommand, c->controller_id, ret);
+    }
+
+    return ret;
+}
+
+// Sends a configuration to the MCU. The first byte is the command, the rest its arguments.
+static int procon_mcu_send_config(struct controller *c, const __u8 *config, size_t len) {
+    __u8 args[PROCON_MCU_CONFIG_LENGTH] = {0};
+
+    memcpy(args, config, min(len, sizeof(args) - 1));
+    args[PROCON_MCU_CONFIG_LENGTH - 1] = procon_mcu_crc8(args + 1, PROCON_MCU_CONFIG_LENGTH - 2);
+
+    return procon_mcu_send(c, PROCON_CMD_COMMAND_AND_RUMBLE, PROCON_SUB_SET_MCU_CONFIG, args, sizeof(args));
+}
+
+// Acks an IR fragment, so the camera goes on with the next one instead of sending it again.
+// Can be called from the event path, only the latest ack is kept until it goes out.
+static void procon_mcu_ack(struct controller *c, __u8 fragment) {
+    __u8 args[PROCON_MCU_CONFIG_LENGTH] = {0};
+
+    args[2] = fragment;
+    args[36] = procon_mcu_crc8(args, 36);
+    args[37] = 0xFF;
+
+    procon_mcu_send(c, PROCON_CMD_MCU, PROCON_MCU_REPORT_IR_IMAGE, args, sizeof(args));
+}
+
+static struct procon_mcu_ring *procon_mcu_ring_alloc(void) {
+    struct procon_mcu_ring *ring;
+    struct procon_mcu_ring_header *header;
+
+    ring = kzalloc(sizeof(struct procon_mcu_ring), GFP_KERNEL);
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    ring->slot_count = clamp(READ_ONCE(mcu_frames), 2U, 64U);
+    ring->slot_size = ALIGN(sizeof(struct procon_mcu_frame) + PROCON_MCU_MAX_FRAME, 64);
+    ring->size = PAGE_ALIGN(PROCON_MCU_RING_DATA_OFFSET + ring->slot_count * ring->slot_size);
+
+    // Zeroed, and safe to map into userspace.
+    ring->mem = vmalloc_user(ring->size);
+    if (ring->mem == NULL) {
+        kfree(ring);
+        return NULL;
+    }
+
+    header = ring->mem;
+    header->version = PROCON_MCU_RING_VERSION;
+    header->slot_count = ring->slot_count;
+    header->slot_size = ring->slot_size;
+    header->data_offset = PROCON_MCU_RING_DATA_OFFSET;
+
+    kref_init(&ring->ref);
+    init_waitqueue_head(&ring->wait);
+
+    return ring;
+}
+
+static void procon_mcu_ring_free(struct kref *ref) {
+    struct procon_mcu_ring *ring = container_of(ref, struct procon_mcu_ring, ref);
+
+    vfree(ring->mem);
+    kfree(ring);
+}
+
+static void procon_mcu_ring_put(struct procon_mcu_ring *ring) {
+    kref_put(&ring->ref, procon_mcu_ring_free);
+}
+
+// Starts a frame in the next slot. Must hold the MCU lock.
+static void procon_mcu_begin(struct procon_mcu *mcu, __u8 type) {
+    struct procon_mcu_ring *ring = mcu->ring;
+    struct procon_mcu_frame *frame;
+
+    frame = ring->mem + PROCON_MCU_RING_DATA_OFFSET + (mcu->head % ring->slot_count) * ring->slot_size;
+
+    // Readers of the old frame in this slot see it go.
+    WRITE_ONCE(frame->sequence, 0);
+    smp_wmb();
+
+    frame->type = type;
+    frame->length = 0;
+    frame->complete = 0;
+
+    bitmap_zero(mcu->received, PROCON_MCU_MAX_FRAGMENTS);
+    mcu->frame = frame;
+}
+
+// Hands the frame being assembled to userspace. Must hold the MCU lock.
+static void procon_mcu_finish(struct procon_mcu *mcu, __u32 length, bool complete) {
+    struct procon_mcu_ring_header *header = mcu->ring->mem;
+    struct procon_mcu_frame *frame = mcu->frame;
+
+    frame->length = length;
+    frame->complete = complete;
+
+    mcu->head++;
+    mcu->frames++;
+    if (!complete) {
+        mcu->incomplete++;
+    }
+
+    smp_wmb();
+    WRITE_ONCE(frame->sequence, mcu->head);
+    smp_store_release(&header->head, mcu->head);
+
+    mcu->frame = NULL;
+    wake_up_interruptible(&mcu->ring->wait);
+}
+
+// Whatever never arrived is left zero, rather than showing an older image.
+static void procon_mcu_finish_image(struct procon_mcu *mcu) {
+    unsigned int fragments = mcu->ir_fragments;
+    bool complete = bitmap_full(mcu->received, fragments);
+
+    if (!complete) {
+        for (unsigned int i = 0; i < fragments; i++) {
+            if (!test_bit(i, mcu->received)) {
+                memset(mcu->frame->data + i * PROCON_MCU_FRAGMENT_LENGTH, 0, PROCON_MCU_FRAGMENT_LENGTH);
+            }
+        }
+    }
+
+    procon_mcu_finish(mcu, fragments * PROCON_MCU_FRAGMENT_LENGTH, complete);
+}
+
+// Takes the MCU part of a 0x31 report. Called from the event path.
+// Fragments are copied straight into their place in the ring, there is no other copy.
+void procon_mcu_input(struct controller *c, const __u8 *data, size_t len) {
+    struct procon_mcu *mcu = &c->mcu;
+    const __u8 *report;
+    unsigned long flags;
+    int ack = -1;
+
+    if (len < PROCON_MCU_DATA_OFFSET + PROCON_MCU_DATA_LENGTH) {
+        return;
+    }
+
+    report = data + PROCON_MCU_DATA_OFFSET;
+
+    spin_lock_irqsave(&mcu->lock, flags);
+
+    if (mcu->ring == NULL || mcu->mode == PROCON_MCU_OFF) {
+        goto unlock;
+    }
+
+    mcu->reports++;
+    mcu->last_type = report[0];
+
+    switch (report[0]) {
+    case PROCON_MCU_REPORT_IR_IMAGE: {
+        unsigned int fragment = report[3];
+
+        if (mcu->mode != PROCON_MCU_IR || fragment >= mcu->ir_fragments) {
+            break;
+        }
+
+        // A new image started before the last one was done.
+        if (fragment == 0 && mcu->frame != NULL) {
+            procon_mcu_finish_image(mcu);
+        }
+
+        if (mcu->frame == NULL) {
+            procon_mcu_begin(mcu, PROCON_MCU_REPORT_IR_IMAGE);
+        }
+
+        memcpy(mcu->frame->data + fragment * PROCON_MCU_FRAGMENT_LENGTH, report + 10, PROCON_MCU_FRAGMENT_LENGTH);
+        __set_bit(fragment, mcu->received);
+        mcu->fragments++;
+        ack = fragment;
+
+        if (fragment == mcu->ir_fragments - 1) {
+            procon_mcu_finish_image(mcu);
+        }
+        break;
+    }
+
+    // Tag state and tag data each fit in a single report, they go up as they are.
+    case PROCON_MCU_REPORT_NFC_STATE:
+    case PROCON_MCU_REPORT_NFC_READ:
+        if (mcu->mode != PROCON_MCU_NFC) {
+            break;
+        }
+
+        procon_mcu_begin(mcu, report[0]);
+        memcpy(mcu->frame->data, report, PROCON_MCU_DATA_LENGTH);
+        procon_mcu_finish(mcu, PROCON_MCU_DATA_LENGTH, true);
+        break;
+    }
+
+unlock:
+    spin_unlock_irqrestore(&mcu->lock, flags);
+
+    if (ack >= 0) {
+        procon_mcu_ack(c, ack);
+    }
+}
+
+// Turns the MCU on in the given mode, or off. The report mode follows.
+int procon_mcu_set_mode(struct controller *c, enum procon_mcu_mode mode, unsigned int ir_fragments) {
+    struct procon_mcu_ring *ring = NULL;
+    unsigned long flags;
+    __u8 state;
+    __u8 config[3];
+
+    if (!c->desc->mcu) {
+        return -EOPNOTSUPP;
+    }
+
+    if (ir_fragments == 0 || ir_fragments > PROCON_MCU_MAX_FRAGMENTS) {
+        return -EINVAL;
+    }
+
+    // The ring is allocated the first time the MCU is used and kept until the controller goes.
+    if (mode != PROCON_MCU_OFF && READ_ONCE(c->mcu.ring) == NULL) {
+        ring = procon_mcu_ring_alloc();
+        if (ring == NULL) {
+            return -ENOMEM;
+        }
+    }
+
+    spin_lock_irqsave(&c->mcu.lock, flags);
+
+    if (ring != NULL && c->mcu.ring == NULL) {
+        c->mcu.ring = ring;
+        ring = NULL;
+    }
+
+    WRITE_ONCE(c->mcu.mode, mode);
+    c->mcu.ir_fragments = ir_fragments;
+    c->mcu.frame = NULL;
+
+    spin_unlock_irqrestore(&c->mcu.lock, flags);
+
+    // Lost a race with another writer.
+    if (ring != NULL) {
+        procon_mcu_ring_put(ring);
+    }
+
+    // Going on, the MCU data is asked for first. Going off, the MCU goes last.
+    procon_stream_update(c);
+
+    state = mode != PROCON_MCU_OFF ? 0x01 : 0x00;
+    procon_mcu_send(c, PROCON_CMD_COMMAND_AND_RUMBLE, PROCON_SUB_SET_MCU_STATE, &state, sizeof(state));
+
+    if (mode != PROCON_MCU_OFF) {
+        config[0] = 0x21;
+        config[1] = 0x00;
+        config[2] = procon_mcu_mode_bytes[mode];
+        procon_mcu_send_config(c, config, sizeof(config));
+    }
+
+    return 0;
+}
+
+// Takes either a mode, "off", "standby", "nfc" or "ir" with an optional "fragments=N",
+// or "config" followed by the hex bytes of a raw MCU configuration, such as IR registers.
+int procon_mcu_configure(struct controller *c, char *config) {
+    enum procon_mcu_mode mode;
+    unsigned int fragments = READ_ONCE(c->mcu.ir_fragments);
+    char *token;
+    int found = -1;
+    int ret;
+
+    config = strim(config);
+    token = strsep(&config, " ");
+    if (token == NULL) {
+        return -EINVAL;
+    }
+
+    if (strcmp(token, "config") == 0) {
+        __u8 bytes[PROCON_MCU_CONFIG_LENGTH - 1];
+        size_t len = 0;
+
+        if (!c->desc->mcu) {
+            return -EOPNOTSUPP;
+        }
+
+        while ((token = strsep(&config, " ")) != NULL) {
+            if (*token == '\0') {
+                continue;
+            }
+
+            if (len == sizeof(bytes)) {
+                return -EINVAL;
+            }
+
+            ret = kstrtou8(token, 16, &bytes[len++]);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        if (len == 0) {
+            return -EINVAL;
+        }
+
+        return procon_mcu_send_config(c, bytes, len);
+    }
+
+    for (int i = 0; i < ARRAY_SIZE(procon_mcu_mode_names); i++) {
+        if (strcmp(token, procon_mcu_mode_names[i]) == 0) {
+            found = i;
+        }
+    }
+
+    if (found < 0) {
+        return -EINVAL;
+    }
+    mode = found;
+
+    while ((token = strsep(&config, " ")) != NULL) {
+        char *value = token;
+        char *key = strsep(&value, "=");
+
+        if (*key == '\0') {
+            continue;
+        }
+
+        if (value == NULL || strcmp(key, "fragments") != 0) {
+            return -EINVAL;
+        }
+
+        ret = kstrtouint(value, 10, &fragments);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return procon_mcu_set_mode(c, mode, fragments);
+}
+
+void procon_mcu_show(struct seq_file *m, struct controller *c) {
+    struct procon_mcu *mcu = &c->mcu;
+    unsigned long flags;
+
+    spin_lock_irqsave(&mcu->lock, flags);
+    seq_printf(m, "mode=%s fragments=%u reports=%u fragments_received=%u frames=%u incomplete=%u last_type=%02x\n",
+        procon_mcu_mode_names[mcu->mode], mcu->ir_fragments, mcu->reports, mcu->fragments, mcu->frames,
+        mcu->incomplete, mcu->last_type);
+    spin_unlock_irqrestore(&mcu->lock, flags);
+}
+
+// The ring outlives the file and the controller for as long as it stays mapped.
+static void procon_mcu_vm_open(struct vm_area_struct *vma) {
+    struct procon_mcu_ring *ring = vma->vm_private_data;
+
+    kref_get(&ring->ref);
+}
+
+static void procon_mcu_vm_close(struct vm_area_struct *vma) {
+    procon_mcu_ring_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct procon_mcu_vm_ops = {
+    .open = procon_mcu_vm_open,
+    .close = procon_mcu_vm_close,
+};
+
+// Only opens once the MCU has been turned on, the ring does not exist before.
+int procon_mcu_frames_open(struct inode *inode, struct file *file) {
+    struct controller *c = pde_data(inode);
+    struct procon_mcu_ring *ring;
+    unsigned long flags;
+
+    if (c == NULL) {
+        return -ENODEV;
+    }
+
+    spin_lock_irqsave(&c->mcu.lock, flags);
+    ring = c->mcu.ring;
+    if (ring != NULL) {
+        kref_get(&ring->ref);
+    }
+    spin_unlock_irqrestore(&c->mcu.lock, flags);
+
+    if (ring == NULL) {
+        return -ENODATA;
+    }
+
+    file->private_data = ring;
+    return 0;
+}
+
+int procon_mcu_frames_release(struct inode *inode, struct file *file) {
+    procon_mcu_ring_put(file->private_data);
+    return 0;
+}
+
+int procon_mcu_frames_mmap(struct file *file, struct vm_area_struct *vma) {
+    struct procon_mcu_ring *ring = file->private_data;
+    int ret;
+
+    ret = remap_vmalloc_range(vma, ring->mem, vma->vm_pgoff);
+    if (ret < 0) {
+        return ret;
+    }
+
+    vma->vm_ops = &procon_mcu_vm_ops;
+    vma->vm_private_data = ring;
+    kref_get(&ring->ref);
+
+    return 0;
+}
+
+// Readable while there are frames past the tail userspace wrote into the header.
+__poll_t procon_mcu_frames_poll(struct file *file, poll_table *wait) {
+    struct procon_mcu_ring *ring = file->private_data;
+    struct procon_mcu_ring_header *header = ring->mem;
+
+    poll_wait(file, &ring->wait, wait);
+
+    if (READ_ONCE(ring->dead)) {
+        return EPOLLHUP;
+    }
+
+    if (smp_load_acquire(&header->head) != READ_ONCE(header->tail)) {
+        return EPOLLIN | EPOLLRDNORM;
+    }
+
+    return 0;
+}
+
+void procon_mcu_init(struct controller *c) {
+    spin_lock_init(&c->mcu.lock);
+    c->mcu.mode = PROCON_MCU_OFF;
+    c->mcu.ir_fragments = PROCON_MCU_MAX_FRAGMENTS;
+}
+
+// Called once no more reports can come in.
+void procon_mcu_stop(struct controller *c) {
+    struct procon_mcu_ring *ring;
+    unsigned long flags;
+
+    spin_lock_irqsave(&c->mcu.lock, flags);
+    ring = c->mcu.ring;
+    c->mcu.ring = NULL;
+    c->mcu.frame = NULL;
+    spin_unlock_irqrestore(&c->mcu.lock, flags);
+
+    if (ring != NULL) {
+        WRITE_ONCE(ring->dead, true);
+        wake_up_interruptible(&ring->wait);
+        procon_mcu_ring_put(ring);
+    }
+}
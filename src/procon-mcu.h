@@ -0,0 +1,117 @@
+#include <linux/types.h>
+#include <linux/spinlock.h>
+#include <linux/kref.h>
+#include <linux/wait.h>
+#include <linux/bitmap.h>
+#include <linux/poll.h>
+#include <linux/seq_file.h>
+
+#ifndef __PROCON_MCU_H__
+#define __PROCON_MCU_H__
+
+// Report mode that adds the data of the NFC/IR MCU to the full reports.
+#define PROCON_REPORT_MCU 0x31
+
+// Where the MCU data sits in a 0x31 report, and how much of it there is.
+#define PROCON_MCU_DATA_OFFSET 49
+#define PROCON_MCU_DATA_LENGTH 313
+
+// MCU report types.
+#define PROCON_MCU_REPORT_EMPTY 0xFF
+#define PROCON_MCU_REPORT_IR_IMAGE 0x03
+#define PROCON_MCU_REPORT_NFC_STATE 0x2A
+#define PROCON_MCU_REPORT_NFC_READ 0x3A
+
+// IR images come in fragments of 300 bytes, at most 256 of them for 320x240.
+#define PROCON_MCU_FRAGMENT_LENGTH 300
+#define PROCON_MCU_MAX_FRAGMENTS 256
+#define PROCON_MCU_MAX_FRAME (PROCON_MCU_FRAGMENT_LENGTH * PROCON_MCU_MAX_FRAGMENTS)
+
+enum procon_mcu_mode {
+    PROCON_MCU_OFF,
+    PROCON_MCU_STANDBY,
+    PROCON_MCU_NFC,
+    PROCON_MCU_IR,
+};
+
+// The start of the mcu_frames proc file, as mapped by userspace.
+// Frames follow at data_offset, one every slot_size bytes.
+#define PROCON_MCU_RING_VERSION 1
+
+struct procon_mcu_ring_header {
+    __u32 version; // PROCON_MCU_RING_VERSION.
+    __u32 slot_count;
+    __u32 slot_size;
+    __u32 data_offset;
+    __u32 head; // Frames completed so far, the newest is in slot (head - 1) % slot_count.
+    __u32 tail; // Written by userspace, poll is readable while it differs from head.
+};
+
+// A frame is written in place while its fragments come in, with sequence 0.
+// Once complete it gets the value of head it was completed as. A reader checks that the
+// sequence did not change while it looked at the data, or the driver wrapped around on it.
+struct procon_mcu_frame {
+    __u32 sequence;
+    __u32 length;
+    __u8 type; // PROCON_MCU_REPORT_*.
+    __u8 complete; // 0 when fragments went missing, those are left zero.
+    __u8 reserved[2];
+    __u8 data[];
+};
+
+#ifdef __KERNEL__
+
+// Outlives the controller while userspace still has it mapped.
+struct procon_mcu_ring {
+    struct kref ref;
+    void *mem; // Header and slots, from vmalloc_user().
+    size_t size;
+    unsigned int slot_count;
+    unsigned int slot_size;
+    wait_queue_head_t wait;
+    bool dead; // The controller went away.
+};
+
+struct procon_mcu {
+    enum procon_mcu_mode mode;
+    unsigned int ir_fragments; // Fragments in one IR image.
+
+    spinlock_t lock; // Everything below, taken from the event path.
+    struct procon_mcu_ring *ring;
+    struct procon_mcu_frame *frame; // Being assembled, NULL between frames.
+    DECLARE_BITMAP(received, PROCON_MCU_MAX_FRAGMENTS);
+    __u32 head;
+
+    // Statistics.
+    unsigned int reports;
+    unsigned int fragments;
+    unsigned int frames;
+    unsigned int incomplete;
+    __u8 last_type;
+};
+
+struct controller;
+
+int procon_mcu_set_mode(struct controller *c, enum procon_mcu_mode mode, unsigned int ir_fragments);
+
+int procon_mcu_configure(struct controller *c, char *config);
+
+void procon_mcu_input(struct controller *c, const __u8 *data, size_t len);
+
+void procon_mcu_show(struct seq_file *m, struct controller *c);
+
+int procon_mcu_frames_open(struct inode *inode, struct file *file);
+
+int procon_mcu_frames_release(struct inode *inode, struct file *file);
+
+int procon_mcu_frames_mmap(struct file *file, struct vm_area_struct *vma);
+
+__poll_t procon_mcu_frames_poll(struct file *file, poll_table *wait);
+
+void procon_mcu_init(struct controller *c);
+
+void procon_mcu_stop(struct controller *c);
+
+#endif
+
+#endif
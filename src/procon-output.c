@@ -0,0 +1,504 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/seq_file.h>
+
+#include "commands.h"
+#include "packet.h"
+#include "procon-controller.h"
+#include "procon-output.h"
+#include "procon-probe.h"
+#include "procon-compat.h"
+
+// All controllers sharing one Bluetooth adapter (or one USB port).
+struct procon_adapter {
+    struct list_head node;
+    struct device *dev;
+
+    struct list_head controllers;
+    unsigned int num_controllers;
+    struct procon_output *cursor; // Controller that sent the last subcommand.
+
+    ktime_t next_frame; // Earliest time the adapter has room for another frame.
+};
+
+static unsigned int adapter_frame_budget = 250;
+module_param(adapter_frame_budget, uint, 0644);
+MODULE_PARM_DESC(adapter_frame_budget, "Output frames per second, shared by all controllers on one adapter.");
+
+static unsigned int rumble_deadline_ms = 10;
+module_param(rumble_deadline_ms, uint, 0644);
+MODULE_PARM_DESC(rumble_deadline_ms, "Time within which a queued rumble frame should be sent.");
+
+static unsigned int pacing_min_ms = 15;
+module_param(pacing_min_ms, uint, 0644);
+MODULE_PARM_DESC(pacing_min_ms, "Lower bound of the subcommand pacing interval.");
+
+static unsigned int pacing_max_ms = 250;
+module_param(pacing_max_ms, uint, 0644);
+MODULE_PARM_DESC(pacing_max_ms, "Upper bound of the subcommand pacing interval.");
+
+static unsigned int pacing_step_ms = 5;
+module_param(pacing_step_ms, uint, 0644);
+MODULE_PARM_DESC(pacing_step_ms, "Amount the pacing interval shrinks by for every acked subcommand.");
+
+static LIST_HEAD(procon_adapters);
+
+// Held while frames are sent, so a controller cannot be removed halfway.
+static DEFINE_MUTEX(procon_output_mutex);
+
+// Protects the queues, these are filled from any context.
+static DEFINE_SPINLOCK(procon_output_lock);
+
+static struct workqueue_struct *procon_output_wq;
+static struct work_struct procon_output_work;
+static struct hrtimer procon_output_timer;
+
+int send_message_raw(struct hid_device *hdev, const __u8 *data, size_t len) {
+    size_t buf_len = len;
+    __u8 *buf;
+    int ret;
+
+    // Over USB every output report is a full 64 byte frame.
+    if (hdev->bus == BUS_USB && buf_len < PROCON_USB_REPORT_LENGTH) {
+        buf_len = PROCON_USB_REPORT_LENGTH;
+    }
+
+    // Try to allocate enough memory to send the message.
+    buf = kzalloc(buf_len, GFP_KERNEL);
+    if (buf == NULL) {
+        return -ENOMEM;
+    }
+
+    memcpy(buf, data, len);
+
+    // Send the message.
+    ret = hid_hw_output_report(hdev, buf, buf_len);
+
+    // Free the buffer.
+    kfree(buf);
+
+    if (ret < 0) {
+        pr_warn("Failed to send message to device: %d\n", ret);
+    }
+
+    return ret;
+}
+
+static void procon_output_transmit(struct controller *c, struct packet *p) {
+    size_t len = 0x40;
+    int ret;
+
+    // Set the packet number.
+    p->packet_num = c->current_packet_num++;
+    if (c->current_packet_num > 0x0F) {
+        c->current_packet_num = 0x00;
+    }
+
+    // If the packet is a rumble only command, truncate the message to 11 bytes.
+    if (p->command == PROCON_CMD_RUMBLE) {
+        len = 0xB;
+    }
+
+    mutex_lock(&c->lock);
+
+    ret = send_message_raw(c->handler, (__u8*) p, len);
+    if (ret < 0) {
+        c->send_errors++;
+    }
+
+    mutex_unlock(&c->lock);
+}
+
+// Must hold procon_output_lock.
+static void procon_output_record(struct procon_output *o, enum procon_pacing_reason reason, ktime_t now, unsigned int latency_us) {
+    struct procon_pacing_event *e = &o->history[o->history_next];
+
+    e->time = now;
+    e->reason = reason;
+    e->latency_us = latency_us;
+    e->interval_us = o->interval_us;
+
+    o->history_next = (o->history_next + 1) % PROCON_PACING_HISTORY;
+}
+
+// An ack never came, back off by doubling the interval. Must hold procon_output_lock.
+// The subcommand is not sent again, the probe timing has to know it was given up on.
+static void procon_output_missed(struct procon_output *o, ktime_t now) {
+    o->awaiting_ack = false;
+    o->misses++;
+    o->interval_us = min(o->interval_us * 2, pacing_max_ms * USEC_PER_MSEC);
+
+    procon_output_record(o, PROCON_PACING_MISS, now, 0);
+    procon_probe_missed(container_of(o, struct controller, output), o->awaiting_id);
+}
+
+void procon_output_ack(struct controller *c, __u8 subcommand_id) {
+    struct procon_output *o = &c->output;
+    unsigned long flags;
+    unsigned int latency_us;
+    unsigned int floor_us;
+    unsigned int step_us = pacing_step_ms * USEC_PER_MSEC;
+    ktime_t now = ktime_get();
+
+    spin_lock_irqsave(&procon_output_lock, flags);
+
+    if (!o->awaiting_ack || o->awaiting_id != subcommand_id) {
+        spin_unlock_irqrestore(&procon_output_lock, flags);
+        return;
+    }
+
+    latency_us = ktime_us_delta(now, o->subcommand_sent);
+    o->awaiting_ack = false;
+    o->acks++;
+
+    // Keep a smoothed latency, the interval never goes below twice of it.
+    o->srtt_us = o->srtt_us == 0 ? latency_us : (7 * o->srtt_us + latency_us) / 8;
+    floor_us = max(pacing_min_ms * USEC_PER_MSEC, 2 * o->srtt_us);
+
+    // Additive decrease of the interval.
+    o->interval_us = o->interval_us > floor_us + step_us ? o->interval_us - step_us : floor_us;
+    procon_output_record(o, PROCON_PACING_ACK, now, latency_us);
+
+    // The controller is done with the subcommand, so the next one can go out right away.
+    o->next_subcommand = ktime_add_ms(o->subcommand_sent, pacing_min_ms);
+    if (ktime_before(o->next_subcommand, now)) {
+        o->next_subcommand = now;
+    }
+
+    spin_unlock_irqrestore(&procon_output_lock, flags);
+
+    queue_work(procon_output_wq, &procon_output_work);
+}
+
+static const char * const pacing_reason_names[] = {
+    [PROCON_PACING_ACK] = "ack",
+    [PROCON_PACING_MISS] = "miss",
+};
+
+int procon_output_show_pacing(struct seq_file *m, struct controller *c) {
+    struct procon_pacing_event history[PROCON_PACING_HISTORY];
+    unsigned int interval_us, srtt_us, acks, misses, queued, next;
+    unsigned long flags;
+    ktime_t now = ktime_get();
+
+    // Work on a copy, seq_printf() should not run under the spinlock.
+    spin_lock_irqsave(&procon_output_lock, flags);
+    interval_us = c->output.interval_us;
+    srtt_us = c->output.srtt_us;
+    acks = c->output.acks;
+    misses = c->output.misses;
+    queued = c->output.count;
+    next = c->output.history_next;
+    memcpy(history, c->output.history, sizeof(history));
+    spin_unlock_irqrestore(&procon_output_lock, flags);
+
+    seq_printf(m, "interval_us: %u\nsrtt_us: %u\nacks: %u\nmisses: %u\nqueued: %u\n\n", interval_us, srtt_us, acks, misses, queued);
+
+    // Oldest adjustment first.
+    seq_puts(m, "age_ms reason latency_us interval_us\n");
+    for (unsigned int i = 0; i < PROCON_PACING_HISTORY; i++) {
+        struct procon_pacing_event *e = &history[(next + i) % PROCON_PACING_HISTORY];
+
+        if (e->time == 0) {
+            continue;
+        }
+
+        seq_printf(m, "%lld %s %u %u\n", ktime_ms_delta(now, e->time), pacing_reason_names[e->reason], e->latency_us, e->interval_us);
+    }
+
+    return 0;
+}
+
+static struct procon_output *procon_output_next(struct procon_adapter *a, struct procon_output *o) {
+    if (o == NULL || list_is_last(&o->node, &a->controllers)) {
+        return list_first_entry(&a->controllers, struct procon_output, node);
+    }
+
+    return list_next_entry(o, node);
+}
+
+// Anything to send, or an ack to give up on.
+static bool procon_output_pending(struct procon_adapter *a) {
+    struct procon_output *o;
+
+    list_for_each_entry(o, &a->controllers, node) {
+        if (o->rumble_pending || o->mcu_pending || o->count > 0 || o->awaiting_ack) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Takes the next frame for the adapter off the queues. Must hold procon_output_lock.
+// Rumble goes first, earliest deadline first. Subcommands take turns between controllers.
+static struct controller *procon_output_pick(struct procon_adapter *a, ktime_t now, struct packet *p, ktime_t *wake) {
+    struct procon_output *o;
+    struct procon_output *best = NULL;
+
+    list_for_each_entry(o, &a->controllers, node) {
+        if (o->rumble_pending && (best == NULL || ktime_before(o->rumble_deadline, best->rumble_deadline))) {
+            best = o;
+        }
+    }
+
+    if (best != NULL) {
+        *p = best->rumble;
+        best->rumble_pending = false;
+        return container_of(best, struct controller, output);
+    }
+
+    // MCU requests get no subcommand reply, so they skip the pacing.
+    list_for_each_entry(o, &a->controllers, node) {
+        if (o->mcu_pending) {
+            *p = o->mcu;
+            o->mcu_pending = false;
+            return container_of(o, struct controller, output);
+        }
+    }
+
+    o = a->cursor;
+    for (unsigned int i = 0; i < a->num_controllers; i++) {
+        o = procon_output_next(a, o);
+
+        // Waited a full interval without an ack. This is noticed on time even when nothing
+        // else is queued, the last subcommand of a burst can go unanswered too.
+        if (o->awaiting_ack) {
+            if (ktime_after(o->next_subcommand, now)) {
+                *wake = min(*wake, o->next_subcommand);
+            } else {
+                procon_output_missed(o, now);
+            }
+        }
+
+        if (o->count == 0) {
+            continue;
+        }
+
+        // The controller is still busy with its previous subcommand.
+        if (ktime_after(o->next_subcommand, now)) {
+            *wake = min(*wake, o->next_subcommand);
+            continue;
+        }
+
+        *p = o->subcommands[o->head];
+        o->head = (o->head + 1) % PROCON_OUTPUT_QUEUE_LEN;
+        o->count--;
+
+        o->subcommand_sent = now;
+        o->awaiting_id = p->subcommand;
+        o->awaiting_ack = true;
+        o->next_subcommand = ktime_add_us(now, o->interval_us);
+        a->cursor = o;
+
+        return container_of(o, struct controller, output);
+    }
+
+    return NULL;
+}
+
+static void procon_output_run(struct work_struct *work) {
+    struct procon_adapter *a;
+    struct controller *c;
+    struct packet p;
+    unsigned long flags;
+    ktime_t now;
+    ktime_t wake = KTIME_MAX;
+    u64 interval = NSEC_PER_SEC / max(adapter_frame_budget, 1U);
+
+    mutex_lock(&procon_output_mutex);
+
+    list_for_each_entry(a, &procon_adapters, node) {
+        for (;;) {
+            now = ktime_get();
+
+            spin_lock_irqsave(&procon_output_lock, flags);
+
+            // The adapter used up its budget, come back once there is room again.
+            if (ktime_after(a->next_frame, now)) {
+                if (procon_output_pending(a)) {
+                    wake = min(wake, a->next_frame);
+                }
+
+                spin_unlock_irqrestore(&procon_output_lock, flags);
+                break;
+            }
+
+            c = procon_output_pick(a, now, &p, &wake);
+            spin_unlock_irqrestore(&procon_output_lock, flags);
+
+            if (c == NULL) {
+                break;
+            }
+
+            procon_output_transmit(c, &p);
+            a->next_frame = ktime_add_ns(now, interval);
+        }
+    }
+
+    mutex_unlock(&procon_output_mutex);
+
+    if (wake != KTIME_MAX) {
+        hrtimer_start(&procon_output_timer, wake, HRTIMER_MODE_ABS);
+    }
+}
+
+static enum hrtimer_restart procon_output_timer_fired(struct hrtimer *timer) {
+    queue_work(procon_output_wq, &procon_output_work);
+    return HRTIMER_NORESTART;
+}
+
+int send_message(struct controller *c, struct packet *p) {
+    struct procon_output *o = &c->output;
+    unsigned long flags;
+    int ret = 0;
+
+    spin_lock_irqsave(&procon_output_lock, flags);
+
+    if (o->adapter == NULL) {
+        ret = -ENODEV;
+    } else if (p->command == PROCON_CMD_RUMBLE) {
+        // A newer rumble state replaces the old one, but keeps its deadline.
+        if (!o->rumble_pending) {
+            o->rumble_deadline = ktime_add_ms(ktime_get(), rumble_deadline_ms);
+            o->rumble_pending = true;
+        }
+
+        o->rumble = *p;
+    } else if (p->command == PROCON_CMD_MCU) {
+        o->mcu = *p;
+        o->mcu_pending = true;
+    } else if (o->count == PROCON_OUTPUT_QUEUE_LEN) {
+        ret = -ENOSPC;
+    } else {
+        o->subcommands[(o->head + o->count) % PROCON_OUTPUT_QUEUE_LEN] = *p;
+        o->count++;
+
+        // Before the scheduler can send it, so its reply or miss always finds it.
+        procon_probe_subcommand(c, p);
+    }
+
+    spin_unlock_irqrestore(&procon_output_lock, flags);
+
+    if (ret < 0) {
+        c->send_errors++;
+        return ret;
+    }
+
+    queue_work(procon_output_wq, &procon_output_work);
+    return 0;
+}
+
+// Controllers on the same adapter share a parent of the HID device.
+// For Bluetooth this is the HCI device, the parent of the connection.
+static struct device *procon_output_adapter_dev(struct hid_device *hdev) {
+    struct device *dev = hdev->dev.parent;
+
+    if (dev != NULL && dev->parent != NULL) {
+        dev = dev->parent;
+    }
+
+    return dev;
+}
+
+int procon_output_register(struct controller *c) {
+    struct device *dev = procon_output_adapter_dev(c->handler);
+    struct procon_adapter *a;
+    struct procon_adapter *found = NULL;
+    unsigned long flags;
+
+    mutex_lock(&procon_output_mutex);
+
+    list_for_each_entry(a, &procon_adapters, node) {
+        if (a->dev == dev) {
+            found = a;
+            break;
+        }
+    }
+
+    if (found == NULL) {
+        found = kzalloc(sizeof(struct procon_adapter), GFP_KERNEL);
+        if (found == NULL) {
+            mutex_unlock(&procon_output_mutex);
+            return -ENOMEM;
+        }
+
+        found->dev = dev;
+        INIT_LIST_HEAD(&found->controllers);
+        list_add_tail(&found->node, &procon_adapters);
+    }
+
+    spin_lock_irqsave(&procon_output_lock, flags);
+
+    c->output.adapter = found;
+    c->output.next_subcommand = ktime_get();
+    c->output.interval_us = MAX_SUBCMD_RATE_MS * USEC_PER_MSEC;
+    list_add_tail(&c->output.node, &found->controllers);
+    found->num_controllers++;
+
+    spin_unlock_irqrestore(&procon_output_lock, flags);
+
+    mutex_unlock(&procon_output_mutex);
+    return 0;
+}
+
+void procon_output_unregister(struct controller *c) {
+    struct procon_adapter *a;
+    unsigned long flags;
+
+    mutex_lock(&procon_output_mutex);
+
+    a = c->output.adapter;
+    if (a == NULL) {
+        mutex_unlock(&procon_output_mutex);
+        return;
+    }
+
+    spin_lock_irqsave(&procon_output_lock, flags);
+
+    list_del(&c->output.node);
+    a->num_controllers--;
+    if (a->cursor == &c->output) {
+        a->cursor = NULL;
+    }
+
+    c->output.adapter = NULL;
+    c->output.count = 0;
+    c->output.rumble_pending = false;
+    c->output.mcu_pending = false;
+    c->output.awaiting_ack = false;
+
+    spin_unlock_irqrestore(&procon_output_lock, flags);
+
+    if (a->num_controllers == 0) {
+        list_del(&a->node);
+        kfree(a);
+    }
+
+    mutex_unlock(&procon_output_mutex);
+}
+
+int procon_output_init(void) {
+    procon_output_wq = alloc_ordered_workqueue("procon-output", WQ_HIGHPRI);
+    if (procon_output_wq == NULL) {
+        return -ENOMEM;
+    }
+
+    INIT_WORK(&procon_output_work, procon_output_run);
+    hrtimer_setup(&procon_output_timer, procon_output_timer_fired, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+
+    return 0;
+}
+
+void procon_output_exit(void) {
+    hrtimer_cancel(&procon_output_timer);
+    cancel_work_sync(&procon_output_work);
+    destroy_workqueue(procon_output_wq);
+}
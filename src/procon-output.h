@@ -0,0 +1,87 @@
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/ktime.h>
+#include <linux/hid.h>
+#include <linux/seq_file.h>
+
+#include "packet.h"
+
+#ifndef __PROCON_OUTPUT_H__
+#define __PROCON_OUTPUT_H__
+
+// Number of pacing adjustments kept for debugfs.
+#define PROCON_PACING_HISTORY 32
+
+// Size of every output report over USB.
+#define PROCON_USB_REPORT_LENGTH 64
+
+// Number of subcommands a controller can have waiting to be sent.
+#define PROCON_OUTPUT_QUEUE_LEN 16
+
+struct procon_adapter;
+
+enum procon_pacing_reason {
+    PROCON_PACING_ACK,
+    PROCON_PACING_MISS,
+};
+
+struct procon_pacing_event {
+    ktime_t time;
+    enum procon_pacing_reason reason;
+    unsigned int latency_us;
+    unsigned int interval_us;
+};
+
+// Per-controller output state, owned by the output scheduler.
+struct procon_output {
+    struct list_head node; // Entry in the controller list of the adapter.
+    struct procon_adapter *adapter;
+
+    // Subcommands, sent in order.
+    struct packet subcommands[PROCON_OUTPUT_QUEUE_LEN];
+    unsigned int head;
+    unsigned int count;
+
+    // Only the latest rumble state matters, so there is a single slot for it.
+    struct packet rumble;
+    bool rumble_pending;
+    ktime_t rumble_deadline;
+
+    // The same for MCU requests, only the latest ack is worth sending.
+    struct packet mcu;
+    bool mcu_pending;
+
+    ktime_t next_subcommand; // Earliest time the controller accepts a new subcommand.
+
+    // Adaptive pacing. The interval is how long to wait for an ack before sending anyway.
+    unsigned int interval_us;
+    unsigned int srtt_us; // Smoothed ack latency.
+    ktime_t subcommand_sent;
+    __u8 awaiting_id;
+    bool awaiting_ack;
+
+    unsigned int acks;
+    unsigned int misses;
+    struct procon_pacing_event history[PROCON_PACING_HISTORY];
+    unsigned int history_next;
+};
+
+struct controller;
+
+int send_message_raw(struct hid_device *hdev, const __u8 *data, size_t len);
+
+int send_message(struct controller *c, struct packet *p);
+
+void procon_output_ack(struct controller *c, __u8 subcommand_id);
+
+int procon_output_show_pacing(struct seq_file *m, struct controller *c);
+
+int procon_output_register(struct controller *c);
+
+void procon_output_unregister(struct controller *c);
+
+int procon_output_init(void);
+
+void procon_output_exit(void);
+
+#endif
@@ -0,0 +1,338 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/input.h>
+
+#include "hids.h"
+#include "packet.h"
+#include "procon-controller.h"
+#include "procon-devices.h"
+#include "procon-input.h"
+#include "procon-keymap.h"
+#include "procon-pair.h"
+#include "procon-stream.h"
+
+// A left and a right JoyCon that share one input device.
+// The input device only exists while both halves are connected.
+struct procon_pair {
+    struct list_head node;
+    struct controller *left;
+    struct controller *right;
+
+    // The combined controller, only what the input path needs is set up.
+    // Both halves sync through it, so they share one frame and one max_sync_rate.
+    struct controller c;
+    struct input_response state; // What both halves last reported, guarded by procon_pair_lock.
+};
+
+static bool joycon_merge = false;
+module_param(joycon_merge, bool, 0444);
+MODULE_PARM_DESC(joycon_merge, "Combine a left and a right JoyCon into a single input device.");
+
+static LIST_HEAD(procon_pairs);
+
+// Serialises adding and removing halves, input devices are registered under it.
+static DEFINE_MUTEX(procon_pair_mutex);
+
+// Protects the pair pointers, the merged state and the input device against the event path.
+static DEFINE_SPINLOCK(procon_pair_lock);
+
+static bool procon_pair_is_left(struct controller *c) {
+    return c->handler->product == DEVICE_JOYCON_LEFT;
+}
+
+// Copies the part of the keymap a half owns to the combined controller.
+// The halves only map their own buttons and axes, so they never overwrite each other.
+// Must hold the input lock of the combined controller.
+static void procon_pair_copy_keymap(struct procon_pair *pair, const struct controller *half, const struct procon_keymap *map) {
+    const struct procon_device_desc *desc = half->desc;
+
+    for (int i = 0; i < PROCON_BTN_COUNT; i++) {
+        if (desc->button_mask & BIT(i)) {
+            pair->c.keymap.keys[i] = map->keys[i];
+        }
+    }
+
+    for (size_t i = 0; i < desc->num_axes; i++) {
+        enum procon_axis axis = desc->axes[i].axis;
+
+        pair->c.keymap.axes[axis] = map->axes[axis];
+        pair->c.keymap.sign[axis] = map->sign[axis];
+    }
+}
+
+bool procon_pair_wanted(struct controller *c) {
+    return joycon_merge && (c->handler->product == DEVICE_JOYCON_LEFT || c->handler->product == DEVICE_JOYCON_RIGHT);
+}
+
+// The combined device is open when either half would be, so both halves follow it.
+static void procon_pair_set_open(struct procon_pair *pair, bool open) {
+    unsigned long flags;
+
+    spin_lock_irqsave(&procon_pair_lock, flags);
+
+    if (pair->left != NULL) {
+        procon_stream_set_open(pair->left, open);
+    }
+
+    if (pair->right != NULL) {
+        procon_stream_set_open(pair->right, open);
+    }
+
+    spin_unlock_irqrestore(&procon_pair_lock, flags);
+}
+
+static int procon_pair_input_open(struct input_dev *input) {
+    procon_pair_set_open(input_get_drvdata(input), true);
+    return 0;
+}
+
+static void procon_pair_input_close(struct input_dev *input) {
+    procon_pair_set_open(input_get_drvdata(input), false);
+}
+
+static struct procon_pair *procon_pair_alloc(void) {
+    struct procon_pair *pair;
+
+    pair = kzalloc(sizeof(struct procon_pair), GFP_KERNEL);
+    if (pair == NULL) {
+        return NULL;
+    }
+
+    // Together the halves have everything a ProCon has.
+    pair->c.desc = &procon_desc_procon;
+    procon_input_init(&pair->c);
+    procon_keymap_init(&pair->c);
+
+    return pair;
+}
+
+static struct input_dev *procon_pair_create_input_device(struct procon_pair *pair) {
+    struct hid_device *hdev = pair->left->handler;
+    struct input_dev *input;
+    int ret;
+
+    // The device outlives either half, so it is not managed by one of them.
+    input = input_allocate_device();
+    if (input == NULL) {
+        return ERR_PTR(-ENOMEM);
+    }
+
+    input->dev.parent = &hdev->dev;
+    input->id.bustype = hdev->bus;
+    input->id.product = DEVICE_PROCON;
+    input->id.vendor = hdev->vendor;
+    input->id.version = hdev->version;
+    input->uniq = hdev->uniq;
+    input->name = "Nintendo Switch Combined JoyCons";
+
+    // Together the halves have everything a ProCon has.
+    procon_input_set_capabilities(input, &procon_desc_procon);
+
+    input_set_drvdata(input, pair);
+    input->open = procon_pair_input_open;
+    input->close = procon_pair_input_close;
+
+    ret = input_register_device(input);
+    if (ret < 0) {
+        input_free_device(input);
+        return ERR_PTR(ret);
+    }
+
+    return input;
+}
+
+int procon_pair_add(struct controller *c) {
+    struct procon_pair *pair;
+    struct procon_pair *found = NULL;
+    struct input_dev *input;
+    unsigned long flags;
+    bool left = procon_pair_is_left(c);
+
+    mutex_lock(&procon_pair_mutex);
+
+    // Look for a half waiting for this one.
+    list_for_each_entry(pair, &procon_pairs, node) {
+        if ((left && pair->left == NULL) || (!left && pair->right == NULL)) {
+            found = pair;
+            break;
+        }
+    }
+
+    if (found == NULL) {
+        found = procon_pair_alloc();
+        if (found == NULL) {
+            mutex_unlock(&procon_pair_mutex);
+            return -ENOMEM;
+        }
+
+        list_add_tail(&found->node, &procon_pairs);
+    }
+
+    spin_lock_irqsave(&procon_pair_lock, flags);
+    if (left) {
+        found->left = c;
+    } else {
+        found->right = c;
+    }
+    c->pair = found;
+    spin_unlock_irqrestore(&procon_pair_lock, flags);
+
+    if (found->left == NULL || found->right == NULL) {
+        pr_info("JoyCon [controller%d] is waiting for its other half.\n", c->controller_id);
+        mutex_unlock(&procon_pair_mutex);
+        return 0;
+    }
+
+    input = procon_pair_create_input_device(found);
+    if (IS_ERR(input)) {
+        pr_err("Could not create combined input device: %ld.\n", PTR_ERR(input));
+
+        // The other half keeps waiting, this one is not merged after all.
+        spin_lock_irqsave(&procon_pair_lock, flags);
+        if (left) {
+            found->left = NULL;
+        } else {
+            found->right = NULL;
+        }
+        c->pair = NULL;
+        spin_unlock_irqrestore(&procon_pair_lock, flags);
+
+        mutex_unlock(&procon_pair_mutex);
+        return PTR_ERR(input);
+    }
+
+    // Both halves start out neutral, under the keymaps they have now.
+    spin_lock_irqsave(&procon_pair_lock, flags);
+    memset(&found->state, 0, sizeof(found->state));
+
+    spin_lock(&found->left->input_lock);
+    spin_lock(&found->c.input_lock);
+    procon_pair_copy_keymap(found, found->left, &found->left->keymap);
+    found->c.sync_state = found->state;
+    found->c.synced_buttons = 0;
+    found->c.input = input;
+    spin_unlock(&found->c.input_lock);
+    spin_unlock(&found->left->input_lock);
+
+    spin_lock(&found->right->input_lock);
+    spin_lock(&found->c.input_lock);
+    procon_pair_copy_keymap(found, found->right, &found->right->keymap);
+    spin_unlock(&found->c.input_lock);
+    spin_unlock(&found->right->input_lock);
+    spin_unlock_irqrestore(&procon_pair_lock, flags);
+
+    pr_info("Combined JoyCons [controller%d] and [controller%d].\n", found->left->controller_id, found->right->controller_id);
+
+    mutex_unlock(&procon_pair_mutex);
+    return 0;
+}
+
+void procon_pair_remove(struct controller *c) {
+    struct procon_pair *pair;
+    struct input_dev *input;
+    unsigned long flags;
+
+    mutex_lock(&procon_pair_mutex);
+
+    pair = c->pair;
+    if (pair == NULL) {
+        mutex_unlock(&procon_pair_mutex);
+        return;
+    }
+
+    // Detach the half and take the input device away from the event path.
+    spin_lock_irqsave(&procon_pair_lock, flags);
+    if (pair->left == c) {
+        pair->left = NULL;
+    } else {
+        pair->right = NULL;
+    }
+    c->pair = NULL;
+
+    spin_lock(&pair->c.input_lock);
+    input = pair->c.input;
+    pair->c.input = NULL;
+    pair->c.sync_pending = false;
+    spin_unlock(&pair->c.input_lock);
+    spin_unlock_irqrestore(&procon_pair_lock, flags);
+
+    // A sync that was held back has nothing to go to anymore.
+    procon_input_stop(&pair->c);
+
+    if (input != NULL) {
+        input_unregister_device(input);
+    }
+
+    // The other half stays behind and waits for a new partner.
+    if (pair->left == NULL && pair->right == NULL) {
+        list_del(&pair->node);
+        kfree(pair);
+    }
+
+    mutex_unlock(&procon_pair_mutex);
+}
+
+// Merges what a half reports into the state of the pair, then syncs it like any controller.
+// The rate limit is the strictest one set on either half.
+void procon_pair_report(struct controller *c, const struct input_response *resp) {
+    const struct procon_device_desc *desc = c->desc;
+    struct procon_pair *pair;
+    unsigned long flags;
+    unsigned int coalesced;
+
+    spin_lock_irqsave(&procon_pair_lock, flags);
+
+    pair = c->pair;
+    if (pair != NULL && pair->c.input != NULL) {
+        pair->state.buttons = (pair->state.buttons & ~desc->button_mask) | (resp->buttons & desc->button_mask);
+
+        for (size_t i = 0; i < desc->num_axes; i++) {
+            pair->state.sticks[desc->axes[i].axis] = resp->sticks[desc->axes[i].axis];
+        }
+
+        WRITE_ONCE(pair->c.max_sync_rate, min_not_zero(READ_ONCE(pair->left->max_sync_rate), READ_ONCE(pair->right->max_sync_rate)));
+
+        // Reports of the pair are serialised by the pair lock, the difference is this report.
+        coalesced = pair->c.syncs_coalesced;
+        procon_input_report(&pair->c, &pair->state);
+        c->syncs_coalesced += pair->c.syncs_coalesced - coalesced;
+    }
+
+    spin_unlock_irqrestore(&procon_pair_lock, flags);
+}
+
+// The keymap of a half changed. Everything held is released under the old codes,
+// then the state of the pair goes out again under the new ones.
+void procon_pair_update_keymap(struct controller *c) {
+    struct input_response neutral = {0};
+    struct procon_pair *pair;
+    unsigned long flags;
+
+    spin_lock_irqsave(&procon_pair_lock, flags);
+
+    pair = c->pair;
+    if (pair != NULL) {
+        spin_lock(&c->input_lock);
+        spin_lock(&pair->c.input_lock);
+
+        if (pair->c.input != NULL) {
+            procon_input_report_state(pair->c.input, &pair->c, &neutral);
+            input_sync(pair->c.input);
+        }
+
+        procon_pair_copy_keymap(pair, c, &c->keymap);
+
+        if (pair->c.input != NULL) {
+            procon_input_report_state(pair->c.input, &pair->c, &pair->c.sync_state);
+            input_sync(pair->c.input);
+        }
+
+        spin_unlock(&pair->c.input_lock);
+        spin_unlock(&c->input_lock);
+    }
+
+    spin_unlock_irqrestore(&procon_pair_lock, flags);
+}
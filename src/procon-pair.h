@@ -0,0 +1,17 @@
+#include "packet.h"
+#include "procon-controller.h"
+
+#ifndef __PROCON_PAIR_H__
+#define __PROCON_PAIR_H__
+
+bool procon_pair_wanted(struct controller *c);
+
+int procon_pair_add(struct controller *c);
+
+void procon_pair_remove(struct controller *c);
+
+void procon_pair_report(struct controller *c, const struct input_response *resp);
+
+void procon_pair_update_keymap(struct controller *c);
+
+#endif
@@ -11,7 +11,7 @@ void print_response(struct input_response data, __u8 *raw_data, size_t len) {
         print_byte_array(data.subcommand_reply, sizeof(data.subcommand_reply));
     }
 
-    else if (data.report_id != 0x30 && data.report_id != 0x3F && data.report_id != 0x21) {
+    else if (data.report_id != 0x30 && data.report_id != 0x31 && data.report_id != 0x3F && data.report_id != 0x21) {
         pr_info("Received:\n");
         print_byte_array(raw_data, len);
     }
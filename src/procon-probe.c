@@ -0,0 +1,182 @@
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/spinlock.h>
+#include <linux/seq_file.h>
+
+#include "commands.h"
+#include "packet.h"
+#include "procon-controller.h"
+#include "procon-probe.h"
+
+static const char *procon_probe_phase_names[PROCON_PROBE_PHASE_COUNT] = {
+    [PROCON_PROBE_SLOT] = "slot",
+    [PROCON_PROBE_PARSE] = "parse",
+    [PROCON_PROBE_HW_START] = "hw_start",
+    [PROCON_PROBE_HW_OPEN] = "hw_open",
+    [PROCON_PROBE_HANDSHAKE] = "handshake",
+    [PROCON_PROBE_SUBCOMMANDS] = "subcommands",
+    [PROCON_PROBE_INPUT] = "input",
+    [PROCON_PROBE_PROC] = "proc",
+};
+
+// The phases are only written by the probe itself, before anything can read them.
+void procon_probe_begin(struct controller *c) {
+    struct procon_probe_timing *t = &c->probe;
+
+    spin_lock_init(&t->lock);
+    t->start_ns = ktime_get_ns();
+    t->mark_ns = t->start_ns;
+    t->recording = true;
+}
+
+// Ends the given phase, it took everything since the end of the one before.
+void procon_probe_phase(struct controller *c, enum procon_probe_phase phase) {
+    struct procon_probe_timing *t = &c->probe;
+    __u64 now = ktime_get_ns();
+
+    t->phase_ns[phase] = now - t->mark_ns;
+    t->mark_ns = now;
+}
+
+void procon_probe_end(struct controller *c) {
+    struct procon_probe_timing *t = &c->probe;
+    unsigned long flags;
+
+    spin_lock_irqsave(&t->lock, flags);
+    t->total_ns = ktime_get_ns() - t->start_ns;
+    t->recording = false;
+    spin_unlock_irqrestore(&t->lock, flags);
+}
+
+// Called for every subcommand queued for output, under the output lock.
+// Rumble goes without a reply, so it is not timed.
+void procon_probe_subcommand(struct controller *c, const struct packet *p) {
+    struct procon_probe_timing *t = &c->probe;
+    unsigned long flags;
+
+    if (p->command == PROCON_CMD_RUMBLE || !READ_ONCE(t->recording)) {
+        return;
+    }
+
+    spin_lock_irqsave(&t->lock, flags);
+
+    if (t->recording && t->num_subcommands < PROCON_PROBE_MAX_SUBCOMMANDS) {
+        struct procon_probe_subcommand *s = &t->subcommands[t->num_subcommands++];
+
+        s->id = p->subcommand;
+        s->queued_ns = ktime_get_ns() - t->start_ns;
+        s->acked_ns = 0;
+        s->missed_ns = 0;
+    }
+
+    spin_unlock_irqrestore(&t->lock, flags);
+}
+
+// Replies come in the order the subcommands went out, the oldest one waiting gets it.
+void procon_probe_ack(struct controller *c, __u8 subcommand_id) {
+    struct procon_probe_timing *t = &c->probe;
+    unsigned long flags;
+
+    if (READ_ONCE(t->num_acked) + READ_ONCE(t->num_missed) == READ_ONCE(t->num_subcommands)) {
+        return;
+    }
+
+    spin_lock_irqsave(&t->lock, flags);
+
+    for (unsigned int i = 0; i < t->num_subcommands; i++) {
+        struct procon_probe_subcommand *s = &t->subcommands[i];
+
+        if (s->acked_ns == 0 && s->missed_ns == 0 && s->id == subcommand_id) {
+            s->acked_ns = max_t(__u64, ktime_get_ns() - t->start_ns, 1);
+            t->num_acked++;
+            break;
+        }
+    }
+
+    spin_unlock_irqrestore(&t->lock, flags);
+}
+
+// The scheduler waited a full interval without a reply and moved on, the subcommand is not sent again.
+// Called under the output lock.
+void procon_probe_missed(struct controller *c, __u8 subcommand_id) {
+    struct procon_probe_timing *t = &c->probe;
+    unsigned long flags;
+
+    if (READ_ONCE(t->num_acked) + READ_ONCE(t->num_missed) == READ_ONCE(t->num_subcommands)) {
+        return;
+    }
+
+    spin_lock_irqsave(&t->lock, flags);
+
+    for (unsigned int i = 0; i < t->num_subcommands; i++) {
+        struct procon_probe_subcommand *s = &t->subcommands[i];
+
+        if (s->acked_ns == 0 && s->missed_ns == 0 && s->id == subcommand_id) {
+            s->missed_ns = max_t(__u64, ktime_get_ns() - t->start_ns, 1);
+            t->num_missed++;
+            break;
+        }
+    }
+
+    spin_unlock_irqrestore(&t->lock, flags);
+}
+
+// All in microseconds. The controller is usable once every subcommand of the probe got its reply,
+// or was given up on. Those show "missed" and when, instead of the time of the reply.
+int procon_probe_show(struct seq_file *m, struct controller *c) {
+    struct procon_probe_timing *t = &c->probe;
+    struct procon_probe_subcommand subcommands[PROCON_PROBE_MAX_SUBCOMMANDS];
+    unsigned int num_subcommands;
+    unsigned int num_acked;
+    unsigned int num_missed;
+    __u64 total_ns;
+    unsigned long flags;
+    __u64 usable = 0;
+
+    spin_lock_irqsave(&t->lock, flags);
+    memcpy(subcommands, t->subcommands, sizeof(subcommands));
+    num_subcommands = t->num_subcommands;
+    num_acked = t->num_acked;
+    num_missed = t->num_missed;
+    total_ns = t->total_ns;
+    spin_unlock_irqrestore(&t->lock, flags);
+
+    seq_printf(m, "device %s\n", c->handler->uniq);
+
+    for (int i = 0; i < PROCON_PROBE_PHASE_COUNT; i++) {
+        seq_printf(m, "%s %llu\n", procon_probe_phase_names[i], div_u64(t->phase_ns[i], NSEC_PER_USEC));
+    }
+    seq_printf(m, "probe %llu\n", div_u64(total_ns, NSEC_PER_USEC));
+
+    for (unsigned int i = 0; i < num_subcommands; i++) {
+        struct procon_probe_subcommand *s = &subcommands[i];
+
+        if (s->missed_ns != 0) {
+            seq_printf(m, "subcommand %02x %llu missed %llu\n", s->id, div_u64(s->queued_ns, NSEC_PER_USEC),
+                div_u64(s->missed_ns, NSEC_PER_USEC));
+            usable = max(usable, s->missed_ns);
+            continue;
+        }
+
+        if (s->acked_ns == 0) {
+            seq_printf(m, "subcommand %02x %llu -\n", s->id, div_u64(s->queued_ns, NSEC_PER_USEC));
+            continue;
+        }
+
+        seq_printf(m, "subcommand %02x %llu %llu\n", s->id, div_u64(s->queued_ns, NSEC_PER_USEC),
+            div_u64(s->acked_ns, NSEC_PER_USEC));
+        usable = max(usable, s->acked_ns);
+    }
+
+    seq_printf(m, "missed %u\n", num_missed);
+
+    if (total_ns > 0 && num_acked + num_missed == num_subcommands) {
+        seq_printf(m, "usable %llu\n", div_u64(max(usable, total_ns), NSEC_PER_USEC));
+    } else {
+        seq_puts(m, "usable -\n");
+    }
+
+    return 0;
+}
@@ -0,0 +1,63 @@
+#include <linux/types.h>
+#include <linux/spinlock.h>
+#include <linux/seq_file.h>
+
+#include "packet.h"
+
+#ifndef __PROCON_PROBE_H__
+#define __PROCON_PROBE_H__
+
+// Steps of procon_init_device(), in the order they run.
+enum procon_probe_phase {
+    PROCON_PROBE_SLOT,        // Finding a controller slot, setting up the controller and its output.
+    PROCON_PROBE_PARSE,       // hid_parse().
+    PROCON_PROBE_HW_START,    // hid_hw_start().
+    PROCON_PROBE_HW_OPEN,     // hid_hw_open().
+    PROCON_PROBE_HANDSHAKE,   // The raw handshake, paced by MAX_SUBCMD_RATE_MS.
+    PROCON_PROBE_SUBCOMMANDS, // Queueing the info, flash and setup subcommands.
+    PROCON_PROBE_INPUT,       // Creating or taking over the input device.
+    PROCON_PROBE_PROC,        // The proc and debugfs files.
+    PROCON_PROBE_PHASE_COUNT,
+};
+
+// Subcommands queued while probing, the ones after that are not timed.
+#define PROCON_PROBE_MAX_SUBCOMMANDS 12
+
+struct procon_probe_subcommand {
+    __u8 id;
+    __u64 queued_ns; // Since the start of the probe.
+    __u64 acked_ns; // 0 while no reply came.
+    __u64 missed_ns; // When the scheduler gave up waiting for the reply, 0 if it did not.
+};
+
+struct procon_probe_timing {
+    spinlock_t lock; // Subcommands, acks come in from the event path.
+    __u64 start_ns;
+    __u64 mark_ns; // End of the last phase.
+    __u64 phase_ns[PROCON_PROBE_PHASE_COUNT];
+    __u64 total_ns; // Until probe returned, 0 while it runs.
+    bool recording;
+
+    struct procon_probe_subcommand subcommands[PROCON_PROBE_MAX_SUBCOMMANDS];
+    unsigned int num_subcommands;
+    unsigned int num_acked;
+    unsigned int num_missed;
+};
+
+struct controller;
+
+void procon_probe_begin(struct controller *c);
+
+void procon_probe_phase(struct controller *c, enum procon_probe_phase phase);
+
+void procon_probe_end(struct controller *c);
+
+void procon_probe_subcommand(struct controller *c, const struct packet *p);
+
+void procon_probe_ack(struct controller *c, __u8 subcommand_id);
+
+void procon_probe_missed(struct controller *c, __u8 subcommand_id);
+
+int procon_probe_show(struct seq_file *m, struct controller *c);
+
+#endif
@@ -0,0 +1,75 @@
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+#include <linux/math64.h>
+#include <linux/seq_file.h>
+
+#include "procon-controller.h"
+#include "procon-profile.h"
+
+static const char *procon_profile_names[PROCON_PROFILE_COUNT] = {"decode", "reply", "report"};
+
+// Reports of one controller come in one at a time, so the counters are not locked.
+// A reader can see a sample half counted, which is fine for statistics.
+void procon_profile_end(struct controller *c, enum procon_profile_section section, __u64 start) {
+    struct procon_profile_stats *stats = &c->profile.sections[section];
+    __u64 ns = local_clock() - start;
+    int bucket = min(fls64(ns), PROCON_PROFILE_BUCKETS - 1);
+
+    if (stats->samples == 0 || ns < stats->min_ns) {
+        stats->min_ns = ns;
+    }
+
+    if (ns > stats->max_ns) {
+        stats->max_ns = ns;
+    }
+
+    stats->samples++;
+    stats->total_ns += ns;
+    stats->buckets[bucket]++;
+}
+
+// Upper bound of the bucket the given percentile falls in.
+static __u64 procon_profile_percentile(const struct procon_profile_stats *stats, unsigned int percent) {
+    __u64 wanted = div_u64(stats->samples * percent + 99, 100);
+    __u64 seen = 0;
+
+    for (int i = 0; i < PROCON_PROFILE_BUCKETS; i++) {
+        seen += stats->buckets[i];
+        if (seen >= wanted) {
+            return i < PROCON_PROFILE_BUCKETS - 1 ? 1ULL << i : stats->max_ns;
+        }
+    }
+
+    return stats->max_ns;
+}
+
+int procon_profile_show(struct seq_file *m, struct controller *c) {
+    seq_puts(m, "section samples min_ns mean_ns max_ns p50_ns p90_ns p99_ns\n");
+
+    for (int i = 0; i < PROCON_PROFILE_COUNT; i++) {
+        struct procon_profile_stats stats = c->profile.sections[i];
+
+        if (stats.samples == 0) {
+            seq_printf(m, "%s 0 - - - - - -\n", procon_profile_names[i]);
+            continue;
+        }
+
+        seq_printf(m, "%s %llu %llu %llu %llu <%llu <%llu <%llu\n", procon_profile_names[i], stats.samples,
+            stats.min_ns, div64_u64(stats.total_ns, stats.samples), stats.max_ns,
+            procon_profile_percentile(&stats, 50), procon_profile_percentile(&stats, 90), procon_profile_percentile(&stats, 99));
+    }
+
+    // The histograms, by upper bound of each bucket in ns.
+    for (int i = 0; i < PROCON_PROFILE_COUNT; i++) {
+        seq_printf(m, "\n%s:", procon_profile_names[i]);
+
+        for (int j = 0; j < PROCON_PROFILE_BUCKETS; j++) {
+            if (c->profile.sections[i].buckets[j] > 0) {
+                seq_printf(m, " <%llu=%llu", 1ULL << j, c->profile.sections[i].buckets[j]);
+            }
+        }
+    }
+    seq_puts(m, "\n");
+
+    return 0;
+}
@@ -0,0 +1,55 @@
+#include <linux/types.h>
+#include <linux/seq_file.h>
+#include <linux/sched/clock.h>
+
+#ifndef __PROCON_PROFILE_H__
+#define __PROCON_PROFILE_H__
+
+// Time spent in parts of the event path, only built with PROCON_PROFILE=1.
+enum procon_profile_section {
+    PROCON_PROFILE_DECODE, // decode_message().
+    PROCON_PROFILE_REPLY,  // Handling of a subcommand reply.
+    PROCON_PROFILE_REPORT, // Passing the state to the input device.
+    PROCON_PROFILE_COUNT,
+};
+
+// Samples by log2 of the nanoseconds taken, the last bucket takes everything from 4 ms up.
+#define PROCON_PROFILE_BUCKETS 24
+
+struct procon_profile_stats {
+    __u64 samples;
+    __u64 total_ns;
+    __u64 min_ns;
+    __u64 max_ns;
+    __u64 buckets[PROCON_PROFILE_BUCKETS];
+};
+
+struct procon_profile {
+    struct procon_profile_stats sections[PROCON_PROFILE_COUNT];
+};
+
+struct controller;
+
+#ifdef PROCON_PROFILE
+
+static inline __u64 procon_profile_start(void) {
+    return local_clock();
+}
+
+void procon_profile_end(struct controller *c, enum procon_profile_section section, __u64 start);
+
+int procon_profile_show(struct seq_file *m, struct controller *c);
+
+#else
+
+// Compiled out, none of this leaves anything behind in the event path.
+static inline __u64 procon_profile_start(void) {
+    return 0;
+}
+
+static inline void procon_profile_end(struct controller *c, enum procon_profile_section section, __u64 start) {
+}
+
+#endif
+
+#endif
@@ -0,0 +1,196 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/idr.h>
+#include <linux/workqueue.h>
+#include <linux/etherdevice.h>
+#include <linux/input.h>
+
+#include "procon-controller.h"
+#include "procon-input.h"
+#include "procon-slot.h"
+
+// A slot and input device kept for a controller that went away, in case it comes back.
+struct procon_parked {
+    struct list_head node;
+    __u8 mac[ETH_ALEN] __aligned(2);
+    __u32 product;
+    int controller_id;
+    struct input_dev *input;
+    struct delayed_work expire;
+};
+
+static unsigned int max_controllers = 8;
+module_param(max_controllers, uint, 0444);
+MODULE_PARM_DESC(max_controllers, "Maximum number of controllers connected at the same time.");
+
+static unsigned int grace_period_ms = 0;
+module_param(grace_period_ms, uint, 0644);
+MODULE_PARM_DESC(grace_period_ms, "Time a disconnected controller keeps its input device and slot, 0 to disable.");
+
+// Hands out the controller ids. Safe to use from concurrent probes.
+static DEFINE_IDA(controller_ids);
+
+static LIST_HEAD(procon_parked_list);
+static DEFINE_MUTEX(procon_parked_mutex);
+
+static void procon_parked_destroy(struct procon_parked *parked) {
+    if (parked->input != NULL) {
+        procon_input_destroy(parked->input);
+    }
+
+    ida_free(&controller_ids, parked->controller_id);
+    pr_info("Released slot controller%d after its grace period.\n", parked->controller_id);
+    kfree(parked);
+}
+
+static void procon_parked_expire(struct work_struct *work) {
+    struct procon_parked *parked = container_of(to_delayed_work(work), struct procon_parked, expire);
+    bool owned;
+
+    // A probe that claimed the slot in the meantime took it off the list.
+    mutex_lock(&procon_parked_mutex);
+    owned = !list_empty(&parked->node);
+    list_del_init(&parked->node);
+    mutex_unlock(&procon_parked_mutex);
+
+    if (owned) {
+        procon_parked_destroy(parked);
+    }
+}
+
+static struct procon_parked *procon_slot_claim(struct controller *c) {
+    struct procon_parked *parked;
+    struct procon_parked *found = NULL;
+    __u8 mac[ETH_ALEN] __aligned(2);
+
+    if (!mac_pton(c->handler->uniq, mac)) {
+        return NULL;
+    }
+
+    mutex_lock(&procon_parked_mutex);
+
+    list_for_each_entry(parked, &procon_parked_list, node) {
+        if (ether_addr_equal(parked->mac, mac) && parked->product == c->handler->product) {
+            found = parked;
+            list_del_init(&found->node);
+            break;
+        }
+    }
+
+    mutex_unlock(&procon_parked_mutex);
+
+    if (found != NULL) {
+        cancel_delayed_work_sync(&found->expire);
+    }
+
+    return found;
+}
+
+// Gives the controller an id. A controller that comes back within its grace period
+// gets its old id and input device back, the input device still has to be reattached.
+int procon_slot_alloc(struct controller *c) {
+    struct procon_parked *parked;
+    int controller_id;
+
+    parked = procon_slot_claim(c);
+    if (parked != NULL) {
+        c->controller_id = parked->controller_id;
+        c->input = parked->input;
+        kfree(parked);
+
+        pr_info("Controller %s is back as controller%d.\n", c->handler->uniq, c->controller_id);
+        return 0;
+    }
+
+    controller_id = ida_alloc_max(&controller_ids, max_controllers - 1, GFP_KERNEL);
+    if (controller_id < 0) {
+        pr_err("Driver does not support more than %u controllers!\n", max_controllers);
+        return controller_id;
+    }
+
+    c->controller_id = controller_id;
+    return 0;
+}
+
+// Gives up the id and input device right away.
+void procon_slot_free(struct controller *c) {
+    if (c->input != NULL) {
+        procon_input_destroy(procon_input_detach(c));
+    }
+
+    ida_free(&controller_ids, c->controller_id);
+}
+
+// Called once the controller is gone. Keeps the id and input device around
+// for the grace period, so a quick reconnect ends up on the same evdev node.
+void procon_slot_release(struct controller *c) {
+    struct procon_parked *parked;
+    unsigned int grace = READ_ONCE(grace_period_ms);
+
+    // A wired controller has no address in uniq, procon_slot_claim() could never find it again.
+    if (grace == 0 || c->input == NULL || c->handler->bus == BUS_USB) {
+        procon_slot_free(c);
+        return;
+    }
+
+    parked = kzalloc(sizeof(struct procon_parked), GFP_KERNEL);
+    if (parked == NULL) {
+        procon_slot_free(c);
+        return;
+    }
+
+    // The address from the device info, or the one the HID device was created with.
+    if (!is_zero_ether_addr(c->info.controller_mac_addr)) {
+        ether_addr_copy(parked->mac, c->info.controller_mac_addr);
+    } else if (!mac_pton(c->handler->uniq, parked->mac)) {
+        kfree(parked);
+        procon_slot_free(c);
+        return;
+    }
+
+    parked->product = c->handler->product;
+    parked->controller_id = c->controller_id;
+    parked->input = procon_input_detach(c);
+    INIT_DELAYED_WORK(&parked->expire, procon_parked_expire);
+
+    mutex_lock(&procon_parked_mutex);
+    list_add_tail(&parked->node, &procon_parked_list);
+    mutex_unlock(&procon_parked_mutex);
+
+    schedule_delayed_work(&parked->expire, msecs_to_jiffies(grace));
+}
+
+int procon_slot_init(void) {
+    if (max_controllers == 0) {
+        pr_crit("max_controllers has to be at least 1.\n");
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+void procon_slot_exit(void) {
+    struct procon_parked *parked;
+
+    // Nothing can probe anymore, release whatever is still waiting.
+    for (;;) {
+        mutex_lock(&procon_parked_mutex);
+        parked = list_first_entry_or_null(&procon_parked_list, struct procon_parked, node);
+        if (parked != NULL) {
+            list_del_init(&parked->node);
+        }
+        mutex_unlock(&procon_parked_mutex);
+
+        if (parked == NULL) {
+            break;
+        }
+
+        cancel_delayed_work_sync(&parked->expire);
+        procon_parked_destroy(parked);
+    }
+
+    ida_destroy(&controller_ids);
+}
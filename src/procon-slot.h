@@ -0,0 +1,16 @@
+#include "procon-controller.h"
+
+#ifndef __PROCON_SLOT_H__
+#define __PROCON_SLOT_H__
+
+int procon_slot_alloc(struct controller *c);
+
+void procon_slot_release(struct controller *c);
+
+void procon_slot_free(struct controller *c);
+
+int procon_slot_init(void);
+
+void procon_slot_exit(void);
+
+#endif
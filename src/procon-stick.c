@@ -0,0 +1,393 @@
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/seq_file.h>
+#include <linux/math64.h>
+
+#include "packet.h"
+#include "procon-controller.h"
+#include "procon-devices.h"
+#include "procon-stick.h"
+
+static const char *procon_stick_names[PROCON_STICK_ID_COUNT] = {"left", "right"};
+
+static const struct procon_stick_config procon_stick_default = {
+    .inner = 0,
+    .outer = 100,
+    .anti = 0,
+    .curve = PROCON_CURVE_LINEAR,
+};
+
+static __u32 procon_stick_percent(__u8 percent) {
+    return (__u32) percent * PROCON_STICK_MAX / 100;
+}
+
+// Shapes t, both in Q15.
+static __u32 procon_stick_curve(const struct procon_stick_config *config, __u32 t) {
+    __u32 shaped = t;
+
+    switch (config->curve) {
+    case PROCON_CURVE_POWER:
+        shaped = 1 << 15;
+        for (int i = 0; i < config->exponent; i++) {
+            shaped = (shaped * t) >> 15;
+        }
+        break;
+
+    case PROCON_CURVE_POINTS: {
+        // Straight lines between the points, with the corners implied.
+        __u32 x0 = 0, y0 = 0, x1 = 1 << 15, y1 = 1 << 15;
+
+        for (int i = 0; i < config->num_points; i++) {
+            __u32 x = ((__u32) config->points[i][0] << 15) / 100;
+            __u32 y = ((__u32) config->points[i][1] << 15) / 100;
+
+            if (x <= t) {
+                x0 = x;
+                y0 = y;
+            } else {
+                x1 = x;
+                y1 = y;
+                break;
+            }
+        }
+
+        if (x1 == x0) {
+            shaped = y1;
+        } else {
+            shaped = y0 + (__s32) ((__s64) ((__s32) y1 - (__s32) y0) * (__s32) (t - x0) / (__s32) (x1 - x0));
+        }
+        break;
+    }
+
+    case PROCON_CURVE_LINEAR:
+    default:
+        break;
+    }
+
+    return shaped;
+}
+
+static void procon_stick_compile(const struct procon_stick_config *config, struct procon_stick_lut *lut) {
+    __u32 inner = procon_stick_percent(config->inner);
+    __u32 outer = procon_stick_percent(config->outer);
+    __u32 anti = procon_stick_percent(config->anti);
+
+    lut->identity = config->inner == 0 && config->outer == 100 && config->anti == 0 && config->curve == PROCON_CURVE_LINEAR;
+
+    for (int i = 0; i < PROCON_STICK_LUT_SIZE; i++) {
+        __u32 r = min_t(__u32, i << PROCON_STICK_LUT_SHIFT, PROCON_STICK_MAX);
+        __u32 t;
+
+        if (r == 0 || r <= inner) {
+            lut->out[i] = 0;
+            continue;
+        }
+
+        if (r >= outer) {
+            lut->out[i] = PROCON_STICK_MAX;
+            continue;
+        }
+
+        t = ((r - inner) << 15) / (outer - inner);
+        lut->out[i] = anti + (((PROCON_STICK_MAX - anti) * procon_stick_curve(config, t)) >> 15);
+    }
+}
+
+// Scales the deflection of a stick along its direction, so the deadzones are round.
+static void procon_stick_apply(const struct procon_stick_lut *lut, __s16 *horizontal, __s16 *vertical) {
+    __s32 x = *horizontal;
+    __s32 y = *vertical;
+    __u32 r;
+    __u32 index;
+    __u32 frac;
+    __s32 out;
+
+    r = int_sqrt((__u32) (x * x) + (__u32) (y * y));
+    if (r == 0) {
+        return;
+    }
+
+    // Interpolate between the two nearest entries.
+    index = min_t(__u32, r, PROCON_STICK_MAX) >> PROCON_STICK_LUT_SHIFT;
+    frac = min_t(__u32, r, PROCON_STICK_MAX) & ((1 << PROCON_STICK_LUT_SHIFT) - 1);
+    out = lut->out[index] + ((((__s32) lut->out[index + 1] - lut->out[index]) * (__s32) frac) >> PROCON_STICK_LUT_SHIFT);
+
+    *horizontal = clamp(x * out / (__s32) r, -PROCON_STICK_MAX, PROCON_STICK_MAX);
+    *vertical = clamp(y * out / (__s32) r, -PROCON_STICK_MAX, PROCON_STICK_MAX);
+}
+
+// Exponential smoothing whose weight grows with the speed of the axis.
+// A resting stick gets the full smoothing, a fast one passes straight through.
+static __s16 procon_stick_filter_axis(struct procon_stick *stick, struct procon_axis_filter *f, __s16 in) {
+    const struct procon_stick_config *config = &stick->config;
+    struct procon_stick_filter_stats *stats = &stick->filter_stats;
+    __s32 alpha;
+    __s32 delta;
+    __s16 out;
+
+    if (!f->primed) {
+        f->primed = true;
+        f->value = in << 4;
+        f->speed = 0;
+        f->last_in = in;
+        f->last_out = in;
+        return in;
+    }
+
+    delta = abs(in - (f->value >> 4));
+    f->speed += (delta - f->speed) >> 2;
+
+    alpha = min_t(__s32, config->filter_alpha + ((f->speed * config->filter_beta) >> 8), 256);
+    f->value += ((((__s32) in << 4) - f->value) * alpha) >> 8;
+    out = f->value >> 4;
+
+    stats->samples++;
+    stats->changes_in += in != f->last_in;
+    stats->changes_out += out != f->last_out;
+    stats->delay_sum += ((256 - alpha) << 8) / alpha;
+
+    f->last_in = in;
+    f->last_out = out;
+    return out;
+}
+
+static void procon_stick_process_one(struct procon_stick *stick, __s16 *horizontal, __s16 *vertical) {
+    if (stick->config.filter_alpha > 0) {
+        *horizontal = procon_stick_filter_axis(stick, &stick->filter[0], *horizontal);
+        *vertical = procon_stick_filter_axis(stick, &stick->filter[1], *vertical);
+    }
+
+    if (!stick->lut.identity) {
+        procon_stick_apply(&stick->lut, horizontal, vertical);
+    }
+}
+
+void procon_stick_process(struct controller *c, struct input_response *resp) {
+    unsigned long flags;
+
+    spin_lock_irqsave(&c->stick_lock, flags);
+
+    if (c->desc->sticks & PROCON_STICK_LEFT) {
+        procon_stick_process_one(&c->sticks[PROCON_STICK_ID_LEFT], &resp->sticks[PROCON_AXIS_LX], &resp->sticks[PROCON_AXIS_LY]);
+    }
+
+    if (c->desc->sticks & PROCON_STICK_RIGHT) {
+        procon_stick_process_one(&c->sticks[PROCON_STICK_ID_RIGHT], &resp->sticks[PROCON_AXIS_RX], &resp->sticks[PROCON_AXIS_RY]);
+    }
+
+    spin_unlock_irqrestore(&c->stick_lock, flags);
+}
+
+void procon_stick_init(struct controller *c) {
+    spin_lock_init(&c->stick_lock);
+
+    for (int i = 0; i < PROCON_STICK_ID_COUNT; i++) {
+        c->sticks[i].config = procon_stick_default;
+        procon_stick_compile(&c->sticks[i].config, &c->sticks[i].lut);
+    }
+}
+
+static int procon_stick_parse_percent(const char *value, __u8 *percent) {
+    __u8 parsed;
+
+    if (kstrtou8(value, 10, &parsed) < 0 || parsed > 100) {
+        return -EINVAL;
+    }
+
+    *percent = parsed;
+    return 0;
+}
+
+// Parses "points:x,y;x,y;..." after the prefix.
+static int procon_stick_parse_points(char *value, struct procon_stick_config *config) {
+    char *point;
+    unsigned int x, y;
+    int last = -1;
+
+    config->num_points = 0;
+
+    while ((point = strsep(&value, ";")) != NULL) {
+        if (*point == '\0') {
+            continue;
+        }
+
+        if (config->num_points == PROCON_STICK_MAX_POINTS) {
+            return -E2BIG;
+        }
+
+        if (sscanf(point, "%u,%u", &x, &y) != 2 || x > 100 || y > 100 || (int) x <= last) {
+            return -EINVAL;
+        }
+
+        config->points[config->num_points][0] = x;
+        config->points[config->num_points][1] = y;
+        config->num_points++;
+        last = x;
+    }
+
+    return 0;
+}
+
+static int procon_stick_parse_curve(char *value, struct procon_stick_config *config) {
+    if (strcmp(value, "linear") == 0) {
+        config->curve = PROCON_CURVE_LINEAR;
+        return 0;
+    }
+
+    if (strncmp(value, "power:", 6) == 0) {
+        if (kstrtou8(value + 6, 10, &config->exponent) < 0 || config->exponent < 1 || config->exponent > 4) {
+            return -EINVAL;
+        }
+
+        config->curve = PROCON_CURVE_POWER;
+        return 0;
+    }
+
+    if (strncmp(value, "points:", 7) == 0) {
+        config->curve = PROCON_CURVE_POINTS;
+        return procon_stick_parse_points(value + 7, config);
+    }
+
+    return -EINVAL;
+}
+
+// Configures a stick from a line like "left inner=8 outer=95 anti=5 curve=power:2".
+// Settings that are left out keep their current value.
+int procon_stick_configure(struct controller *c, char *line) {
+    struct procon_stick_config config;
+    struct procon_stick_lut *lut;
+    unsigned long flags;
+    char *token;
+    int stick = -1;
+    int ret = 0;
+
+    token = strsep(&line, " ");
+    for (int i = 0; i < PROCON_STICK_ID_COUNT; i++) {
+        if (token != NULL && strcmp(token, procon_stick_names[i]) == 0) {
+            stick = i;
+        }
+    }
+
+    if (stick < 0) {
+        return -EINVAL;
+    }
+
+    spin_lock_irqsave(&c->stick_lock, flags);
+    config = c->sticks[stick].config;
+    spin_unlock_irqrestore(&c->stick_lock, flags);
+
+    while ((token = strsep(&line, " ")) != NULL) {
+        char *value = token;
+        char *key = strsep(&value, "=");
+
+        if (*key == '\0') {
+            continue;
+        }
+
+        if (value == NULL) {
+            return -EINVAL;
+        }
+
+        if (strcmp(key, "inner") == 0) {
+            ret = procon_stick_parse_percent(value, &config.inner);
+        } else if (strcmp(key, "outer") == 0) {
+            ret = procon_stick_parse_percent(value, &config.outer);
+        } else if (strcmp(key, "anti") == 0) {
+            ret = procon_stick_parse_percent(value, &config.anti);
+        } else if (strcmp(key, "filter_alpha") == 0) {
+            ret = kstrtou8(value, 10, &config.filter_alpha);
+        } else if (strcmp(key, "filter_beta") == 0) {
+            ret = kstrtou8(value, 10, &config.filter_beta);
+        } else if (strcmp(key, "curve") == 0) {
+            ret = procon_stick_parse_curve(value, &config);
+        } else {
+            ret = -EINVAL;
+        }
+
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (config.inner >= config.outer) {
+        return -EINVAL;
+    }
+
+    // Compile outside the lock, the event path only waits for the copy.
+    lut = kmalloc(sizeof(struct procon_stick_lut), GFP_KERNEL);
+    if (lut == NULL) {
+        return -ENOMEM;
+    }
+
+    procon_stick_compile(&config, lut);
+
+    spin_lock_irqsave(&c->stick_lock, flags);
+    c->sticks[stick].config = config;
+    c->sticks[stick].lut = *lut;
+    c->sticks[stick].filter[0].primed = false;
+    c->sticks[stick].filter[1].primed = false;
+    spin_unlock_irqrestore(&c->stick_lock, flags);
+
+    kfree(lut);
+    return 0;
+}
+
+void procon_stick_show(struct seq_file *m, struct controller *c) {
+    struct procon_stick_config config;
+    unsigned long flags;
+
+    for (int i = 0; i < PROCON_STICK_ID_COUNT; i++) {
+        spin_lock_irqsave(&c->stick_lock, flags);
+        config = c->sticks[i].config;
+        spin_unlock_irqrestore(&c->stick_lock, flags);
+
+        seq_printf(m, "%s inner=%u outer=%u anti=%u filter_alpha=%u filter_beta=%u curve=", procon_stick_names[i],
+            config.inner, config.outer, config.anti, config.filter_alpha, config.filter_beta);
+
+        switch (config.curve) {
+        case PROCON_CURVE_POWER:
+            seq_printf(m, "power:%u", config.exponent);
+            break;
+
+        case PROCON_CURVE_POINTS:
+            seq_puts(m, "points:");
+            for (int j = 0; j < config.num_points; j++) {
+                seq_printf(m, "%s%u,%u", j > 0 ? ";" : "", config.points[j][0], config.points[j][1]);
+            }
+            break;
+
+        case PROCON_CURVE_LINEAR:
+        default:
+            seq_puts(m, "linear");
+            break;
+        }
+
+        seq_putc(m, '\n');
+    }
+}
+
+// What the filter saved and what it cost. The delay is the mean group delay of the smoothing.
+int procon_stick_show_filter(struct seq_file *m, struct controller *c) {
+    struct procon_stick_filter_stats stats;
+    unsigned int rate = READ_ONCE(c->report_rate);
+    unsigned long flags;
+    __u64 delay;
+
+    for (int i = 0; i < PROCON_STICK_ID_COUNT; i++) {
+        spin_lock_irqsave(&c->stick_lock, flags);
+        stats = c->sticks[i].filter_stats;
+        spin_unlock_irqrestore(&c->stick_lock, flags);
+
+        delay = stats.samples > 0 ? div64_u64(stats.delay_sum, stats.samples) : 0;
+
+        seq_printf(m, "%s samples=%llu changes_in=%llu changes_out=%llu saved=%llu delay_reports=%llu.%02llu delay_us=%llu\n",
+            procon_stick_names[i], stats.samples, stats.changes_in, stats.changes_out,
+            stats.changes_in > stats.changes_out ? stats.changes_in - stats.changes_out : 0,
+            delay >> 8, ((delay & 0xFF) * 100) >> 8,
+            rate > 0 ? div64_u64(delay * 1000000, (__u64) rate << 8) : 0);
+    }
+
+    return 0;
+}
@@ -0,0 +1,85 @@
+#include <linux/types.h>
+#include <linux/seq_file.h>
+
+#include "packet.h"
+
+#ifndef __PROCON_STICK_H__
+#define __PROCON_STICK_H__
+
+// The stick shaping table has an entry every 1 << (15 - PROCON_STICK_LUT_BITS) counts of deflection.
+#define PROCON_STICK_LUT_BITS 8
+#define PROCON_STICK_LUT_SIZE ((1 << PROCON_STICK_LUT_BITS) + 1)
+#define PROCON_STICK_LUT_SHIFT (15 - PROCON_STICK_LUT_BITS)
+
+#define PROCON_STICK_MAX_POINTS 8
+
+enum procon_stick_id {
+    PROCON_STICK_ID_LEFT,
+    PROCON_STICK_ID_RIGHT,
+    PROCON_STICK_ID_COUNT,
+};
+
+enum procon_stick_curve {
+    PROCON_CURVE_LINEAR,
+    PROCON_CURVE_POWER,
+    PROCON_CURVE_POINTS,
+};
+
+// Shaping of a single stick. All values are percentages of full deflection.
+struct procon_stick_config {
+    __u8 inner; // Deflection below this reads as centred.
+    __u8 outer; // Deflection above this reads as full.
+    __u8 anti;  // Smallest deflection reported outside the inner deadzone.
+
+    // Smoothing, 0 is off. Alpha in 1/256 at rest, beta adds to it per count of speed.
+    __u8 filter_alpha;
+    __u8 filter_beta;
+
+    enum procon_stick_curve curve;
+    __u8 exponent;
+    __u8 num_points;
+    __u8 points[PROCON_STICK_MAX_POINTS][2]; // Input and output, ascending by input.
+};
+
+// The configuration compiled to output deflection by input deflection.
+struct procon_stick_lut {
+    bool identity;
+    __u16 out[PROCON_STICK_LUT_SIZE];
+};
+
+// Adaptive smoothing state of a single axis.
+struct procon_axis_filter {
+    bool primed;
+    __s32 value; // Filtered value with 4 extra bits.
+    __s32 speed; // Smoothed change per report.
+    __s16 last_in;
+    __s16 last_out;
+};
+
+struct procon_stick_filter_stats {
+    __u64 samples;
+    __u64 changes_in;
+    __u64 changes_out;
+    __u64 delay_sum; // Filter delay in 1/256 reports.
+};
+
+struct procon_stick {
+    struct procon_stick_config config;
+    struct procon_stick_lut lut;
+    struct procon_axis_filter filter[2];
+    struct procon_stick_filter_stats filter_stats;
+};
+
+struct controller;
+
+void procon_stick_init(struct controller *c);
+
+void procon_stick_process(struct controller *c, struct input_response *resp);
+
+int procon_stick_configure(struct controller *c, char *line);
+
+void procon_stick_show(struct seq_file *m, struct controller *c);
+
+int procon_stick_show_filter(struct seq_file *m, struct controller *c);
+
+#endif
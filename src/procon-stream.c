@@ -0,0 +1,326 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/input.h>
+
+#include "commands.h"
+#include "packet.h"
+#include "procon-controller.h"
+#include "procon-output.h"
+#include "procon-input.h"
+#include "procon-pair.h"
+#include "procon-mcu.h"
+#include "procon-stream.h"
+
+static unsigned int idle_timeout_ms = 30000;
+module_param(idle_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(idle_timeout_ms, "Time without input changes before a controller drops to low power, 0 to disable.");
+
+static unsigned int watchdog_ms = 1000;
+module_param(watchdog_ms, uint, 0644);
+MODULE_PARM_DESC(watchdog_ms, "Time without full reports before a streaming controller is resynchronised, 0 to disable.");
+
+// A controller that stays silent is resynchronised at most every 32 times watchdog_ms.
+#define PROCON_STREAM_MAX_BACKOFF 5
+
+// Queues the idle or watchdog work, unless the controller is going away. Must hold the stream lock.
+static void procon_stream_queue(struct controller *c, struct delayed_work *work, unsigned long delay) {
+    if (!c->stream_stopped) {
+        mod_delayed_work(system_wq, work, delay);
+    }
+}
+
+// Time until the watchdog checks again, doubled for every resync that did not help. Must hold the stream lock.
+static unsigned long procon_stream_watchdog_delay(struct controller *c) {
+    return msecs_to_jiffies(READ_ONCE(watchdog_ms)) << c->resync_backoff;
+}
+
+static void procon_stream_send(struct controller *c, __u8 subcommand, __u8 arg) {
+    struct packet p;
+    __u8 args[] = {arg};
+    int ret;
+
+    init_packet(&p, PROCON_CMD_COMMAND_AND_RUMBLE, subcommand, args, sizeof(args));
+    packet_add_rumble(&p);
+
+    // A controller that is going away closes its input device after leaving the scheduler.
+    ret = send_message(c, &p);
+    if (ret < 0 && ret != -ENODEV) {
+        pr_warn("Could not send subcommand %02x to controller%d: %d.\n", subcommand, c->controller_id, ret);
+    }
+}
+
+// Picks the report mode and power state the controller should be in and switches if needed.
+// Full reports are only worth it while someone has the input device open and the controller
+// is in use, otherwise the simple reports, which only come on a change, are enough.
+// While the MCU is on, its data only comes with the full reports, idle or not.
+// The same goes for the IMU samples gyro aim needs, turning the controller is not a change of input.
+void procon_stream_update(struct controller *c) {
+    unsigned long flags;
+    __u8 mode;
+    bool mode_changed;
+    bool lpm;
+    bool lpm_changed;
+    bool mcu;
+    bool gyro;
+
+    spin_lock_irqsave(&c->stream_lock, flags);
+
+    mcu = READ_ONCE(c->mcu.mode) != PROCON_MCU_OFF;
+    gyro = READ_ONCE(c->gyro.enabled);
+
+    if (mcu) {
+        mode = PROCON_REPORT_MCU;
+    } else {
+        mode = gyro || (c->input_open && !c->idle) ? PROCON_REPORT_FULL : PROCON_REPORT_SIMPLE;
+    }
+    mode_changed = mode != c->report_mode;
+    c->report_mode = mode;
+
+    // Give the controller time to switch before the watchdog expects full reports.
+    if (mode_changed && mode != PROCON_REPORT_SIMPLE) {
+        c->last_full_report = jiffies;
+
+        if (READ_ONCE(watchdog_ms) > 0) {
+            procon_stream_queue(c, &c->watchdog_work, procon_stream_watchdog_delay(c));
+        }
+    }
+
+    // Low power mode that was turned on by hand is left alone.
+    lpm = c->idle && !mcu && !gyro && !READ_ONCE(c->info.low_power_mode);
+    lpm_changed = lpm != c->idle_lpm;
+    c->idle_lpm = lpm;
+
+    spin_unlock_irqrestore(&c->stream_lock, flags);
+
+    // Waking up, the report rate goes first. Going idle, the power state goes last.
+    if (mode_changed) {
+        procon_stream_send(c, PROCON_SUB_SET_REPORT_MODE, mode);
+    }
+
+    if (lpm_changed) {
+        procon_stream_send(c, PROCON_SUB_SET_POWER_STATE, lpm ? 0x1 : 0x0);
+    }
+}
+
+static void procon_stream_arm_idle(struct controller *c) {
+    unsigned int timeout_ms = READ_ONCE(idle_timeout_ms);
+    unsigned long flags;
+
+    if (timeout_ms > 0) {
+        spin_lock_irqsave(&c->stream_lock, flags);
+        procon_stream_queue(c, &c->idle_work, msecs_to_jiffies(timeout_ms));
+        spin_unlock_irqrestore(&c->stream_lock, flags);
+    }
+}
+
+static void procon_stream_idle_work(struct work_struct *work) {
+    struct controller *c = container_of(to_delayed_work(work), struct controller, idle_work);
+    unsigned int timeout_ms = READ_ONCE(idle_timeout_ms);
+    unsigned long timeout;
+    unsigned long elapsed;
+    unsigned long flags;
+
+    if (timeout_ms == 0) {
+        return;
+    }
+
+    timeout = msecs_to_jiffies(timeout_ms);
+
+    spin_lock_irqsave(&c->stream_lock, flags);
+
+    if (!c->input_open || c->idle) {
+        spin_unlock_irqrestore(&c->stream_lock, flags);
+        return;
+    }
+
+    // The event path only records the time of a change, so check again when it is not old enough.
+    elapsed = jiffies - c->last_change;
+    if (elapsed < timeout) {
+        procon_stream_queue(c, &c->idle_work, timeout - elapsed);
+        spin_unlock_irqrestore(&c->stream_lock, flags);
+        return;
+    }
+
+    c->idle = true;
+
+    spin_unlock_irqrestore(&c->stream_lock, flags);
+
+    pr_info("controller%d is idle, entering low power.\n", c->controller_id);
+    procon_stream_update(c);
+}
+
+// Simple and full reports decode to the same state, so a simple report of an idle
+// controller is compared to the last full one.
+static bool procon_stream_state_changed(struct controller *c, const struct input_response *resp) {
+    if (resp->buttons != c->idle_buttons) {
+        return true;
+    }
+
+    // Stick noise is not a change.
+    for (int i = 0; i < PROCON_AXIS_COUNT; i++) {
+        if (abs(resp->sticks[i] - c->idle_sticks[i]) > PROCON_STICK_FUZZ) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Releases anything held, the last state should not stay frozen while the controller is silent.
+static void procon_stream_release(struct controller *c) {
+    struct input_response neutral = {
+        .report_id = PROCON_REPORT_FULL,
+    };
+
+    if (c->merged) {
+        procon_pair_report(c, &neutral);
+    } else {
+        procon_input_report(c, &neutral);
+    }
+}
+
+// Checks that a controller that should be streaming full reports still is.
+// A controller that went silent or fell back to simple reports only gets the
+// handshake and the report mode again, not a whole new probe.
+static void procon_stream_watchdog(struct work_struct *work) {
+    struct controller *c = container_of(to_delayed_work(work), struct controller, watchdog_work);
+    unsigned int timeout_ms = READ_ONCE(watchdog_ms);
+    __u8 handshake[] = {0x80, 0x02};
+    unsigned long timeout;
+    unsigned long flags;
+    __u8 mode;
+
+    // Restarted by the next switch to full reports.
+    mode = READ_ONCE(c->report_mode);
+    if (timeout_ms == 0 || (mode != PROCON_REPORT_FULL && mode != PROCON_REPORT_MCU)) {
+        return;
+    }
+
+    timeout = msecs_to_jiffies(timeout_ms);
+
+    // Streaming, any earlier resync did its job.
+    if (time_before(jiffies, READ_ONCE(c->last_full_report) + timeout)) {
+        spin_lock_irqsave(&c->stream_lock, flags);
+        c->resync_backoff = 0;
+        procon_stream_queue(c, &c->watchdog_work, READ_ONCE(c->last_full_report) + timeout - jiffies);
+        spin_unlock_irqrestore(&c->stream_lock, flags);
+        return;
+    }
+
+    pr_warn_ratelimited("controller%d stopped streaming, resynchronising.\n", c->controller_id);
+    c->resyncs++;
+
+    procon_stream_release(c);
+
+    mutex_lock(&c->lock);
+    send_message_raw(c->handler, handshake, sizeof(handshake));
+    mutex_unlock(&c->lock);
+
+    // Forget the mode, so it gets sent again. Until full reports come back, every next try waits longer.
+    spin_lock_irqsave(&c->stream_lock, flags);
+    c->report_mode = 0;
+    if (c->resync_backoff < PROCON_STREAM_MAX_BACKOFF) {
+        c->resync_backoff++;
+    }
+    spin_unlock_irqrestore(&c->stream_lock, flags);
+
+    procon_stream_update(c);
+}
+
+// Watches the decoded input for changes. Called from the event path.
+void procon_stream_input(struct controller *c, const struct input_response *resp) {
+    unsigned long flags;
+    bool wake = false;
+
+    if (resp->report_id != 0x30 && resp->report_id != 0x31 && resp->report_id != 0x21 && resp->report_id != PROCON_REPORT_SIMPLE) {
+        return;
+    }
+
+    // Simple reports while full ones were asked for do not count, the watchdog catches those.
+    if (resp->report_id != PROCON_REPORT_SIMPLE) {
+        WRITE_ONCE(c->last_full_report, jiffies);
+    }
+
+    spin_lock_irqsave(&c->stream_lock, flags);
+
+    if (!procon_stream_state_changed(c, resp)) {
+        spin_unlock_irqrestore(&c->stream_lock, flags);
+        return;
+    }
+
+    c->idle_buttons = resp->buttons;
+    memcpy(c->idle_sticks, resp->sticks, sizeof(c->idle_sticks));
+    c->last_change = jiffies;
+
+    if (c->idle) {
+        c->idle = false;
+        wake = true;
+    }
+
+    spin_unlock_irqrestore(&c->stream_lock, flags);
+
+    if (wake) {
+        procon_stream_update(c);
+        procon_stream_arm_idle(c);
+    }
+}
+
+void procon_stream_set_open(struct controller *c, bool open) {
+    unsigned long flags;
+
+    spin_lock_irqsave(&c->stream_lock, flags);
+    WRITE_ONCE(c->input_open, open);
+    c->idle = false;
+    c->last_change = jiffies;
+    spin_unlock_irqrestore(&c->stream_lock, flags);
+
+    // This can be called under the pair lock, so the idle work is not waited for.
+    if (open) {
+        procon_stream_arm_idle(c);
+    } else {
+        cancel_delayed_work(&c->idle_work);
+    }
+
+    procon_stream_update(c);
+}
+
+// While a controller is away for its grace period, its input device has no controller.
+int procon_stream_input_open(struct input_dev *input) {
+    struct controller *c = input_get_drvdata(input);
+
+    if (c != NULL) {
+        procon_stream_set_open(c, true);
+    }
+
+    return 0;
+}
+
+void procon_stream_input_close(struct input_dev *input) {
+    struct controller *c = input_get_drvdata(input);
+
+    if (c != NULL) {
+        procon_stream_set_open(c, false);
+    }
+}
+
+void procon_stream_init(struct controller *c) {
+    spin_lock_init(&c->stream_lock);
+    INIT_DELAYED_WORK(&c->idle_work, procon_stream_idle_work);
+    INIT_DELAYED_WORK(&c->watchdog_work, procon_stream_watchdog);
+    c->last_change = jiffies;
+}
+
+// Called before the device stops, reports can still come in but nothing gets queued anymore.
+void procon_stream_stop(struct controller *c) {
+    unsigned long flags;
+
+    spin_lock_irqsave(&c->stream_lock, flags);
+    c->stream_stopped = true;
+    spin_unlock_irqrestore(&c->stream_lock, flags);
+
+    cancel_delayed_work_sync(&c->idle_work);
+    cancel_delayed_work_sync(&c->watchdog_work);
+}
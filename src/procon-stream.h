@@ -0,0 +1,26 @@
+#include <linux/input.h>
+
+#include "procon-controller.h"
+
+#ifndef __PROCON_STREAM_H__
+#define __PROCON_STREAM_H__
+
+// Input report modes.
+#define PROCON_REPORT_FULL 0x30
+#define PROCON_REPORT_SIMPLE 0x3F
+
+void procon_stream_update(struct controller *c);
+
+void procon_stream_input(struct controller *c, const struct input_response *resp);
+
+void procon_stream_set_open(struct controller *c, bool open);
+
+int procon_stream_input_open(struct input_dev *input);
+
+void procon_stream_input_close(struct input_dev *input);
+
+void procon_stream_init(struct controller *c);
+
+void procon_stream_stop(struct controller *c);
+
+#endif
@@ -0,0 +1,398 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/input.h>
+
+#include "hids.h"
+#include "packet.h"
+#include "procon-compat.h"
+#include "procon-controller.h"
+#include "procon-devices.h"
+#include "procon-input.h"
+#include "procon-keymap.h"
+#include "procon-stick.h"
+#include "procon-virtual.h"
+
+// Length of a full report up to the end of the IMU data, all decode_message() looks at.
+#define PROCON_VIRTUAL_REPORT_LENGTH (PROCON_IMU_OFFSET + 12 * PROCON_IMU_SAMPLES)
+
+// Reports for a sweep of a stick from one end to the other and back.
+#define PROCON_VIRTUAL_SWEEP_TICKS 256
+
+static const char *procon_virtual_pattern_names[] = {
+    [PROCON_VIRTUAL_STILL] = "still",
+    [PROCON_VIRTUAL_SWEEP] = "sweep",
+    [PROCON_VIRTUAL_BUTTONS] = "buttons",
+    [PROCON_VIRTUAL_RANDOM] = "random",
+};
+
+// The virtual controllers, all started and stopped together under the mutex.
+static DEFINE_MUTEX(procon_virtual_mutex);
+static struct procon_virtual **procon_virtuals = NULL;
+static unsigned int procon_virtual_count = 0;
+static unsigned int procon_virtual_rate = 120;
+static enum procon_virtual_pattern procon_virtual_pattern = PROCON_VIRTUAL_SWEEP;
+static ktime_t procon_virtual_started;
+
+static __u32 procon_virtual_random(struct procon_virtual *v) {
+    // xorshift32, plenty for making up input.
+    v->seed ^= v->seed << 13;
+    v->seed ^= v->seed >> 17;
+    v->seed ^= v->seed << 5;
+    return v->seed;
+}
+
+// A raw 12 bit stick value from a position between 0 and 255.
+static __u16 procon_virtual_stick(__u32 position) {
+    return CALIBRATION_DEFAULT_MIN + position * (CALIBRATION_DEFAULT_MAX - CALIBRATION_DEFAULT_MIN) / 255;
+}
+
+static __u32 procon_virtual_sweep(__u32 tick) {
+    __u32 t = tick % PROCON_VIRTUAL_SWEEP_TICKS;
+
+    return t < PROCON_VIRTUAL_SWEEP_TICKS / 2 ? 2 * t : 2 * (PROCON_VIRTUAL_SWEEP_TICKS - 1 - t);
+}
+
+static void procon_virtual_encode_stick(__u8 *data, __u16 horizontal, __u16 vertical) {
+    data[0] = horizontal & 0xFF;
+    data[1] = ((horizontal >> 8) & 0xF) | ((vertical & 0xF) << 4);
+    data[2] = vertical >> 4;
+}
+
+// Makes up the next full report, as the controller would send it.
+static void procon_virtual_generate(struct procon_virtual *v, __u8 *report) {
+    __u16 sticks[PROCON_AXIS_COUNT];
+    __u32 buttons = 0;
+    __u32 tick = v->tick++;
+
+    for (int i = 0; i < PROCON_AXIS_COUNT; i++) {
+        sticks[i] = CALIBRATION_DEFAULT_CENTER;
+    }
+
+    switch (v->pattern) {
+    case PROCON_VIRTUAL_SWEEP:
+        // Y a quarter behind X, so the sticks go around rather than along a line.
+        sticks[PROCON_AXIS_LX] = procon_virtual_stick(procon_virtual_sweep(tick));
+        sticks[PROCON_AXIS_LY] = procon_virtual_stick(procon_virtual_sweep(tick + PROCON_VIRTUAL_SWEEP_TICKS / 4));
+        sticks[PROCON_AXIS_RX] = sticks[PROCON_AXIS_LY];
+        sticks[PROCON_AXIS_RY] = sticks[PROCON_AXIS_LX];
+
+        if (tick % 64 < 8) {
+            buttons = BIT(PROCON_BTN_A);
+        }
+        break;
+
+    case PROCON_VIRTUAL_BUTTONS:
+        buttons = BIT(tick % PROCON_BTN_COUNT);
+        break;
+
+    case PROCON_VIRTUAL_RANDOM:
+        buttons = procon_virtual_random(v);
+        for (int i = 0; i < PROCON_AXIS_COUNT; i++) {
+            sticks[i] = procon_virtual_stick(procon_virtual_random(v) & 0xFF);
+        }
+        break;
+
+    case PROCON_VIRTUAL_STILL:
+    default:
+        break;
+    }
+
+    buttons &= v->c.desc->button_mask;
+
+    memset(report, 0, PROCON_VIRTUAL_REPORT_LENGTH);
+    report[0] = 0x30;
+    report[1] = tick & 0xFF;
+    report[2] = 0x8E; // Full battery, charging, powered.
+    report[3] = buttons & 0xFF;
+    report[4] = (buttons >> 8) & 0xFF;
+    report[5] = (buttons >> 16) & 0xFF;
+    procon_virtual_encode_stick(report + 6, sticks[PROCON_AXIS_LX], sticks[PROCON_AXIS_LY]);
+    procon_virtual_encode_stick(report + 9, sticks[PROCON_AXIS_RX], sticks[PROCON_AXIS_RY]);
+}
+
+static enum hrtimer_restart procon_virtual_timer_fired(struct hrtimer *timer) {
+    struct procon_virtual *v = container_of(timer, struct procon_virtual, timer);
+    __u8 report[PROCON_VIRTUAL_REPORT_LENGTH];
+    struct input_response resp;
+    ktime_t now = ktime_get();
+    __u64 late = ktime_to_ns(ktime_sub(now, hrtimer_get_expires(timer)));
+    __u64 overruns;
+
+    v->late_ns_total += late;
+    v->late_ns_max = max(v->late_ns_max, late);
+
+    // The same steps procon_event() takes for a full report.
+    procon_virtual_generate(v, report);
+    v->generated++;
+
+    if (decode_message(&resp, report, sizeof(report), v->c.desc, &v->c.calibration)) {
+        v->decode_errors++;
+    } else {
+        procon_stick_process(&v->c, &resp);
+        procon_input_report(&v->c, &resp);
+    }
+
+    // Ticks that passed while this one was late are not made up for.
+    overruns = hrtimer_forward(timer, now, v->period);
+    if (overruns > 1) {
+        v->missed += overruns - 1;
+    }
+
+    return HRTIMER_RESTART;
+}
+
+static struct procon_virtual *procon_virtual_create(int id, unsigned int rate, enum procon_virtual_pattern pattern) {
+    struct procon_virtual *v;
+    struct controller *c;
+    struct input_dev *input;
+    int ret;
+
+    v = kzalloc(sizeof(struct procon_virtual), GFP_KERNEL);
+    if (v == NULL) {
+        return ERR_PTR(-ENOMEM);
+    }
+
+    c = &v->c;
+    c->desc = &procon_desc_procon;
+    c->controller_id = id;
+    procon_calibration_default(&c->calibration);
+    procon_input_init(c);
+    procon_stick_init(c);
+    procon_keymap_init(c);
+
+    input = input_allocate_device();
+    if (input == NULL) {
+        ret = -ENOMEM;
+        goto err_free;
+    }
+
+    input->name = kasprintf(GFP_KERNEL, "%s [virtual %d]", c->desc->name, id);
+    if (input->name == NULL) {
+        input_free_device(input);
+        ret = -ENOMEM;
+        goto err_free;
+    }
+
+    input->id.bustype = BUS_VIRTUAL;
+    input->id.vendor = VENDOR_NINTENDO;
+    input->id.product = DEVICE_PROCON;
+    procon_input_set_capabilities(input, c->desc);
+
+    ret = input_register_device(input);
+    if (ret < 0) {
+        kfree(input->name);
+        input_free_device(input);
+        goto err_free;
+    }
+
+    c->input = input;
+    v->period = ns_to_ktime(NSEC_PER_SEC / rate);
+    v->pattern = pattern;
+    v->seed = (id + 1) * 2654435761U;
+    hrtimer_setup(&v->timer, procon_virtual_timer_fired, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+
+    return v;
+
+err_free:
+    kfree(v);
+    return ERR_PTR(ret);
+}
+
+static void procon_virtual_destroy(struct procon_virtual *v) {
+    struct input_dev *input;
+    unsigned long flags;
+
+    hrtimer_cancel(&v->timer);
+    procon_input_stop(&v->c);
+
+    spin_lock_irqsave(&v->c.input_lock, flags);
+    input = v->c.input;
+    v->c.input = NULL;
+    spin_unlock_irqrestore(&v->c.input_lock, flags);
+
+    procon_input_destroy(input);
+    kfree(v);
+}
+
+// Must hold the mutex.
+static void procon_virtual_stop_all(void) {
+    for (unsigned int i = 0; i < procon_virtual_count; i++) {
+        procon_virtual_destroy(procon_virtuals[i]);
+    }
+
+    kfree(procon_virtuals);
+    procon_virtuals = NULL;
+    procon_virtual_count = 0;
+}
+
+// Must hold the mutex. The timers are spread over one period, like independent controllers.
+static int procon_virtual_start_all(unsigned int count, unsigned int rate, enum procon_virtual_pattern pattern) {
+    struct procon_virtual **virtuals;
+    __u64 period = NSEC_PER_SEC / rate;
+    ktime_t now;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    virtuals = kcalloc(count, sizeof(struct procon_virtual *), GFP_KERNEL);
+    if (virtuals == NULL) {
+        return -ENOMEM;
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+        virtuals[i] = procon_virtual_create(i, rate, pattern);
+        if (IS_ERR(virtuals[i])) {
+            int ret = PTR_ERR(virtuals[i]);
+
+            while (i-- > 0) {
+                procon_virtual_destroy(virtuals[i]);
+            }
+            kfree(virtuals);
+            return ret;
+        }
+    }
+
+    procon_virtuals = virtuals;
+    procon_virtual_count = count;
+    procon_virtual_started = ktime_get();
+
+    now = procon_virtual_started;
+    for (unsigned int i = 0; i < count; i++) {
+        hrtimer_start(&virtuals[i]->timer, ktime_add_ns(now, div_u64(period * i, count)), HRTIMER_MODE_ABS);
+    }
+
+    return 0;
+}
+
+// Takes "count=N rate=HZ pattern=NAME", or "stop". Whatever is left out stays as it was.
+// Every write starts all virtual controllers over, with fresh statistics.
+int procon_virtual_configure(char *config) {
+    unsigned int count;
+    unsigned int rate = procon_virtual_rate;
+    enum procon_virtual_pattern pattern = procon_virtual_pattern;
+    char *token;
+    int ret = 0;
+
+    mutex_lock(&procon_virtual_mutex);
+    count = procon_virtual_count;
+
+    while ((token = strsep(&config, " \t\n")) != NULL) {
+        char *value = token;
+        char *key = strsep(&value, "=");
+
+        if (*key == '\0') {
+            continue;
+        }
+
+        if (strcmp(key, "stop") == 0 && value == NULL) {
+            count = 0;
+            continue;
+        }
+
+        if (value == NULL) {
+            ret = -EINVAL;
+        } else if (strcmp(key, "count") == 0) {
+            ret = kstrtouint(value, 10, &count);
+        } else if (strcmp(key, "rate") == 0) {
+            ret = kstrtouint(value, 10, &rate);
+        } else if (strcmp(key, "pattern") == 0) {
+            ret = match_string(procon_virtual_pattern_names, ARRAY_SIZE(procon_virtual_pattern_names), value);
+            if (ret >= 0) {
+                pattern = ret;
+                ret = 0;
+            }
+        } else {
+            ret = -EINVAL;
+        }
+
+        if (ret < 0) {
+            goto unlock;
+        }
+    }
+
+    if (count > PROCON_VIRTUAL_MAX || rate == 0 || rate > PROCON_VIRTUAL_MAX_RATE) {
+        ret = -EINVAL;
+        goto unlock;
+    }
+
+    procon_virtual_stop_all();
+
+    procon_virtual_rate = rate;
+    procon_virtual_pattern = pattern;
+    ret = procon_virtual_start_all(count, rate, pattern);
+
+unlock:
+    mutex_unlock(&procon_virtual_mutex);
+    return ret;
+}
+
+// Per controller and in total: reports made, the rate they were delivered at and what got lost.
+// Delivered is what went out through input_sync(). Reports merged by max_sync_rate never got a
+// sync of their own and count as dropped, missed ticks never made it out of the timer.
+int procon_virtual_show(struct seq_file *m) {
+    __u64 elapsed;
+    __u64 generated = 0;
+    __u64 delivered = 0;
+    __u64 errors = 0;
+    __u64 missed = 0;
+    __u64 dropped = 0;
+    __u64 late_total = 0;
+    __u64 late_max = 0;
+
+    mutex_lock(&procon_virtual_mutex);
+
+    seq_printf(m, "count=%u rate=%u pattern=%s\n", procon_virtual_count, procon_virtual_rate,
+        procon_virtual_pattern_names[procon_virtual_pattern]);
+
+    if (procon_virtual_count == 0) {
+        goto unlock;
+    }
+
+    elapsed = max_t(__u64, ktime_to_ns(ktime_sub(ktime_get(), procon_virtual_started)), 1);
+
+    seq_puts(m, "\nid generated delivered delivered_hz decode_errors missed dropped late_avg_ns late_max_ns\n");
+
+    for (unsigned int i = 0; i < procon_virtual_count; i++) {
+        struct procon_virtual *v = procon_virtuals[i];
+        __u64 syncs = READ_ONCE(v->c.syncs);
+        __u64 pending = READ_ONCE(v->c.sync_pending); // Waiting for the sync timer, not lost yet.
+        __u64 decoded = v->generated - v->decode_errors;
+        __u64 lost = decoded > syncs + pending ? decoded - syncs - pending : 0;
+
+        seq_printf(m, "virtual%u %llu %llu %llu %llu %llu %llu %llu %llu\n", i, v->generated, syncs,
+            div64_u64(syncs * NSEC_PER_SEC, elapsed), v->decode_errors, v->missed, lost,
+            v->generated > 0 ? div64_u64(v->late_ns_total, v->generated) : 0, v->late_ns_max);
+
+        generated += v->generated;
+        delivered += syncs;
+        errors += v->decode_errors;
+        missed += v->missed;
+        dropped += lost;
+        late_total += v->late_ns_total;
+        late_max = max(late_max, v->late_ns_max);
+    }
+
+    seq_printf(m, "total %llu %llu %llu %llu %llu %llu %llu %llu\n", generated, delivered,
+        div64_u64(delivered * NSEC_PER_SEC, elapsed), errors, missed, dropped,
+        generated > 0 ? div64_u64(late_total, generated) : 0, late_max);
+
+    seq_printf(m, "\nelapsed_ms %llu\nexpected_hz %llu\n", div_u64(elapsed, NSEC_PER_MSEC),
+        (__u64) procon_virtual_count * procon_virtual_rate);
+
+unlock:
+    mutex_unlock(&procon_virtual_mutex);
+    return 0;
+}
+
+void procon_virtual_exit(void) {
+    mutex_lock(&procon_virtual_mutex);
+    procon_virtual_stop_all();
+    mutex_unlock(&procon_virtual_mutex);
+}
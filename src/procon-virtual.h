@@ -0,0 +1,45 @@
+#include <linux/types.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/seq_file.h>
+
+#include "procon-controller.h"
+
+#ifndef __PROCON_VIRTUAL_H__
+#define __PROCON_VIRTUAL_H__
+
+#define PROCON_VIRTUAL_MAX 256
+#define PROCON_VIRTUAL_MAX_RATE 2000
+
+enum procon_virtual_pattern {
+    PROCON_VIRTUAL_STILL,   // Nothing moves, every report is the same.
+    PROCON_VIRTUAL_SWEEP,   // Both sticks sweep their whole range, a button is held now and then.
+    PROCON_VIRTUAL_BUTTONS, // A different button changes every report.
+    PROCON_VIRTUAL_RANDOM,  // Everything changes every report.
+};
+
+// A controller without hardware, for load testing. Generated 0x30 reports take the same path
+// from decode_message() to input_sync() as real ones, only the output side is left out.
+struct procon_virtual {
+    struct controller c; // Only what the input path needs is set up.
+    struct hrtimer timer;
+    ktime_t period;
+    enum procon_virtual_pattern pattern;
+    __u32 tick;
+    __u32 seed;
+
+    // Statistics, updated from the timer without a lock.
+    __u64 generated;
+    __u64 decode_errors;
+    __u64 missed; // Timer ticks that came too late to be run.
+    __u64 late_ns_total;
+    __u64 late_ns_max;
+};
+
+int procon_virtual_configure(char *config);
+
+int procon_virtual_show(struct seq_file *m);
+
+void procon_virtual_exit(void);
+
+#endif
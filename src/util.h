@@ -1,9 +0,0 @@
-#include <linux/types.h>
-#include <linux/string.h>
-
-#ifndef __PROCON_UTIL_H__
-#define __PROCON_UTIL_H__
-
-char *format_mac_addr(const __u8 *mac_data);
-
-#endif
\ No newline at end of file
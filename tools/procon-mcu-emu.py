@@ -0,0 +1,319 @@
+#!/usr/bin/env python3
+# Connects a virtual Pro Controller through uhid that has an MCU, turns it on through the mcu
+# proc file of the controller, and checks what comes out of mcu_frames for the reports it sends.
+#
+# Needs root, the hid-procon module loaded and hid_nintendo unloaded so it does not take the
+# controller. The controller answers the 0x22 and 0x21 subcommands that set up the MCU and streams
+# 0x31 reports, with the full 313 bytes of MCU data, as long as the driver asked for them.
+#
+# In IR mode it sends whole images, images with fragments missing, an image restarted halfway,
+# and fragments past the end of the image. Every fragment the driver takes has to be acked with
+# a 0x11 report, only the latest ack is kept so some may be skipped, but never the last one.
+# In NFC mode it sends tag state and tag data, which each make a frame of their own.
+#
+# Each frame in the ring is checked for its slot, sequence, type, length, complete flag and
+# data, and the ring header for its head.
+
+import argparse
+import glob
+import mmap
+import os
+import queue
+import re
+import struct
+import sys
+import threading
+import time
+
+from procon_uhid import VirtualProCon, format_mac
+
+REPORT_MCU_LENGTH = 362
+MCU_DATA_LENGTH = 313
+
+MCU_REPORT_EMPTY = 0xFF
+MCU_REPORT_IR_IMAGE = 0x03
+MCU_REPORT_NFC_STATE = 0x2A
+MCU_REPORT_NFC_READ = 0x3A
+
+FRAGMENT_LENGTH = 300
+
+# The 0x21 configuration byte for each mode.
+MCU_MODE_NFC = 0x04
+MCU_MODE_IR = 0x05
+
+# struct procon_mcu_ring_header and struct procon_mcu_frame.
+RING_HEADER = struct.Struct("<IIIIII")
+RING_VERSION = 1
+FRAME_HEADER = struct.Struct("<IIBB2x")
+
+
+class McuProCon(VirtualProCon):
+    def __init__(self, index, mac):
+        super().__init__(index, mac, name="procon-mcu-emu")
+        self.mcu_state = None
+        self.mcu_mode = None
+        self.acks = []
+        self.reports = queue.Queue()
+        self.streamer = threading.Thread(target=self.stream, daemon=True)
+
+    def handle_subcommand(self, subcommand, args):
+        if subcommand == 0x22:
+            self.mcu_state = args[0]
+            self.reply(0x80, subcommand, b"")
+            return True
+
+        if subcommand == 0x21:
+            # The MCU reports its firmware and the state it went to.
+            self.mcu_mode = args[2]
+            self.reply(0xA0, subcommand, bytes([0x01, 0x00, 0xFF, 0x00, 0x08, 0x00, 0x1B, args[2]]))
+            return True
+
+        return False
+
+    # Fragment acks, the fragment is the third argument of the 0x03 request.
+    def handle_mcu(self, data):
+        if data[10] == MCU_REPORT_IR_IMAGE:
+            self.acks.append(data[13])
+
+    # A full report every 15 ms while the driver wants them, with the next queued MCU data or
+    # nothing. The controller keeps streaming whether there is anything to say or not.
+    def stream(self):
+        while not self.stop.is_set():
+            time.sleep(0.015)
+            if self.report_mode != 0x31:
+                continue
+
+            try:
+                mcu = self.reports.get_nowait()
+            except queue.Empty:
+                mcu = bytes([MCU_REPORT_EMPTY])
+
+            self.send_input(self.input_header(0x31) + bytes(36) + mcu.ljust(MCU_DATA_LENGTH, b"\0"), REPORT_MCU_LENGTH)
+
+    def drain(self, timeout):
+        deadline = time.monotonic() + timeout + self.reports.qsize() * 0.015
+        while not self.reports.empty() and time.monotonic() < deadline:
+            time.sleep(0.01)
+
+        # Give the last report and its ack time to go through.
+        time.sleep(0.2)
+
+
+def fragment_data(image, fragment):
+    return bytes((image * 37 + fragment * 11 + i) & 0xFF for i in range(FRAGMENT_LENGTH))
+
+
+def ir_report(image, fragment):
+    return bytes([MCU_REPORT_IR_IMAGE, 0x00, 0x00, fragment, 0, 0, 0, 0, 0, 0]) + fragment_data(image, fragment)
+
+
+def nfc_report(kind, tag):
+    return bytes([kind, 0x00, 0x05, 0x00, 0x00, 0x09, 0x31, tag]) + bytes((tag + i) & 0xFF for i in range(200))
+
+
+def ir_image(image, fragments, received):
+    data = b"".join(fragment_data(image, f) if f in received else bytes(FRAGMENT_LENGTH) for f in range(fragments))
+    return (MCU_REPORT_IR_IMAGE, len(data), int(len(received) == fragments), data)
+
+
+class Ring:
+    def __init__(self, path):
+        self.fd = os.open(path, os.O_RDWR)
+        header = mmap.mmap(self.fd, mmap.PAGESIZE)
+        version, self.slot_count, self.slot_size, self.data_offset, _, _ = RING_HEADER.unpack_from(header)
+        header.close()
+
+        if version != RING_VERSION:
+            raise RuntimeError("ring version %d, expected %d" % (version, RING_VERSION))
+
+        size = self.data_offset + self.slot_count * self.slot_size
+        self.mem = mmap.mmap(self.fd, -(-size // mmap.PAGESIZE) * mmap.PAGESIZE)
+
+    def head(self):
+        return RING_HEADER.unpack_from(self.mem)[4]
+
+    def set_tail(self, tail):
+        struct.pack_into("<I", self.mem, 5 * 4, tail)
+
+    def frame(self, number):
+        offset = self.data_offset + (number % self.slot_count) * self.slot_size
+        sequence, length, kind, complete = FRAME_HEADER.unpack_from(self.mem, offset)
+        start = offset + FRAME_HEADER.size
+        return sequence, length, kind, complete, bytes(self.mem[start:start + length])
+
+    def close(self):
+        self.mem.close()
+        os.close(self.fd)
+
+
+class Checker:
+    def __init__(self, device, ring, timeout):
+        self.device = device
+        self.ring = ring
+        self.timeout = timeout
+        self.head = ring.head()
+        self.errors = 0
+
+    def error(self, scenario, message):
+        print("%s: %s" % (scenario, message), file=sys.stderr)
+        self.errors += 1
+
+    # Sends the reports, then expects exactly these frames in the ring, and these fragments acked.
+    def run(self, scenario, reports, frames, acked):
+        self.device.acks.clear()
+        for report in reports:
+            self.device.reports.put(report)
+        self.device.drain(self.timeout)
+
+        errors = self.errors
+        head = self.ring.head()
+        if head != self.head + len(frames):
+            self.error(scenario, "head %d, expected %d" % (head, self.head + len(frames)))
+
+        for number, expected in enumerate(frames, self.head):
+            # Older frames were overwritten, only the last slot_count can be checked.
+            if number + self.ring.slot_count < head:
+                continue
+
+            sequence, length, kind, complete, data = self.ring.frame(number)
+            if sequence != number + 1:
+                self.error(scenario, "frame %d has sequence %d, expected %d" % (number, sequence, number + 1))
+            if (kind, length, complete) != expected[:3]:
+                self.error(scenario, "frame %d is type %02x length %d complete %d, expected type %02x length %d complete %d"
+                           % ((number, kind, length, complete) + expected[:3]))
+            elif data != expected[3]:
+                self.error(scenario, "frame %d has the wrong data" % number)
+
+        # Acks come in order, and only for fragments the driver took.
+        acks = self.device.acks
+        position = 0
+        for ack in acks:
+            while position < len(acked) and acked[position] != ack:
+                position += 1
+            if position == len(acked):
+                self.error(scenario, "acks %s are not in %s" % (acks, acked))
+                break
+            position += 1
+
+        if acked and (not acks or acks[-1] != acked[-1]):
+            self.error(scenario, "last ack %s, expected %d" % (acks[-1] if acks else "none", acked[-1]))
+        if not acked and acks:
+            self.error(scenario, "acks %s, expected none" % acks)
+
+        self.head = head
+        self.ring.set_tail(head)
+        print("%-12s %s" % (scenario, "ok" if self.errors == errors else "failed"))
+
+
+def find_controller(proc, mac, timeout):
+    pattern = re.compile(r"\bmac=%s\b" % re.escape(format_mac(mac)))
+    deadline = time.monotonic() + timeout
+
+    while time.monotonic() < deadline:
+        for path in glob.glob(os.path.join(proc, "controller*", "state")):
+            try:
+                with open(path) as f:
+                    if pattern.search(f.read()):
+                        return os.path.dirname(path)
+            except OSError:
+                continue
+
+        time.sleep(0.01)
+
+    return None
+
+
+def set_mode(device, directory, mode, mode_byte, timeout):
+    with open(os.path.join(directory, "mcu"), "w") as f:
+        f.write(mode)
+
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        if device.mcu_state == 0x01 and device.mcu_mode == mode_byte and device.report_mode == 0x31:
+            return True
+        time.sleep(0.01)
+
+    print("%s: MCU state %s mode %s report mode %s" % (mode, device.mcu_state, device.mcu_mode, device.report_mode),
+          file=sys.stderr)
+    return False
+
+
+def run_scenarios(args, device, directory):
+    fragments = args.fragments
+    last = fragments - 1
+    everything = list(range(fragments))
+
+    if not set_mode(device, directory, "ir fragments=%d" % fragments, MCU_MODE_IR, args.timeout):
+        return 1
+
+    ring = Ring(os.path.join(directory, "mcu_frames"))
+    checker = Checker(device, ring, args.timeout)
+
+    checker.run("complete", [ir_report(1, f) for f in everything], [ir_image(1, fragments, everything)], everything)
+
+    # Missing fragments are left zero and the image is not complete.
+    received = [f for f in everything if f % 3 != 1 or f == last]
+    checker.run("gaps", [ir_report(2, f) for f in received], [ir_image(2, fragments, received)], received)
+
+    # Fragment 0 in the middle of an image ends the image before it.
+    half = everything[:fragments // 2]
+    checker.run("restart", [ir_report(3, f) for f in half] + [ir_report(4, f) for f in everything],
+                [ir_image(3, fragments, half), ir_image(4, fragments, everything)], half + everything)
+
+    # Fragments past the end of the image are dropped, and not acked.
+    checker.run("range", [ir_report(5, f) for f in half] + [ir_report(5, fragments)]
+                + [ir_report(5, f) for f in everything[fragments // 2:]],
+                [ir_image(5, fragments, everything)], everything)
+
+    # Slower than the ring, the head keeps counting and the newest frames are intact.
+    images = list(range(6, 6 + ring.slot_count + 1))
+    checker.run("wrap", [ir_report(image, f) for image in images for f in everything],
+                [ir_image(image, fragments, everything) for image in images], everything * len(images))
+
+    if not set_mode(device, directory, "nfc", MCU_MODE_NFC, args.timeout):
+        ring.close()
+        return 1
+
+    # Tag state and tag data go up as they are, IR fragments are not taken in NFC mode.
+    state = nfc_report(MCU_REPORT_NFC_STATE, 0x10).ljust(MCU_DATA_LENGTH, b"\0")
+    read = nfc_report(MCU_REPORT_NFC_READ, 0x20).ljust(MCU_DATA_LENGTH, b"\0")
+    checker.run("nfc", [state, ir_report(1, 0), read],
+                [(MCU_REPORT_NFC_STATE, MCU_DATA_LENGTH, 1, state), (MCU_REPORT_NFC_READ, MCU_DATA_LENGTH, 1, read)], [])
+
+    with open(os.path.join(directory, "mcu"), "w") as f:
+        f.write("off")
+
+    ring.close()
+    return 1 if checker.errors else 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description="MCU frames of hid-procon with a virtual controller.")
+    parser.add_argument("--fragments", type=int, default=8, help="fragments in one IR image, from 2 to 255")
+    parser.add_argument("--timeout", type=float, default=5.0, help="seconds to wait for each step")
+    parser.add_argument("--proc", default="/proc/procon", help="proc directory of the driver")
+    args = parser.parse_args()
+
+    # Fragment numbers are a byte, one past the last has to fit for the range check.
+    if not 2 <= args.fragments <= 255:
+        parser.error("--fragments has to be from 2 to 255")
+
+    device = McuProCon(0, bytes([0x98, 0xB6, 0xE9, 0x4D, 0xC0, 0x31]))
+    device.thread.start()
+    device.streamer.start()
+    device.create()
+
+    try:
+        directory = find_controller(args.proc, device.mac, args.timeout)
+        if directory is None:
+            print("the controller never showed up in %s" % args.proc, file=sys.stderr)
+            return 1
+
+        return run_scenarios(args, device, directory)
+    finally:
+        device.destroy()
+        device.streamer.join()
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,171 @@
+#!/usr/bin/env python3
+# Connects and disconnects virtual Pro Controllers through uhid, all at once, and reports how long
+# each phase of the probe took, from the debugfs probe file of every controller.
+#
+# Needs root, the hid-procon module loaded, hid_nintendo unloaded so it does not take the
+# controllers, and debugfs mounted. Each virtual controller, from procon_uhid.py, answers the
+# handshake and subcommands like a real one would over Bluetooth.
+#
+# All uhid devices share a parent, so the driver paces them as controllers on one adapter.
+# With --usb they are created as wired controllers instead. Every output report then has to come
+# as a full 64 byte frame, and the handshake has to include the USB only status and force USB
+# steps, both are checked. Wired controllers have a serial number as uniq, so they never hit the cache.
+#
+# Each controller uses its MAC address as the uniq of its HID device, which is what the cache
+# looks up. A controller that keeps its MAC address between rounds is found in the cache from
+# the second round on and skips reading flash, use --cold to give them a new one every round.
+
+import argparse
+import glob
+import os
+import sys
+import threading
+import time
+
+from procon_uhid import BUS_BLUETOOTH, BUS_USB, REPORT_LENGTH, VirtualProCon
+
+# The raw 0x80 steps procon_init_device() sends, by bus.
+HANDSHAKE = {
+    BUS_BLUETOOTH: [0x02, 0x03, 0x02],
+    BUS_USB: [0x01, 0x02, 0x03, 0x02, 0x04],
+}
+
+PHASES = ["slot", "parse", "hw_start", "hw_open", "handshake", "subcommands", "input", "proc", "probe", "usable"]
+
+
+def read_probe_files(debugfs):
+    results = {}
+
+    for path in glob.glob(os.path.join(debugfs, "controller*", "probe")):
+        try:
+            with open(path) as f:
+                lines = [line.split() for line in f]
+        except OSError:
+            continue
+
+        fields = {line[0]: line[1:] for line in lines if line and line[0] != "subcommand"}
+        if "device" in fields and fields["device"]:
+            results[fields["device"][0]] = fields
+
+    return results
+
+
+def percentile(values, percent):
+    values = sorted(values)
+    return values[max(0, -(-len(values) * percent // 100) - 1)]
+
+
+def run_round(args, number, stats):
+    devices = []
+    for i in range(args.count):
+        mac_round = number if args.cold else 0
+        mac = bytes([0x98, 0xB6, mac_round >> 8 & 0xFF, mac_round & 0xFF, i >> 8 & 0xFF, i & 0xFF])
+        devices.append(VirtualProCon(i, mac, args.bus, "procon-bench"))
+
+    for device in devices:
+        device.thread.start()
+
+    # Connect them all at the same time.
+    for device in devices:
+        device.create()
+
+    waiting = {device.uniq: device for device in devices}
+    deadline = time.monotonic() + args.timeout
+
+    while waiting and time.monotonic() < deadline:
+        probes = read_probe_files(args.debugfs)
+
+        for uniq, fields in probes.items():
+            if uniq not in waiting or fields.get("usable", ["-"])[0] == "-":
+                continue
+
+            device = waiting.pop(uniq)
+            stats.setdefault("connect", []).append((time.monotonic() - device.created) * 1000000)
+
+            for phase in PHASES:
+                if phase in fields:
+                    stats.setdefault(phase, []).append(int(fields[phase][0]))
+
+            # Subcommands the driver gave up on without a reply.
+            if "missed" in fields:
+                stats["missed"] = stats.get("missed", 0) + int(fields["missed"][0])
+
+        time.sleep(0.005)
+
+    if waiting:
+        print("round %d: %d of %d controllers never became usable" % (number, len(waiting), args.count), file=sys.stderr)
+        stats["failed"] = stats.get("failed", 0) + len(waiting)
+
+    # And disconnect them all at once.
+    start = time.monotonic()
+    threads = [threading.Thread(target=device.destroy) for device in devices]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+
+    while read_probe_files(args.debugfs) and time.monotonic() < start + args.timeout:
+        time.sleep(0.005)
+    stats.setdefault("disconnect", []).append((time.monotonic() - start) * 1000000)
+
+    # The resyncs of the watchdog repeat the handshake later, only the start has to match.
+    for device in devices:
+        expected = HANDSHAKE[args.bus]
+        if device.handshake[:len(expected)] != expected:
+            print("round %d: controller %d got handshake %s, expected %s" % (number, device.index,
+                  " ".join("%02x" % step for step in device.handshake), " ".join("%02x" % step for step in expected)),
+                  file=sys.stderr)
+            stats["protocol_errors"] = stats.get("protocol_errors", 0) + 1
+
+        if device.short_frames:
+            print("round %d: controller %d got %d output reports shorter than %d bytes" % (number, device.index,
+                  device.short_frames, REPORT_LENGTH), file=sys.stderr)
+            stats["protocol_errors"] = stats.get("protocol_errors", 0) + 1
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Probe and hotplug timing of hid-procon with virtual controllers.")
+    parser.add_argument("-n", "--count", type=int, default=8, help="controllers connected at once")
+    parser.add_argument("-r", "--rounds", type=int, default=5, help="times to connect and disconnect them")
+    parser.add_argument("--cold", action="store_true", help="a new MAC address every round, so nothing is cached")
+    parser.add_argument("--usb", dest="bus", action="store_const", const=BUS_USB, default=BUS_BLUETOOTH,
+                        help="connect them as wired controllers")
+    parser.add_argument("--timeout", type=float, default=10.0, help="seconds to wait for the controllers of a round")
+    parser.add_argument("--debugfs", default="/sys/kernel/debug/procon", help="debugfs directory of the driver")
+    args = parser.parse_args()
+
+    if not os.path.isdir(args.debugfs):
+        print("%s does not exist, is the module loaded and debugfs mounted?" % args.debugfs, file=sys.stderr)
+        return 1
+
+    stats = {}
+    for number in range(args.rounds):
+        run_round(args, number, stats)
+
+    # Probe phases as the driver measured them. Connect is from UHID_CREATE2 until the probe file
+    # showed the controller usable, disconnect is for the whole round, all in microseconds.
+    print("%-12s %6s %10s %10s %10s %10s %10s" % ("phase", "n", "min", "p50", "p90", "p99", "max"))
+    for phase in PHASES + ["connect", "disconnect"]:
+        values = stats.get(phase)
+        if not values:
+            continue
+
+        print("%-12s %6d %10d %10d %10d %10d %10d" % (phase, len(values), min(values), percentile(values, 50),
+              percentile(values, 90), percentile(values, 99), max(values)))
+
+    if stats.get("missed"):
+        print("missed subcommands %d" % stats["missed"])
+
+    if stats.get("protocol_errors"):
+        print("protocol errors %d" % stats["protocol_errors"])
+        return 1
+
+    if stats.get("failed"):
+        print("failed %d" % stats["failed"])
+        return 1
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,166 @@
+# A Pro Controller emulated through uhid, shared by the tools that test hid-procon with it.
+#
+# It answers the handshake and the subcommands the driver sends like a real one would, and
+# keeps track of what came in, so a tool can check the driver sent what it should.
+
+import os
+import select
+import struct
+import threading
+import time
+
+UHID_DESTROY = 1
+UHID_START = 2
+UHID_OUTPUT = 6
+UHID_CREATE2 = 11
+UHID_INPUT2 = 12
+
+UHID_DATA_MAX = 4096
+HID_MAX_DESCRIPTOR_SIZE = 4096
+UHID_EVENT_SIZE = 4 + 128 + 64 + 64 + 2 + 2 + 4 * 4 + HID_MAX_DESCRIPTOR_SIZE
+
+BUS_USB = 0x03
+BUS_BLUETOOTH = 0x05
+VENDOR_NINTENDO = 0x057E
+DEVICE_PROCON = 0x2009
+
+# Vendor defined reports with the IDs the controller uses, hid_input_report() drops any other.
+# The 0x31 reports are the full ones with the MCU data after them, 361 bytes after the ID.
+REPORT_DESCRIPTOR = bytes([
+    0x06, 0x01, 0xFF,              # Usage Page (Vendor 0xFF01)
+    0x09, 0x01,                    # Usage (0x01)
+    0xA1, 0x01,                    # Collection (Application)
+    0x15, 0x00, 0x26, 0xFF, 0x00,  #   Logical Minimum (0), Logical Maximum (255)
+    0x75, 0x08,                    #   Report Size (8)
+    0x85, 0x21, 0x09, 0x21, 0x95, 0x3F, 0x81, 0x02,  # Input 0x21, subcommand replies
+    0x85, 0x30, 0x09, 0x30, 0x95, 0x3F, 0x81, 0x02,  # Input 0x30, full reports
+    0x85, 0x31, 0x09, 0x31, 0x96, 0x69, 0x01, 0x81, 0x02,  # Input 0x31, full reports with MCU data
+    0x85, 0x3F, 0x09, 0x3F, 0x95, 0x0B, 0x81, 0x02,  # Input 0x3F, simple reports
+    0x85, 0x81, 0x09, 0x81, 0x95, 0x3F, 0x81, 0x02,  # Input 0x81, handshake replies
+    0x85, 0x01, 0x09, 0x01, 0x95, 0x3F, 0x91, 0x02,  # Output 0x01, subcommands
+    0x85, 0x10, 0x09, 0x10, 0x95, 0x3F, 0x91, 0x02,  # Output 0x10, rumble
+    0x85, 0x11, 0x09, 0x11, 0x95, 0x3F, 0x91, 0x02,  # Output 0x11, MCU requests and acks
+    0x85, 0x80, 0x09, 0x80, 0x95, 0x3F, 0x91, 0x02,  # Output 0x80, handshake
+    0xC0,                          # End Collection
+])
+
+REPORT_LENGTH = 64
+
+
+def encode_stick(x, y):
+    return bytes([x & 0xFF, ((x >> 8) & 0xF) | ((y & 0xF) << 4), (y >> 4) & 0xFF])
+
+
+def le16(values):
+    return b"".join(struct.pack("<h", v) for v in values)
+
+
+# What the controller has in flash, as far as the driver reads it.
+FLASH = {
+    0x5000: bytes([0x00]),
+    0x603D: encode_stick(1400, 1400) + encode_stick(2048, 2048) + encode_stick(1400, 1400)
+          + encode_stick(2048, 2048) + encode_stick(1400, 1400) + encode_stick(1400, 1400),
+    0x6020: le16([0, 0, 0]) + le16([16384, 16384, 16384]) + le16([0, 0, 0]) + le16([13371, 13371, 13371]),
+}
+
+
+def format_mac(mac):
+    return ":".join("%02x" % b for b in mac)
+
+
+class VirtualProCon:
+    def __init__(self, index, mac, bus=BUS_BLUETOOTH, name="procon-uhid"):
+        self.index = index
+        self.mac = mac
+        self.bus = bus
+        self.name = name
+        self.uniq = format_mac(mac) if bus == BUS_BLUETOOTH else "%012x" % index
+        self.timer = 0
+        self.report_mode = None
+        self.handshake = []
+        self.short_frames = 0
+        self.fd = os.open("/dev/uhid", os.O_RDWR)
+        self.created = None
+        self.stop = threading.Event()
+        self.thread = threading.Thread(target=self.run, daemon=True)
+
+    def write_event(self, kind, payload):
+        event = struct.pack("<I", kind) + payload
+        os.write(self.fd, event.ljust(UHID_EVENT_SIZE, b"\0"))
+
+    def create(self):
+        payload = struct.pack("<128s64s64sHHIIII", b"Virtual Pro Controller", self.name.encode(),
+                              self.uniq.encode(), len(REPORT_DESCRIPTOR), self.bus,
+                              VENDOR_NINTENDO, DEVICE_PROCON, 0, 0)
+        self.created = time.monotonic()
+        self.write_event(UHID_CREATE2, payload + REPORT_DESCRIPTOR)
+
+    def destroy(self):
+        self.stop.set()
+        self.write_event(UHID_DESTROY, b"")
+        self.thread.join()
+        os.close(self.fd)
+
+    def send_input(self, data, length=REPORT_LENGTH):
+        data = data.ljust(length, b"\0")
+        self.write_event(UHID_INPUT2, struct.pack("<H", len(data)) + data)
+
+    # Report ID, timer, battery and connection, buttons, both sticks and the vibrator byte.
+    def input_header(self, report_id):
+        self.timer = (self.timer + 1) & 0xFF
+        return bytes([report_id, self.timer, 0x8E, 0, 0, 0]) + encode_stick(2048, 2048) * 2 + bytes([0x00])
+
+    def reply(self, ack, subcommand, data):
+        self.send_input(self.input_header(0x21) + bytes([ack, subcommand]) + data)
+
+    # Subclasses answer what they emulate on top, and return True when they did.
+    def handle_subcommand(self, subcommand, args):
+        return False
+
+    def handle_mcu(self, data):
+        pass
+
+    def handle_output(self, data):
+        if self.bus == BUS_USB and len(data) != REPORT_LENGTH:
+            self.short_frames += 1
+
+        if data[0] == 0x80:
+            self.handshake.append(data[1])
+            self.send_input(bytes([0x81, data[1]]))
+        elif data[0] == 0x01:
+            subcommand = data[10]
+            args = data[11:]
+
+            if self.handle_subcommand(subcommand, args):
+                return
+
+            if subcommand == 0x02:
+                # Firmware 3.139, a Pro Controller, its MAC and colours from flash.
+                self.reply(0x82, subcommand, bytes([0x03, 0x8B, 0x03, 0x02]) + self.mac + bytes([0x01, 0x01]))
+            elif subcommand == 0x10:
+                address = struct.unpack("<I", args[0:4])[0]
+                length = args[4]
+                content = FLASH.get(address, b"").ljust(length, b"\xFF")[:length]
+                self.reply(0x90, subcommand, args[0:5] + content)
+            else:
+                if subcommand == 0x03:
+                    self.report_mode = args[0]
+
+                self.reply(0x80, subcommand, b"")
+        elif data[0] == 0x11:
+            self.handle_mcu(data)
+
+        # Rumble only reports get no reply.
+
+    def run(self):
+        while not self.stop.is_set():
+            ready, _, _ = select.select([self.fd], [], [], 0.1)
+            if not ready:
+                continue
+
+            event = os.read(self.fd, UHID_EVENT_SIZE)
+            kind = struct.unpack_from("<I", event)[0]
+
+            if kind == UHID_OUTPUT:
+                size = struct.unpack_from("<H", event, 4 + UHID_DATA_MAX)[0]
+                self.handle_output(event[4:4 + size])